@@ -24,6 +24,7 @@
 #include <gtsam/slam/PriorFactor.h>
 
 #include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/OptimizerResync.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <pose_graph_msgs/PoseGraphEdge.h>
 #include <pose_graph_msgs/PoseGraphNode.h>
@@ -42,6 +43,7 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/OptimizerInput.h>
 #include <lamp_utils/PoseGraph.h>
 #include <lamp_utils/PrefixHandling.h>
 
@@ -102,6 +104,10 @@ protected:
   bool PublishPoseGraph(bool b_publish_incremental = true);
   bool PublishPoseGraphForOptimizer();
 
+  // The optimizer missed changes, the next input carries the whole graph
+  void OptimizerResyncCallback(
+      const pose_graph_msgs::OptimizerResync::ConstPtr& msg);
+
   // Generate map from keyed scans
   bool ReGenerateMapPointCloud();
   bool CombineKeyedScansWorld(PointCloud* points);
@@ -133,11 +139,13 @@ protected:
   ros::Publisher pose_graph_pub_;
   ros::Publisher pose_graph_incremental_pub_;
   ros::Publisher pose_graph_to_optimize_pub_;
+  ros::Publisher optimizer_input_pub_;
   ros::Publisher keyed_scan_pub_;
 
   // Subscribers
   ros::Subscriber back_end_pose_graph_sub_;
   ros::Subscriber laser_loop_closure_sub_;
+  ros::Subscriber optimizer_resync_sub_;
 
   // Services
 
@@ -156,6 +164,9 @@ protected:
   // Frames.
   std::string base_frame_id_;
 
+  // What of the pose graph the optimizer was sent
+  lamp_utils::OptimizerInputTracker optimizer_input_;
+
   // Pose graph merger
   Merger merger_;
 
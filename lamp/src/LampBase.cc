@@ -347,25 +347,37 @@ bool LampBase::PublishPoseGraph(bool b_publish_incremental) {
 }
 
 bool LampBase::PublishPoseGraphForOptimizer() {
-  // TODO incremental publishing instead of full graph?
-
-  // Convert master pose-graph to messages
-  pose_graph_msgs::PoseGraphConstPtr g = pose_graph_.ToMsg();
-
-  // ROS_DEBUG_STREAM("Publishing pose graph for optimizer with "
-  //                 << g->nodes.size() << " nodes and " << g->edges.size()
-  //                 << " edges");
-  for (auto v : g->nodes) {
-    ROS_DEBUG_STREAM(
-        "PublishedPGForOptimizer Key : " << gtsam::DefaultKeyFormatter(v.key));
+  // Changes since the previous input
+  pose_graph_msgs::OptimizerInput::Ptr input =
+      optimizer_input_.Update(pose_graph_);
+  ROS_DEBUG_STREAM("Publishing " << (input->full ? "full " : "")
+                                 << "optimizer input " << input->epoch << "/"
+                                 << input->sequence << " with "
+                                 << input->nodes.size() << " nodes, "
+                                 << input->edges.size() << " edges and "
+                                 << input->removed_edges.size()
+                                 << " removed edges");
+  optimizer_input_pub_.publish(input);
+
+  // Full graph only for whoever still listens to it (e.g. recordings)
+  if (pose_graph_to_optimize_pub_.getNumSubscribers() > 0) {
+    pose_graph_msgs::PoseGraphConstPtr g = pose_graph_.ToMsg();
+    pose_graph_to_optimize_pub_.publish(*g);
   }
 
-  // Publish
-  pose_graph_to_optimize_pub_.publish(*g);
-
   return true;
 }
 
+void LampBase::OptimizerResyncCallback(
+    const pose_graph_msgs::OptimizerResync::ConstPtr& msg) {
+  ROS_WARN_STREAM("Optimizer requested a "
+                  << (msg->rebuild ? "rebuild" : "resync") << " at input "
+                  << msg->epoch << "/" << msg->sequence
+                  << ", sending the full graph");
+  optimizer_input_.RequestFull(msg->rebuild);
+  PublishPoseGraphForOptimizer();
+}
+
 // Placeholder function to used fixed covariances while proper covariances are
 // being developed
 gtsam::SharedNoiseModel LampBase::SetFixedNoiseModels(std::string type) {
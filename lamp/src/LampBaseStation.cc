@@ -115,6 +115,12 @@ bool LampBaseStation::RegisterCallbacks(const ros::NodeHandle& n) {
                    &LampBaseStation::LaserLoopClosureCallback,
                    dynamic_cast<LampBase*>(this));
 
+  optimizer_resync_sub_ =
+      nl.subscribe("optimizer_resync",
+                   10,
+                   &LampBaseStation::OptimizerResyncCallback,
+                   dynamic_cast<LampBase*>(this));
+
   remove_robot_sub_ = nl.subscribe("remove_robot_from_graph",
                                    1,
                                    &LampBaseStation::RemoveRobotCallback,
@@ -136,6 +142,8 @@ bool LampBaseStation::CreatePublishers(const ros::NodeHandle& n) {
   // Base station publishers
   pose_graph_to_optimize_pub_ = nl.advertise<pose_graph_msgs::PoseGraph>(
       "pose_graph_to_optimize", 10, true);
+  optimizer_input_pub_ = nl.advertise<pose_graph_msgs::OptimizerInput>(
+      "optimizer_input", 100, true);
   lamp_pgo_reset_pub_ = nl.advertise<std_msgs::Bool>("reset_pgo", 10, true);
 
   // Robot pose publishers
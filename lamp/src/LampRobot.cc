@@ -190,6 +190,11 @@ bool LampRobot::RegisterCallbacks(const ros::NodeHandle& n) {
                                          &LampRobot::LaserLoopClosureCallback,
                                          dynamic_cast<LampBase*>(this));
 
+  optimizer_resync_sub_ = nl.subscribe("optimizer_resync",
+                                       10,
+                                       &LampRobot::OptimizerResyncCallback,
+                                       dynamic_cast<LampBase*>(this));
+
   return true;
 }
 
@@ -203,6 +208,8 @@ bool LampRobot::CreatePublishers(const ros::NodeHandle& n) {
   // Pose Graph publishers
   pose_graph_to_optimize_pub_ = nl.advertise<pose_graph_msgs::PoseGraph>(
       "pose_graph_to_optimize", 10, true);
+  optimizer_input_pub_ = nl.advertise<pose_graph_msgs::OptimizerInput>(
+      "optimizer_input", 100, true);
   keyed_scan_pub_ =
       nl.advertise<pose_graph_msgs::KeyedScan>("keyed_scans", 10, true);
 
@@ -7,7 +7,12 @@ Interface for ROS and KimeraRPGO
 #ifndef LAMP_PGO_H_
 #define LAMP_PGO_H_
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <gtsam/nonlinear/Marginals.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
@@ -18,13 +23,44 @@ Interface for ROS and KimeraRPGO
 #include <std_msgs/Bool.h>
 #include <std_msgs/String.h>
 
+#include <pose_graph_msgs/OptimizerInput.h>
+#include <pose_graph_msgs/OptimizerResync.h>
+#include <pose_graph_msgs/OptimizerStatus.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <pose_graph_msgs/PoseGraphEdge.h>
+#include <pose_graph_msgs/PoseGraphNode.h>
 
+#include <lamp_utils/OptimizerInput.h>
 #include <lamp_utils/PrefixHandling.h>
 
 #include "KimeraRPGO/RobustSolver.h"
 
+typedef pose_graph_msgs::PoseGraphNode::_covariance_type NodeCovariance;
+
+// Marginal covariances to recover from a snapshot of the optimized graph
+struct CovarianceJob {
+  gtsam::NonlinearFactorGraph nfg;
+  gtsam::Values values;
+  gtsam::KeyVector keys;
+  // Solver resets before the job was queued, its results are dropped after
+  // another one
+  uint64_t num_resets = 0;
+};
+
+// Inputs received while the solver was busy, given to it at once
+struct PendingInput {
+  // Start over from an empty solver
+  bool reset = false;
+  // The edges are the whole graph, the ones given before and missing from it
+  // were removed
+  bool full = false;
+  std::vector<pose_graph_msgs::PoseGraphNode> nodes;
+  std::vector<pose_graph_msgs::PoseGraphEdge> edges;
+  std::vector<pose_graph_msgs::PoseGraphEdge> removed_edges;
+  size_t num_inputs = 0;
+  ros::WallTime first_received;
+};
+
 class LampPgo {
  public:
   // constructor destructor
@@ -37,6 +73,8 @@ class LampPgo {
   // define publishers and subscribers
   ros::Publisher optimized_pub_;
   ros::Publisher ignored_list_pub_;
+  ros::Publisher resync_pub_;
+  ros::Publisher status_pub_;
 
   ros::Subscriber input_sub_;
 
@@ -50,10 +88,71 @@ class LampPgo {
   // reset subscriber
   ros::Subscriber reset_sub_;
 
-  void PublishValues() const;
+  // Publishes the optimized values with the covariances recovered so far and
+  // queues the recovery of the ones that changed: all of them, or only the
+  // new nodes if the graph was only extended by odometry
+  void PublishValues(bool b_odometry_only = false);
+
+  // Publishes values_ and nfg_ with the covariances recovered so far. Called
+  // with solver_mutex_ held, also once a covariance job is done.
+  void PublishGraph();
 
+  // Queues the covariance recovery of keys, or of the new nodes
+  // (covariance_keys_) and the keys never recovered among them if not
+  // b_all_keys. Takes over the keys of a queued job that hasn't started.
+  void QueueCovarianceRecovery(const gtsam::KeyVector& keys, bool b_all_keys);
+
+  void CovarianceLoop();
+
+  static std::unordered_map<gtsam::Key, NodeCovariance> RecoverCovariances(
+      const CovarianceJob& job);
+
+  // Takes full graphs as well as incremental ones (graph_msg->incremental)
   void InputCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
 
+  // Changes of the graph since the previous input (see
+  // pose_graph_msgs/OptimizerInput). Asks for the full graph when one is
+  // missed or can't be applied.
+  void OptimizerInputCallback(
+      const pose_graph_msgs::OptimizerInput::ConstPtr& input);
+
+  // Wakes up the optimization thread for pending_input_ (input_mutex_ held)
+  void AddPendingInput();
+
+  // Gives the pending inputs to the solver, one update for all of them
+  void OptimizationLoop();
+
+  // Only the nodes and edges not seen before are converted and added. Returns
+  // the path taken (OptimizerStatus::ROBUST or INCREMENTAL).
+  uint8_t
+  AddAndOptimize(const std::vector<pose_graph_msgs::PoseGraphNode>& nodes,
+                 const std::vector<pose_graph_msgs::PoseGraphEdge>& edges);
+
+  // Whether the factors only chain the new values to the graph by odometry,
+  // one factor per new value
+  bool IsOdometryExtension(const gtsam::NonlinearFactorGraph& factors,
+                           const gtsam::Values& new_values) const;
+
+  // Estimates of the new values of an odometry extension, composed from the
+  // estimates of the nodes they extend. The optimum of the extended graph
+  // keeps the older estimates, the new factors have no error at these.
+  gtsam::Values ComposeOdometry(
+      const gtsam::NonlinearFactorGraph& factors) const;
+
+  // Gives the robust solver the odometry it hasn't seen yet, before it is
+  // used otherwise
+  void FlushOdometry();
+
+  // Forgets edges removed from the input graph. False if the solver still
+  // uses some of them, it can't remove them.
+  bool ForgetRemovedEdges(
+      const std::vector<pose_graph_msgs::PoseGraphEdge>& removed_edges);
+
+  // input_mutex_ held
+  void RequestResync(bool rebuild);
+
+  void ResetSolver();
+
   void RemoveLCByIdCallback(const std_msgs::String::ConstPtr& msg);
 
   void RemoveLCCallback(const std_msgs::Bool::ConstPtr& msg);
@@ -71,13 +170,53 @@ class LampPgo {
   void PublishIgnoredList() const;
 
  private:
+  // Held by whoever uses the solver and its results (values_, nfg_,
+  // added_factors_, ...): the optimization thread and the other callbacks
+  std::mutex solver_mutex_;
+
   // Optimizer parameters
   KimeraRPGO::RobustSolverParams rpgo_params_;
   std::unique_ptr<KimeraRPGO::RobustSolver> pgo_solver_;  // actual solver
 
   gtsam::Values values_;
   gtsam::NonlinearFactorGraph nfg_;
-  gtsam::NonlinearFactorGraph nfg_all_;
+
+  // Odometry only updates are composed onto values_ instead of optimized.
+  // The robust solver gets their factors and values with its next update.
+  bool b_compose_odometry_;
+  gtsam::NonlinearFactorGraph unsolved_factors_;
+  gtsam::Values unsolved_values_;
+  // Every edge given to the solver (including the ones it rejected)
+  lamp_utils::FactorIdSet added_factors_;
+
+  // Take OptimizerInput changes instead of full graphs
+  bool b_incremental_input_;
+  // Inputs not yet given to the solver, the input state below and
+  // pending_input_ are guarded by input_mutex_
+  std::thread optimization_thread_;
+  std::mutex input_mutex_;
+  std::condition_variable input_cv_;
+  PendingInput pending_input_;
+  bool b_stop_optimization_ = false;
+  // Epoch and sequence number of the next input expected
+  uint64_t input_epoch_ = 0;
+  uint64_t input_sequence_ = 0;
+  // A full input is due, the changes until then are dropped
+  bool b_input_synced_ = false;
+  bool b_resync_requested_ = false;
+
+  // Recover the covariance of every key rather than the changed ones
+  bool b_covariance_all_keys_;
+  // New nodes since the previous recovery
+  std::unordered_set<gtsam::Key> covariance_keys_;
+  // Recovered in the background by covariance_thread_, last ones per key
+  std::thread covariance_thread_;
+  std::mutex covariance_mutex_;
+  std::condition_variable covariance_cv_;
+  std::unique_ptr<CovarianceJob> covariance_job_;
+  std::unordered_map<gtsam::Key, NodeCovariance> covariances_;
+  uint64_t num_resets_ = 0;
+  bool b_stop_covariance_ = false;
 
   // Parameter namespace ("robot" or "base")
   std::string param_ns_;
@@ -92,6 +231,9 @@ class LampPgo {
 
   // Max loop closure factor error
   double max_lc_error_;
+
+  // Test class fixtures
+  friend class TestLampPgo;
 };
 
 #endif  // LAMP_PGO_H_
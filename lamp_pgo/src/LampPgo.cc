@@ -6,12 +6,16 @@ Interface for ROS and KimeraRPGO
 
 #include "lamp_pgo/LampPgo.h"
 
+#include <algorithm>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <gtsam/geometry/Point3.h>
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/geometry/Rot3.h>
+#include <gtsam/slam/BetweenFactor.h>
 
 #include <parameter_utils/ParameterUtils.h>
 #include <lamp_utils/CommonFunctions.h>
@@ -24,7 +28,22 @@ using gtsam::Values;
 namespace pu = parameter_utils;
 
 LampPgo::LampPgo() {}
-LampPgo::~LampPgo() {}
+LampPgo::~LampPgo() {
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    b_stop_optimization_ = true;
+  }
+  input_cv_.notify_all();
+  if (optimization_thread_.joinable())
+    optimization_thread_.join();
+  {
+    std::lock_guard<std::mutex> lock(covariance_mutex_);
+    b_stop_covariance_ = true;
+  }
+  covariance_cv_.notify_all();
+  if (covariance_thread_.joinable())
+    covariance_thread_.join();
+}
 
 bool LampPgo::Initialize(const ros::NodeHandle& n) {
   // Create subscriber and publisher
@@ -37,10 +56,13 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
   // "back_end_pose_graph"(lamp)
   ignored_list_pub_ =
       nl.advertise<std_msgs::String>("ignored_robots", 10, true);
+  // Latched, so a request made before the sender connects isn't lost
+  resync_pub_ = nl.advertise<pose_graph_msgs::OptimizerResync>(
+      "optimizer_resync", 10, true);
+  status_pub_ = nl.advertise<pose_graph_msgs::OptimizerStatus>(
+      "optimizer_status", 10, false);
 
   // Subscriber
-  input_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
-      "pose_graph_to_optimize", 1, &LampPgo::InputCallback, this);
   remove_lc_sub_ = nl.subscribe<std_msgs::Bool>(
       "remove_loop_closure", 1, &LampPgo::RemoveLCCallback, this);
   remove_lc_by_id_sub_ = nl.subscribe<std_msgs::String>(
@@ -105,6 +127,12 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
 
   if (!pu::Get(param_ns_ + "/max_lc_error", max_lc_error_))
     return false;
+  if (!pu::Get(param_ns_ + "/b_incremental_input", b_incremental_input_))
+    return false;
+  if (!pu::Get(param_ns_ + "/b_covariance_all_keys", b_covariance_all_keys_))
+    return false;
+  if (!pu::Get(param_ns_ + "/b_compose_odometry", b_compose_odometry_))
+    return false;
 
   std::string log_path;
   if (pu::Get("log_path", log_path)) {
@@ -113,6 +141,17 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
   }
   // Initialize solver
   pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
+  covariance_thread_ = std::thread(&LampPgo::CovarianceLoop, this);
+  optimization_thread_ = std::thread(&LampPgo::OptimizationLoop, this);
+
+  // Input, only queued for the optimization thread by the callbacks
+  if (b_incremental_input_) {
+    input_sub_ = nl.subscribe<pose_graph_msgs::OptimizerInput>(
+        "optimizer_input", 100, &LampPgo::OptimizerInputCallback, this);
+  } else {
+    input_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+        "pose_graph_to_optimize", 10, &LampPgo::InputCallback, this);
+  }
 
   // Publish ignored list once
   PublishIgnoredList();
@@ -121,6 +160,8 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
 }
 
 void LampPgo::RemoveLastLoopClosure(char prefix_1, char prefix_2) {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushOdometry();
   KimeraRPGO::EdgePtr removed_edge =
       pgo_solver_->removeLastLoopClosure(prefix_1, prefix_2);
   if (removed_edge != NULL) {
@@ -141,6 +182,8 @@ void LampPgo::RemoveLastLoopClosure(char prefix_1, char prefix_2) {
 }
 
 void LampPgo::RemoveLastLoopClosure() {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushOdometry();
   KimeraRPGO::EdgePtr removed_edge = pgo_solver_->removeLastLoopClosure();
   if (removed_edge != NULL) {
     // Extract the optimized values
@@ -174,73 +217,284 @@ void LampPgo::RemoveLCCallback(const std_msgs::Bool::ConstPtr& msg) {
 
 void LampPgo::ResetCallback(const std_msgs::Bool::ConstPtr& msg) {
   if (msg->data) {
-    // Re-initialize solver
-    pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
-    values_ = Values();
-    nfg_ = NonlinearFactorGraph();
-    nfg_all_ = NonlinearFactorGraph();
+    std::lock_guard<std::mutex> lock(solver_mutex_);
+    ResetSolver();
+    // Whatever input follows applies to an empty graph
+    std::lock_guard<std::mutex> input_lock(input_mutex_);
+    pending_input_ = PendingInput();
+    b_input_synced_ = false;
+  }
+}
+
+void LampPgo::ResetSolver() {
+  // Re-initialize solver
+  pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
+  unsolved_factors_ = NonlinearFactorGraph();
+  unsolved_values_ = Values();
+  values_ = Values();
+  nfg_ = NonlinearFactorGraph();
+  added_factors_.clear();
+  covariance_keys_.clear();
+  {
+    std::lock_guard<std::mutex> lock(covariance_mutex_);
+    covariance_job_.reset();
+    covariances_.clear();
+    num_resets_++;
   }
 }
 
 void LampPgo::InputCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
   // Callback for the input posegraph
-  NonlinearFactorGraph all_factors, new_factors;
-  Values all_values, new_values;
+  ROS_DEBUG_STREAM("PGO received " << (graph_msg->incremental ? "incremental "
+                                                              : "")
+                                   << "graph of size "
+                                   << graph_msg->nodes.size());
+
+  std::lock_guard<std::mutex> lock(input_mutex_);
+  PendingInput& pending = pending_input_;
+  if (!graph_msg->incremental) {
+    // Has all the pending ones
+    pending.nodes = graph_msg->nodes;
+    pending.edges = graph_msg->edges;
+  } else {
+    pending.nodes.insert(
+        pending.nodes.end(), graph_msg->nodes.begin(), graph_msg->nodes.end());
+    pending.edges.insert(
+        pending.edges.end(), graph_msg->edges.begin(), graph_msg->edges.end());
+  }
+  AddPendingInput();
+}
 
-  ROS_DEBUG_STREAM("PGO received graph of size " << graph_msg->nodes.size());
+void LampPgo::OptimizerInputCallback(
+    const pose_graph_msgs::OptimizerInput::ConstPtr& input) {
+  ROS_DEBUG_STREAM("PGO received " << (input->full ? "full " : "")
+                                   << "input " << input->epoch << "/"
+                                   << input->sequence << " with "
+                                   << input->nodes.size() << " nodes, "
+                                   << input->edges.size() << " edges and "
+                                   << input->removed_edges.size()
+                                   << " removed edges");
+
+  std::lock_guard<std::mutex> lock(input_mutex_);
+  PendingInput& pending = pending_input_;
+  if (input->full) {
+    // Replaces the pending changes. A new epoch replaces everything sent
+    // before.
+    PendingInput full;
+    full.reset = pending.reset || input->epoch != input_epoch_;
+    if (input->epoch != input_epoch_)
+      ROS_INFO_STREAM("PGO starting over from input epoch " << input->epoch);
+    full.full = true;
+    full.nodes = input->nodes;
+    full.edges = input->edges;
+    full.num_inputs = pending.num_inputs;
+    full.first_received = pending.first_received;
+    pending = std::move(full);
+
+    input_epoch_ = input->epoch;
+    input_sequence_ = input->sequence + 1;
+    b_input_synced_ = true;
+    b_resync_requested_ = false;
+    AddPendingInput();
+    return;
+  }
 
-  // Convert to gtsam type
-  lamp_utils::PoseGraphMsgToGtsam(graph_msg, &all_factors, &all_values);
+  if (!b_input_synced_ || input->epoch != input_epoch_ ||
+      input->sequence != input_sequence_) {
+    // Missed some changes
+    RequestResync(false);
+    return;
+  }
+  input_sequence_++;
+
+  if (!input->removed_edges.empty()) {
+    // Pending edges since removed are never given to the solver
+    lamp_utils::FactorIdSet removed;
+    for (const auto& e : input->removed_edges)
+      removed.insert(lamp_utils::FactorId::FromMsg(e));
+    pending.edges.erase(
+        std::remove_if(pending.edges.begin(),
+                       pending.edges.end(),
+                       [&](const pose_graph_msgs::PoseGraphEdge& e) {
+                         return removed.count(lamp_utils::FactorId::FromMsg(e));
+                       }),
+        pending.edges.end());
+    // A full input already forgets what its edges don't have
+    if (!pending.full) {
+      pending.removed_edges.insert(pending.removed_edges.end(),
+                                   input->removed_edges.begin(),
+                                   input->removed_edges.end());
+    }
+  }
+  pending.nodes.insert(
+      pending.nodes.end(), input->nodes.begin(), input->nodes.end());
+  pending.edges.insert(
+      pending.edges.end(), input->edges.begin(), input->edges.end());
+  AddPendingInput();
+}
 
-  // Track node IDs
-  for (auto n : graph_msg->nodes) {
-    if (!key_to_id_map_.count(n.key)) {
-      key_to_id_map_[n.key] = n.ID;
+void LampPgo::AddPendingInput() {
+  if (pending_input_.num_inputs == 0)
+    pending_input_.first_received = ros::WallTime::now();
+  pending_input_.num_inputs++;
+  input_cv_.notify_one();
+}
+
+void LampPgo::OptimizationLoop() {
+  while (true) {
+    PendingInput input;
+    {
+      std::unique_lock<std::mutex> lock(input_mutex_);
+      input_cv_.wait(lock, [this] {
+        return b_stop_optimization_ || pending_input_.num_inputs > 0;
+      });
+      if (b_stop_optimization_)
+        return;
+      std::swap(input, pending_input_);
+    }
+
+    const ros::WallTime start = ros::WallTime::now();
+    std::lock_guard<std::mutex> lock(solver_mutex_);
+    if (input.reset)
+      ResetSolver();
+    if (input.full) {
+      // Resync in the same epoch, the changes missed may have removed edges
+      lamp_utils::FactorIdSet input_edges;
+      input_edges.reserve(input.edges.size());
+      for (const auto& e : input.edges)
+        input_edges.insert(lamp_utils::FactorId::FromMsg(e));
+      for (const auto& id : added_factors_) {
+        if (input_edges.count(id))
+          continue;
+        pose_graph_msgs::PoseGraphEdge removed;
+        removed.key_from = id.key_from;
+        removed.key_to = id.key_to;
+        removed.type = id.type;
+        input.removed_edges.push_back(removed);
+      }
+    }
+    if (!ForgetRemovedEdges(input.removed_edges)) {
+      std::lock_guard<std::mutex> input_lock(input_mutex_);
+      RequestResync(true);
+      continue;
     }
+    pose_graph_msgs::OptimizerStatus status;
+    status.path = AddAndOptimize(input.nodes, input.edges);
+    status.header.stamp = ros::Time::now();
+    status.num_inputs = input.num_inputs;
+    {
+      std::lock_guard<std::mutex> input_lock(input_mutex_);
+      status.queue_depth = pending_input_.num_inputs;
+    }
+    const ros::WallTime end = ros::WallTime::now();
+    status.solve_time = (end - start).toSec();
+    status.latency = (end - input.first_received).toSec();
+    status_pub_.publish(status);
+    const bool incremental =
+        status.path == pose_graph_msgs::OptimizerStatus::INCREMENTAL;
+    ROS_DEBUG_STREAM("PGO solved " << status.num_inputs << " inputs "
+                                   << (incremental ? "incrementally"
+                                                   : "with the robust solver")
+                                   << " in "
+                                   << status.solve_time << " s, "
+                                   << status.latency << " s after the first, "
+                                   << status.queue_depth << " pending");
   }
+}
 
-  // Track edge types
-  for (auto e : graph_msg->edges) {
-    edge_to_type_[std::make_pair(e.key_to, e.key_from)] = e.type;
+bool LampPgo::ForgetRemovedEdges(
+    const std::vector<pose_graph_msgs::PoseGraphEdge>& removed_edges) {
+  if (removed_edges.empty())
+    return true;
+
+  // Mostly loop closures the solver rejected, which the sender drops after
+  // getting the optimized graph. Factors are told apart by their keys only,
+  // two edges of different types between the same nodes are the exception.
+  std::set<std::pair<gtsam::Key, gtsam::Key>> used;
+  for (const auto& factor : nfg_) {
+    if (factor)
+      used.emplace(factor->front(), factor->back());
+  }
+  for (const auto& e : removed_edges) {
+    if (used.count(std::make_pair(e.key_from, e.key_to))) {
+      ROS_WARN_STREAM("PGO can't remove edge from "
+                      << gtsam::DefaultKeyFormatter(e.key_from) << " to "
+                      << gtsam::DefaultKeyFormatter(e.key_to));
+      return false;
+    }
+    added_factors_.erase(lamp_utils::FactorId::FromMsg(e));
   }
+  return true;
+}
+
+void LampPgo::RequestResync(bool rebuild) {
+  b_input_synced_ = false;
+  // Once until the full input comes
+  if (b_resync_requested_)
+    return;
+  b_resync_requested_ = true;
+
+  pose_graph_msgs::OptimizerResync msg;
+  msg.header.stamp = ros::Time::now();
+  msg.epoch = input_epoch_;
+  msg.sequence = input_sequence_;
+  msg.rebuild = rebuild;
+  ROS_WARN_STREAM("PGO requesting a " << (rebuild ? "rebuild" : "resync")
+                                      << " at input " << input_epoch_ << "/"
+                                      << input_sequence_);
+  resync_pub_.publish(msg);
+}
 
-  // Extract new values
-  // TODO - use the merger here? In case the state of the graph here is
-  // different from the lamp node Will that ever be the case?
+uint8_t LampPgo::AddAndOptimize(
+    const std::vector<pose_graph_msgs::PoseGraphNode>& nodes,
+    const std::vector<pose_graph_msgs::PoseGraphEdge>& edges) {
+  NonlinearFactorGraph candidate_factors, new_factors;
+  Values new_values;
 
-  gtsam::KeyVector key_list = all_values.keys();
-  for (size_t i = 0; i < key_list.size(); i++) {
-    if (!values_.exists(key_list[i])) {
-      new_values.insert(key_list[i], all_values.at(key_list[i]));
+  // Keep only what the solver has not seen, so a full graph costs a lookup
+  // per node and edge rather than a conversion and a search of every factor
+  pose_graph_msgs::PoseGraph::Ptr new_graph(new pose_graph_msgs::PoseGraph);
+  for (const auto& n : nodes) {
+    if (!key_to_id_map_.count(n.key)) {
+      // Track node IDs
+      key_to_id_map_[n.key] = n.ID;
     }
+    if (!values_.exists(n.key))
+      new_graph->nodes.push_back(n);
   }
+  for (const auto& e : edges) {
+    if (!added_factors_.insert(lamp_utils::FactorId::FromMsg(e)).second)
+      continue;
+    // Track edge types
+    edge_to_type_[std::make_pair(e.key_to, e.key_from)] = e.type;
+    new_graph->edges.push_back(e);
+  }
+
+  // Convert to gtsam type
+  lamp_utils::PoseGraphMsgToGtsam(new_graph, &candidate_factors, &new_values);
 
   gtsam::Values temp_values = values_;
   temp_values.insert(new_values);
 
   // Extract the new factors
-  for (size_t i = 0; i < all_factors.size(); i++) {
-    bool factor_exists = false;
-    for (size_t j = 0; j < nfg_all_.size(); j++) {
-      if (nfg_all_[j]->keys() == all_factors[i]->keys()) {
-        factor_exists = true;
-        break;
-      }
-    }
-    if (!factor_exists) {
-      // this factor does not exist before
-      bool loop_closure =
-          (lamp_utils::IsRobotPrefix(gtsam::Symbol(all_factors[i]->back()).chr()) &&
-           lamp_utils::IsRobotPrefix(gtsam::Symbol(all_factors[i]->front()).chr()) &&
-           all_factors[i]->back() != all_factors[i]->front() + 1);
-      if (!loop_closure) {
-        new_factors.add(all_factors[i]);
+  for (size_t i = 0; i < candidate_factors.size(); i++) {
+    const auto& factor = candidate_factors[i];
+    bool loop_closure =
+        (lamp_utils::IsRobotPrefix(gtsam::Symbol(factor->back()).chr()) &&
+         lamp_utils::IsRobotPrefix(gtsam::Symbol(factor->front()).chr()) &&
+         factor->back() != factor->front() + 1);
+    if (!loop_closure) {
+      new_factors.add(factor);
+    } else {
+      if (factor->error(temp_values) < max_lc_error_) {
+        new_factors.add(factor);
       } else {
-        if (all_factors[i]->error(temp_values) < max_lc_error_)
-          new_factors.add(all_factors[i]);
-        else {
-          ROS_WARN("Loop closure discarded because of large error. ");
+        ROS_WARN("Loop closure discarded because of large error. ");
+        // Not given to the solver, checked again if sent again
+        for (const auto& e : new_graph->edges) {
+          if (e.key_from == factor->front() && e.key_to == factor->back())
+            added_factors_.erase(lamp_utils::FactorId::FromMsg(e));
         }
       }
     }
@@ -249,17 +503,35 @@ void LampPgo::InputCallback(
   ROS_DEBUG_STREAM("PGO adding new values " << new_values.size());
   for (auto k : new_values) {
     ROS_DEBUG_STREAM("\t" << gtsam::DefaultKeyFormatter(k.key));
+    covariance_keys_.insert(k.key);
   }
   ROS_DEBUG_STREAM("PGO adding new factors " << new_factors.size());
 
   // new_factors.print("new factors");
 
+  // Odometry only, the older estimates don't change
+  if (b_compose_odometry_ && IsOdometryExtension(new_factors, new_values)) {
+    const Values new_estimates = ComposeOdometry(new_factors);
+    // The robust solver gets them with its next update, for its outlier
+    // rejection
+    unsolved_factors_.add(new_factors);
+    unsolved_values_.insert(new_values);
+    values_.insert(new_estimates);
+    nfg_.add(new_factors);
+    ROS_DEBUG_STREAM("PGO extended " << new_estimates.size()
+                                     << " values incrementally");
+    PublishValues(true);
+    return pose_graph_msgs::OptimizerStatus::INCREMENTAL;
+  }
+
   ROS_DEBUG_STREAM("FACTORS BEFORE");
 
-  // Run the optimizer
-  pgo_solver_->update(new_factors, new_values);
-  // Track all the added factors (including rejected ones)
-  nfg_all_.add(new_factors);
+  // Run the optimizer, on the odometry composed so far too
+  unsolved_factors_.add(new_factors);
+  unsolved_values_.insert(new_values);
+  pgo_solver_->update(unsolved_factors_, unsolved_values_);
+  unsolved_factors_ = NonlinearFactorGraph();
+  unsolved_values_ = Values();
 
   // Extract the optimized values
   values_ = pgo_solver_->calculateEstimate();
@@ -287,21 +559,81 @@ void LampPgo::InputCallback(
                     << bad_errors.size()
                     << " factors have high error. Likely GNC outliers.");
   }
+  return pose_graph_msgs::OptimizerStatus::ROBUST;
+}
+
+bool LampPgo::IsOdometryExtension(const NonlinearFactorGraph& factors,
+                                  const Values& new_values) const {
+  if (factors.size() != new_values.size())
+    return false;
+  // One odometry factor to each new node, from a node before it
+  std::unordered_set<gtsam::Key> extended;
+  for (const auto& factor : factors) {
+    if (!boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3>>(
+            factor))
+      return false;
+    const gtsam::Symbol from(factor->front());
+    const gtsam::Symbol to(factor->back());
+    if (!lamp_utils::IsRobotPrefix(from.chr()) || to.chr() != from.chr() ||
+        to.index() != from.index() + 1)
+      return false;
+    if (!new_values.exists(to) || !extended.insert(to).second)
+      return false;
+    if (!values_.exists(from) && !new_values.exists(from))
+      return false;
+  }
+  return true;
+}
+
+Values LampPgo::ComposeOdometry(const NonlinearFactorGraph& factors) const {
+  typedef gtsam::BetweenFactor<gtsam::Pose3> OdometryFactor;
+  std::vector<boost::shared_ptr<OdometryFactor>> odometry;
+  for (const auto& factor : factors)
+    odometry.push_back(boost::dynamic_pointer_cast<OdometryFactor>(factor));
+  // In key order a new node comes after the one it extends
+  std::sort(odometry.begin(),
+            odometry.end(),
+            [](const boost::shared_ptr<OdometryFactor>& a,
+               const boost::shared_ptr<OdometryFactor>& b) {
+              return a->key2() < b->key2();
+            });
+
+  Values estimates;
+  for (const auto& factor : odometry) {
+    const gtsam::Pose3& from = values_.exists(factor->key1())
+        ? values_.at<gtsam::Pose3>(factor->key1())
+        : estimates.at<gtsam::Pose3>(factor->key1());
+    estimates.insert(factor->key2(), from.compose(factor->measured()));
+  }
+  return estimates;
+}
+
+void LampPgo::FlushOdometry() {
+  if (unsolved_factors_.empty() && unsolved_values_.empty())
+    return;
+  pgo_solver_->update(unsolved_factors_, unsolved_values_);
+  unsolved_factors_ = NonlinearFactorGraph();
+  unsolved_values_ = Values();
+}
+
+void LampPgo::PublishValues(bool b_odometry_only) {
+  // With the covariances recovered so far, the changed ones are recovered in
+  // the background rather than here (a factorization of the whole graph) and
+  // published again once done. Odometry to new nodes leaves the marginals of
+  // the older ones as they are, anything else (a loop closure) changes them
+  // all.
+  QueueCovarianceRecovery(values_.keys(),
+                          b_covariance_all_keys_ || !b_odometry_only);
+  PublishGraph();
 }
 
 // TODO - check that this is ok including just the positions in the message
-void LampPgo::PublishValues() const {
+void LampPgo::PublishGraph() {
   pose_graph_msgs::PoseGraph pose_graph_msg;
-  int iter_debug = 0;
   // Then store the values as nodes
   gtsam::KeyVector key_list = values_.keys();
-  // Extract the marginal/covariances of the optimized values
-
-  // gtsam::Marginals marginal(nfg_, values_);
-  // marginal.print();
-  // marginal.bayesTree_.print("Bayes Tree: ");
-
 
+  std::unique_lock<std::mutex> covariance_lock(covariance_mutex_);
   for (const auto& key : key_list) {
     pose_graph_msgs::PoseGraphNode node;
     node.key = key;
@@ -323,43 +655,15 @@ void LampPgo::PublishValues() const {
         values_.at<gtsam::Pose3>(key).rotation().toQuaternion().z();
     node.pose.orientation.w =
         values_.at<gtsam::Pose3>(key).rotation().toQuaternion().w();
-
-
-
-    // ROS_WARN_STREAM("Debug get covariance");
+    // covariance, zero until first recovered
+    auto covariance = covariances_.find(key);
+    if (covariance != covariances_.end())
+      node.covariance = covariance->second;
 
     pose_graph_msg.nodes.push_back(node);
   }
-  try {
-    gtsam::Marginals marginal(nfg_, values_);
-    for (size_t k = 0 ; k < key_list.size(); ++k) {
-      auto key = key_list[k];
-      auto node = pose_graph_msg.nodes[k];
-      // covariance
-      try {
-        auto cov_matrix = marginal.marginalCovariance(gtsam::Symbol(key));
-        int iter = 0;
-        for (int i = 0; i < 6; i++) {
-          for (int j = 0; j < 6; j++) {
-            node.covariance[iter] = cov_matrix(i, j);
-            iter++;
-          }
-        }
-      }
-      catch (std::exception& e) {
-        ROS_WARN_STREAM("Key is not found in the clique"
-                        << gtsam::DefaultKeyFormatter(key));
-      }
-    }
-  } catch (gtsam::IndeterminantLinearSystemException e) {
-    ROS_ERROR_STREAM("LampPgo System is indeterminant, not computing covariance");
-      boost::array<float, 36> default_covariance;
-      default_covariance.assign(1e-4);
-      for (size_t k = 0 ; k < key_list.size(); ++k) {
-          auto node = pose_graph_msg.nodes[k];
-          node.covariance = default_covariance;
-        }
-  }
+  covariance_lock.unlock();
+
   for (const auto& factor : nfg_) {
     if (boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3>>(factor)) {
       pose_graph_msgs::PoseGraphEdge edge;
@@ -394,10 +698,116 @@ void LampPgo::PublishValues() const {
   optimized_pub_.publish(pose_graph_msg);
 }
 
+void LampPgo::QueueCovarianceRecovery(const gtsam::KeyVector& keys,
+                                      bool b_all_keys) {
+  std::unordered_set<gtsam::Key> requested;
+  {
+    std::lock_guard<std::mutex> lock(covariance_mutex_);
+    for (const auto& key : keys) {
+      if (b_all_keys || covariance_keys_.count(key) || !covariances_.count(key))
+        requested.insert(key);
+    }
+    // Still wanted from the job not started
+    if (covariance_job_) {
+      for (const auto& key : covariance_job_->keys) {
+        if (values_.exists(key))
+          requested.insert(key);
+      }
+    }
+  }
+  covariance_keys_.clear();
+  if (requested.empty())
+    return;
+
+  std::unique_ptr<CovarianceJob> job(new CovarianceJob);
+  job->nfg = nfg_;
+  job->values = values_;
+  job->keys.assign(requested.begin(), requested.end());
+  {
+    std::lock_guard<std::mutex> lock(covariance_mutex_);
+    job->num_resets = num_resets_;
+    covariance_job_ = std::move(job);
+  }
+  covariance_cv_.notify_one();
+}
+
+void LampPgo::CovarianceLoop() {
+  while (true) {
+    std::unique_ptr<CovarianceJob> job;
+    {
+      std::unique_lock<std::mutex> lock(covariance_mutex_);
+      covariance_cv_.wait(lock, [this] {
+        return b_stop_covariance_ || covariance_job_ != nullptr;
+      });
+      if (b_stop_covariance_)
+        return;
+      job = std::move(covariance_job_);
+    }
+
+    const ros::WallTime start = ros::WallTime::now();
+    std::unordered_map<gtsam::Key, NodeCovariance> recovered =
+        RecoverCovariances(*job);
+    ROS_DEBUG_STREAM("PGO recovered " << recovered.size() << " of "
+                                      << job->values.size()
+                                      << " covariances in "
+                                      << (ros::WallTime::now() - start).toSec()
+                                      << " s");
+
+    {
+      std::lock_guard<std::mutex> lock(covariance_mutex_);
+      if (job->num_resets != num_resets_)
+        continue;
+      for (const auto& covariance : recovered)
+        covariances_[covariance.first] = covariance.second;
+    }
+
+    // Published now rather than with the next update, until which the new
+    // nodes would have none. Locks solver_mutex_ before covariance_mutex_, as
+    // the optimization thread does.
+    std::lock_guard<std::mutex> solver_lock(solver_mutex_);
+    if (!values_.empty())
+      PublishGraph();
+  }
+}
+
+std::unordered_map<gtsam::Key, NodeCovariance>
+LampPgo::RecoverCovariances(const CovarianceJob& job) {
+  std::unordered_map<gtsam::Key, NodeCovariance> recovered;
+  try {
+    gtsam::Marginals marginal(job.nfg, job.values);
+    for (const auto& key : job.keys) {
+      try {
+        auto cov_matrix = marginal.marginalCovariance(key);
+        NodeCovariance& covariance = recovered[key];
+        int iter = 0;
+        for (int i = 0; i < 6; i++) {
+          for (int j = 0; j < 6; j++) {
+            covariance[iter] = cov_matrix(i, j);
+            iter++;
+          }
+        }
+      } catch (std::exception& e) {
+        ROS_WARN_STREAM("Key is not found in the clique"
+                        << gtsam::DefaultKeyFormatter(key));
+      }
+    }
+  } catch (gtsam::IndeterminantLinearSystemException& e) {
+    ROS_ERROR_STREAM(
+        "LampPgo System is indeterminant, not computing covariance");
+    NodeCovariance default_covariance;
+    default_covariance.assign(1e-4);
+    for (const auto& key : job.keys)
+      recovered[key] = default_covariance;
+  }
+  return recovered;
+}
+
 void LampPgo::IgnoreRobotLoopClosures(const std_msgs::String::ConstPtr& msg) {
   // First convert string "huskyn" to char prefix
   char prefix = lamp_utils::GetRobotPrefix(msg->data);
 
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushOdometry();
   pgo_solver_->ignorePrefix(prefix);
 
   // Extract the optimized values
@@ -429,6 +839,8 @@ void LampPgo::ReviveRobotLoopClosures(const std_msgs::String::ConstPtr& msg) {
   // First convert string "huskyn" to char prefix
   char prefix = lamp_utils::GetRobotPrefix(msg->data);
 
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushOdometry();
   pgo_solver_->revivePrefix(prefix);
 
   // Extract the optimized values
@@ -0,0 +1,570 @@
+/**
+ *  @brief Testing the LampPgo class
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <set>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Symbol.h>
+
+#include "lamp_pgo/LampPgo.h"
+
+typedef std::vector<pose_graph_msgs::PoseGraphNode> Nodes;
+typedef std::vector<pose_graph_msgs::PoseGraphEdge> Edges;
+
+class TestLampPgo : public ::testing::Test {
+ protected:
+  TestLampPgo() {
+    // Load params
+    system("rosparam load $(rospack find lamp_pgo)/config/pgo_parameters.yaml");
+  }
+  ~TestLampPgo() {
+    // Restore the parameters a test changed
+    system("rosparam load $(rospack find lamp_pgo)/config/pgo_parameters.yaml");
+  }
+
+  static pose_graph_msgs::PoseGraphNode Node(const gtsam::Symbol& key,
+                                             double x) {
+    pose_graph_msgs::PoseGraphNode node;
+    node.key = key;
+    node.ID = "odom_node";
+    node.pose.position.x = x;
+    node.pose.orientation.w = 1.0;
+    return node;
+  }
+
+  static pose_graph_msgs::PoseGraphEdge Edge(const gtsam::Symbol& from,
+                                             const gtsam::Symbol& to,
+                                             double dx,
+                                             int32_t type) {
+    pose_graph_msgs::PoseGraphEdge edge;
+    edge.key_from = from;
+    edge.key_to = to;
+    edge.type = type;
+    edge.pose.position.x = dx;
+    edge.pose.orientation.w = 1.0;
+    for (size_t i = 0; i < 6; i++)
+      edge.covariance[i * 6 + i] = 1e-2;
+    return edge;
+  }
+
+  // Nodes first to last of robot a, one meter apart, with the odometry to
+  // each of them (and a prior on the first node of the robot)
+  static void AddOdometry(size_t first,
+                          size_t last,
+                          Nodes* nodes,
+                          Edges* edges) {
+    for (size_t i = first; i <= last; i++) {
+      nodes->push_back(Node(gtsam::Symbol('a', i), i));
+      if (i == 0) {
+        edges->push_back(Edge(gtsam::Symbol('a', 0),
+                              gtsam::Symbol('a', 0),
+                              0,
+                              pose_graph_msgs::PoseGraphEdge::PRIOR));
+      } else {
+        edges->push_back(Edge(gtsam::Symbol('a', i - 1),
+                              gtsam::Symbol('a', i),
+                              1.0,
+                              pose_graph_msgs::PoseGraphEdge::ODOM));
+      }
+    }
+  }
+
+  bool initialize(LampPgo& pgo) {
+    ros::NodeHandle nh;
+    return pgo.Initialize(nh);
+  }
+
+  uint8_t addAndOptimize(LampPgo& pgo, const Nodes& nodes, const Edges& edges) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    return pgo.AddAndOptimize(nodes, edges);
+  }
+
+  gtsam::Values getValues(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    return pgo.values_;
+  }
+
+  gtsam::Values getSolverEstimate(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    pgo.FlushOdometry();
+    return pgo.pgo_solver_->calculateEstimate();
+  }
+
+  size_t getNumFactors(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    return pgo.nfg_.size();
+  }
+
+  size_t getNumAddedFactors(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    return pgo.added_factors_.size();
+  }
+
+  bool forgetRemovedEdges(LampPgo& pgo, const Edges& removed_edges) {
+    std::lock_guard<std::mutex> lock(pgo.solver_mutex_);
+    return pgo.ForgetRemovedEdges(removed_edges);
+  }
+
+  // Covariance jobs then stay queued until runCovarianceJob
+  void stopCovarianceThread(LampPgo& pgo) {
+    {
+      std::lock_guard<std::mutex> lock(pgo.covariance_mutex_);
+      pgo.b_stop_covariance_ = true;
+    }
+    pgo.covariance_cv_.notify_all();
+    pgo.covariance_thread_.join();
+  }
+
+  // Recovers the covariances of the queued job, returns its keys
+  std::set<gtsam::Key> runCovarianceJob(LampPgo& pgo) {
+    std::unique_ptr<CovarianceJob> job;
+    {
+      std::lock_guard<std::mutex> lock(pgo.covariance_mutex_);
+      job = std::move(pgo.covariance_job_);
+    }
+    if (!job)
+      return std::set<gtsam::Key>();
+    const auto recovered = LampPgo::RecoverCovariances(*job);
+    std::lock_guard<std::mutex> lock(pgo.covariance_mutex_);
+    for (const auto& covariance : recovered)
+      pgo.covariances_[covariance.first] = covariance.second;
+    return std::set<gtsam::Key>(job->keys.begin(), job->keys.end());
+  }
+
+  double getCovarianceTrace(LampPgo& pgo, const gtsam::Key& key) {
+    std::lock_guard<std::mutex> lock(pgo.covariance_mutex_);
+    const NodeCovariance& covariance = pgo.covariances_.at(key);
+    double trace = 0;
+    for (size_t i = 0; i < 6; i++)
+      trace += covariance[i * 6 + i];
+    return trace;
+  }
+
+  static pose_graph_msgs::OptimizerInput::Ptr Input(uint64_t epoch,
+                                                   uint64_t sequence,
+                                                   bool full,
+                                                   const Nodes& nodes,
+                                                   const Edges& edges) {
+    pose_graph_msgs::OptimizerInput::Ptr input(
+        new pose_graph_msgs::OptimizerInput);
+    input->epoch = epoch;
+    input->sequence = sequence;
+    input->full = full;
+    input->nodes = nodes;
+    input->edges = edges;
+    return input;
+  }
+
+  void optimizerInputCallback(
+      LampPgo& pgo, const pose_graph_msgs::OptimizerInput::ConstPtr& input) {
+    pgo.OptimizerInputCallback(input);
+  }
+
+  void resetCallback(LampPgo& pgo) {
+    std_msgs::Bool::Ptr msg(new std_msgs::Bool);
+    msg->data = true;
+    pgo.ResetCallback(msg);
+  }
+
+  // Inputs then stay pending until startOptimizationThread
+  void stopOptimizationThread(LampPgo& pgo) {
+    {
+      std::lock_guard<std::mutex> lock(pgo.input_mutex_);
+      pgo.b_stop_optimization_ = true;
+    }
+    pgo.input_cv_.notify_all();
+    pgo.optimization_thread_.join();
+  }
+
+  void startOptimizationThread(LampPgo& pgo) {
+    {
+      std::lock_guard<std::mutex> lock(pgo.input_mutex_);
+      pgo.b_stop_optimization_ = false;
+    }
+    pgo.optimization_thread_ = std::thread(&LampPgo::OptimizationLoop, &pgo);
+  }
+
+  PendingInput getPendingInput(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.input_mutex_);
+    return pgo.pending_input_;
+  }
+
+  bool isInputSynced(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.input_mutex_);
+    return pgo.b_input_synced_;
+  }
+
+  bool isResyncRequested(LampPgo& pgo) {
+    std::lock_guard<std::mutex> lock(pgo.input_mutex_);
+    return pgo.b_resync_requested_;
+  }
+
+  // Until the optimization thread took every pending input and the solver
+  // has num_values values
+  bool waitForValues(LampPgo& pgo, size_t num_values) {
+    for (size_t i = 0; i < 500; i++) {
+      if (getPendingInput(pgo).num_inputs == 0 &&
+          getValues(pgo).size() == num_values)
+        return true;
+      ros::WallDuration(0.01).sleep();
+    }
+    return false;
+  }
+
+  void valuesCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+    published_values_ = msg;
+  }
+
+  // Until optimized_values were published with num_nodes nodes, all of them
+  // with a covariance
+  bool waitForCovariances(size_t num_nodes) {
+    for (size_t i = 0; i < 500; i++) {
+      ros::spinOnce();
+      if (published_values_ && published_values_->nodes.size() == num_nodes &&
+          std::all_of(published_values_->nodes.begin(),
+                      published_values_->nodes.end(),
+                      [](const pose_graph_msgs::PoseGraphNode& node) {
+                        return node.covariance[0] > 0;
+                      }))
+        return true;
+      ros::WallDuration(0.01).sleep();
+    }
+    return false;
+  }
+
+  LampPgo pgo_;
+  pose_graph_msgs::PoseGraph::ConstPtr published_values_;
+};
+
+TEST_F(TestLampPgo, TestInitialize) {
+  ASSERT_TRUE(initialize(pgo_));
+}
+
+TEST_F(TestLampPgo, DuplicateEdgesGivenOnce) {
+  ASSERT_TRUE(initialize(pgo_));
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 3, &nodes, &edges);
+  edges.push_back(Edge(gtsam::Symbol('a', 3),
+                       gtsam::Symbol('a', 0),
+                       -3.0,
+                       pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  addAndOptimize(pgo_, nodes, edges);
+  const size_t num_factors = getNumFactors(pgo_);
+  EXPECT_EQ(5u, num_factors);
+  EXPECT_EQ(5u, getNumAddedFactors(pgo_));
+
+  // A full graph sent again
+  addAndOptimize(pgo_, nodes, edges);
+  EXPECT_EQ(num_factors, getNumFactors(pgo_));
+  EXPECT_EQ(5u, getNumAddedFactors(pgo_));
+
+  // Twice in the same input
+  const pose_graph_msgs::PoseGraphEdge loop_closure =
+      Edge(gtsam::Symbol('a', 3),
+           gtsam::Symbol('a', 1),
+           -2.0,
+           pose_graph_msgs::PoseGraphEdge::LOOPCLOSE);
+  addAndOptimize(pgo_, Nodes(), Edges{loop_closure, loop_closure});
+  EXPECT_EQ(num_factors + 1, getNumFactors(pgo_));
+  EXPECT_EQ(6u, getNumAddedFactors(pgo_));
+}
+
+TEST_F(TestLampPgo, RemovedEdgesGivenAgainOnce) {
+  ASSERT_TRUE(initialize(pgo_));
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 3, &nodes, &edges);
+  addAndOptimize(pgo_, nodes, edges);
+  const size_t num_factors = getNumFactors(pgo_);
+
+  // Far off the odometry, rejected by the solver
+  const pose_graph_msgs::PoseGraphEdge outlier =
+      Edge(gtsam::Symbol('a', 3),
+           gtsam::Symbol('a', 0),
+           -30.0,
+           pose_graph_msgs::PoseGraphEdge::LOOPCLOSE);
+  addAndOptimize(pgo_, Nodes(), Edges{outlier});
+  EXPECT_EQ(num_factors, getNumFactors(pgo_));
+  EXPECT_EQ(5u, getNumAddedFactors(pgo_));
+  addAndOptimize(pgo_, Nodes(), Edges{outlier});
+  EXPECT_EQ(5u, getNumAddedFactors(pgo_));
+
+  // The sender drops it, once or more
+  EXPECT_TRUE(forgetRemovedEdges(pgo_, Edges{outlier}));
+  EXPECT_EQ(4u, getNumAddedFactors(pgo_));
+  EXPECT_TRUE(forgetRemovedEdges(pgo_, Edges{outlier, outlier}));
+  EXPECT_EQ(4u, getNumAddedFactors(pgo_));
+
+  // Sent again after that, the solver checks it once more
+  addAndOptimize(pgo_, Nodes(), Edges{outlier, outlier});
+  EXPECT_EQ(5u, getNumAddedFactors(pgo_));
+  EXPECT_EQ(num_factors, getNumFactors(pgo_));
+
+  // Still used by the solver, can't be removed
+  EXPECT_FALSE(forgetRemovedEdges(
+      pgo_,
+      Edges{Edge(gtsam::Symbol('a', 0),
+                 gtsam::Symbol('a', 1),
+                 1.0,
+                 pose_graph_msgs::PoseGraphEdge::ODOM)}));
+}
+
+TEST_F(TestLampPgo, ComposedOdometryMatchesRobustSolver) {
+  system("rosparam set base/b_compose_odometry true");
+  ASSERT_TRUE(initialize(pgo_));
+  system("rosparam set base/b_compose_odometry false");
+  LampPgo robust;
+  ASSERT_TRUE(initialize(robust));
+
+  // A loop closure that moves the odometry estimates
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 5, &nodes, &edges);
+  edges.push_back(Edge(gtsam::Symbol('a', 5),
+                       gtsam::Symbol('a', 0),
+                       -4.8,
+                       pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::ROBUST,
+            addAndOptimize(pgo_, nodes, edges));
+  addAndOptimize(robust, nodes, edges);
+
+  // Odometry only, composed onto the optimized estimates
+  nodes.clear();
+  edges.clear();
+  AddOdometry(6, 8, &nodes, &edges);
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::INCREMENTAL,
+            addAndOptimize(pgo_, nodes, edges));
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::ROBUST,
+            addAndOptimize(robust, nodes, edges));
+
+  const gtsam::Values composed = getValues(pgo_);
+  const gtsam::Values optimized = getValues(robust);
+  ASSERT_EQ(9u, composed.size());
+  ASSERT_EQ(optimized.size(), composed.size());
+  for (const auto& key_value : optimized) {
+    EXPECT_TRUE(composed.at<gtsam::Pose3>(key_value.key)
+                    .equals(key_value.value.cast<gtsam::Pose3>(), 1e-3))
+        << gtsam::DefaultKeyFormatter(key_value.key);
+  }
+  // The robust solver still ends up with the composed odometry
+  const gtsam::Values solver_estimate = getSolverEstimate(pgo_);
+  ASSERT_EQ(composed.size(), solver_estimate.size());
+  for (const auto& key_value : solver_estimate) {
+    EXPECT_TRUE(composed.at<gtsam::Pose3>(key_value.key)
+                    .equals(key_value.value.cast<gtsam::Pose3>(), 1e-3))
+        << gtsam::DefaultKeyFormatter(key_value.key);
+  }
+  EXPECT_EQ(getNumFactors(robust), getNumFactors(pgo_));
+}
+
+TEST_F(TestLampPgo, RobustUpdateTakesComposedOdometry) {
+  system("rosparam set base/b_compose_odometry true");
+  ASSERT_TRUE(initialize(pgo_));
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 3, &nodes, &edges);
+  addAndOptimize(pgo_, nodes, edges);
+  nodes.clear();
+  edges.clear();
+  AddOdometry(4, 6, &nodes, &edges);
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::INCREMENTAL,
+            addAndOptimize(pgo_, nodes, edges));
+
+  // The loop closure goes to the robust solver with the odometry before it
+  nodes.clear();
+  edges.clear();
+  edges.push_back(Edge(gtsam::Symbol('a', 6),
+                       gtsam::Symbol('a', 1),
+                       -5.0,
+                       pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::ROBUST,
+            addAndOptimize(pgo_, nodes, edges));
+  EXPECT_EQ(7u, getValues(pgo_).size());
+  EXPECT_EQ(8u, getNumFactors(pgo_));
+}
+
+TEST_F(TestLampPgo, LoopClosureUpdatesEveryCovariance) {
+  ASSERT_TRUE(initialize(pgo_));
+  stopCovarianceThread(pgo_);
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 5, &nodes, &edges);
+  addAndOptimize(pgo_, nodes, edges);
+  EXPECT_EQ(6u, runCovarianceJob(pgo_).size());
+  const gtsam::Symbol middle('a', 3);
+  const double before = getCovarianceTrace(pgo_, middle);
+
+  // Neither a new node nor an endpoint of the loop closure, still less
+  // uncertain after it
+  nodes.clear();
+  edges.clear();
+  edges.push_back(Edge(gtsam::Symbol('a', 5),
+                       gtsam::Symbol('a', 0),
+                       -5.0,
+                       pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  addAndOptimize(pgo_, nodes, edges);
+  const std::set<gtsam::Key> recovered = runCovarianceJob(pgo_);
+  EXPECT_EQ(6u, recovered.size());
+  EXPECT_TRUE(recovered.count(middle));
+  EXPECT_LT(getCovarianceTrace(pgo_, middle), before);
+}
+
+TEST_F(TestLampPgo, OdometryUpdatesNewCovariances) {
+  system("rosparam set base/b_compose_odometry true");
+  ASSERT_TRUE(initialize(pgo_));
+  stopCovarianceThread(pgo_);
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 5, &nodes, &edges);
+  addAndOptimize(pgo_, nodes, edges);
+  runCovarianceJob(pgo_);
+
+  // The older marginals don't change
+  nodes.clear();
+  edges.clear();
+  AddOdometry(6, 7, &nodes, &edges);
+  EXPECT_EQ(pose_graph_msgs::OptimizerStatus::INCREMENTAL,
+            addAndOptimize(pgo_, nodes, edges));
+  const std::set<gtsam::Key> recovered = runCovarianceJob(pgo_);
+  EXPECT_EQ(2u, recovered.size());
+  EXPECT_TRUE(recovered.count(gtsam::Symbol('a', 6)));
+  EXPECT_TRUE(recovered.count(gtsam::Symbol('a', 7)));
+  EXPECT_LT(getCovarianceTrace(pgo_, gtsam::Symbol('a', 6)),
+            getCovarianceTrace(pgo_, gtsam::Symbol('a', 7)));
+}
+
+TEST_F(TestLampPgo, RecoveredCovariancesPublished) {
+  ASSERT_TRUE(initialize(pgo_));
+  ros::NodeHandle nh;
+  ros::Subscriber values_sub = nh.subscribe(
+      "optimized_values", 10, &TestLampPgo::valuesCallback, this);
+  for (size_t i = 0; i < 500 && values_sub.getNumPublishers() == 0; i++)
+    ros::WallDuration(0.01).sleep();
+  ASSERT_EQ(1u, values_sub.getNumPublishers());
+
+  // Published without covariances by the update, then again once recovered
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 3, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 0, true, nodes, edges));
+  EXPECT_TRUE(waitForCovariances(4));
+}
+
+TEST_F(TestLampPgo, GapRequestsResync) {
+  ASSERT_TRUE(initialize(pgo_));
+  stopOptimizationThread(pgo_);
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 2, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 0, true, nodes, edges));
+  EXPECT_TRUE(isInputSynced(pgo_));
+  EXPECT_FALSE(isResyncRequested(pgo_));
+
+  // Input 1 was missed, the changes until the next full input are dropped
+  nodes.clear();
+  edges.clear();
+  AddOdometry(3, 3, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 2, false, nodes, edges));
+  EXPECT_FALSE(isInputSynced(pgo_));
+  EXPECT_TRUE(isResyncRequested(pgo_));
+  optimizerInputCallback(pgo_, Input(1, 3, false, Nodes(), Edges()));
+  PendingInput pending = getPendingInput(pgo_);
+  EXPECT_EQ(1u, pending.num_inputs);
+  EXPECT_EQ(3u, pending.nodes.size());
+  EXPECT_EQ(3u, pending.edges.size());
+
+  nodes.clear();
+  edges.clear();
+  AddOdometry(0, 4, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 4, true, nodes, edges));
+  EXPECT_TRUE(isInputSynced(pgo_));
+  EXPECT_FALSE(isResyncRequested(pgo_));
+  startOptimizationThread(pgo_);
+  EXPECT_TRUE(waitForValues(pgo_, 5));
+}
+
+TEST_F(TestLampPgo, FullInputReplacesPending) {
+  ASSERT_TRUE(initialize(pgo_));
+  stopOptimizationThread(pgo_);
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 2, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 0, true, nodes, edges));
+  nodes.clear();
+  edges.clear();
+  AddOdometry(3, 3, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 1, false, nodes, edges));
+  PendingInput pending = getPendingInput(pgo_);
+  EXPECT_EQ(2u, pending.num_inputs);
+  EXPECT_EQ(4u, pending.nodes.size());
+
+  // Has everything pending, not added to it
+  nodes.clear();
+  edges.clear();
+  AddOdometry(0, 5, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 2, true, nodes, edges));
+  pending = getPendingInput(pgo_);
+  EXPECT_EQ(3u, pending.num_inputs);
+  EXPECT_TRUE(pending.full);
+  // Still starts over, from the first input of the epoch
+  EXPECT_TRUE(pending.reset);
+  EXPECT_EQ(6u, pending.nodes.size());
+  EXPECT_EQ(6u, pending.edges.size());
+
+  startOptimizationThread(pgo_);
+  EXPECT_TRUE(waitForValues(pgo_, 6));
+  EXPECT_EQ(6u, getNumFactors(pgo_));
+}
+
+TEST_F(TestLampPgo, ResetWhilePending) {
+  ASSERT_TRUE(initialize(pgo_));
+
+  Nodes nodes;
+  Edges edges;
+  AddOdometry(0, 2, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 0, true, nodes, edges));
+  ASSERT_TRUE(waitForValues(pgo_, 3));
+
+  stopOptimizationThread(pgo_);
+  nodes.clear();
+  edges.clear();
+  AddOdometry(3, 3, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 1, false, nodes, edges));
+  EXPECT_EQ(1u, getPendingInput(pgo_).num_inputs);
+
+  // The pending changes applied to the graph just dropped
+  resetCallback(pgo_);
+  EXPECT_EQ(0u, getPendingInput(pgo_).num_inputs);
+  EXPECT_EQ(0u, getValues(pgo_).size());
+  EXPECT_FALSE(isInputSynced(pgo_));
+  optimizerInputCallback(pgo_, Input(1, 2, false, Nodes(), Edges()));
+  EXPECT_TRUE(isResyncRequested(pgo_));
+  EXPECT_EQ(0u, getPendingInput(pgo_).num_inputs);
+
+  nodes.clear();
+  edges.clear();
+  AddOdometry(0, 4, &nodes, &edges);
+  optimizerInputCallback(pgo_, Input(1, 3, true, nodes, edges));
+  startOptimizationThread(pgo_);
+  EXPECT_TRUE(waitForValues(pgo_, 5));
+  EXPECT_EQ(5u, getNumFactors(pgo_));
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "test_lamp_pgo");
+  return RUN_ALL_TESTS();
+}
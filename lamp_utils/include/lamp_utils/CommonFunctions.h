@@ -178,6 +178,17 @@ inline gtsam::Pose3 ToGtsam(const geometry_msgs::Pose msg) {
   return pose;
 }
 
+// True if pose b is more than the given translation (m) or rotation (rad)
+// away from pose a
+inline bool PoseChanged(const gtsam::Pose3& a,
+                        const gtsam::Pose3& b,
+                        double translation_threshold,
+                        double rotation_threshold) {
+  const gtsam::Pose3 delta = a.between(b);
+  return delta.translation().norm() > translation_threshold ||
+      gtsam::Rot3::Logmap(delta.rotation()).norm() > rotation_threshold;
+}
+
 inline Mat66 ToGu(const Gaussian::shared_ptr& covariance) {
   gtsam::Matrix66 gtsam_covariance = covariance->covariance();
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+#ifndef KEYED_SCAN_STORE_H
+#define KEYED_SCAN_STORE_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/KeyedScan.h>
+
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_utils {
+
+struct KeyedScanStoreStats {
+  size_t num_scans = 0;
+  // Scans currently held decoded
+  size_t num_decoded = 0;
+  size_t decoded_bytes = 0;
+  // Messages kept to decode evicted scans again
+  size_t message_bytes = 0;
+  size_t decodes = 0;
+  size_t evictions = 0;
+  size_t observability_computations = 0;
+};
+
+// Decoded keyed scans shared between every consumer holding the store. A scan
+// is deserialized once, on its first Add, and handed out as a ConstPtr so
+// consumers never copy the points. With a memory budget the message of each
+// scan is kept, and the least recently used decoded clouds are dropped while
+// the decoded clouds and kept messages together exceed the budget. A dropped
+// cloud is decoded again from its message when next requested; clouds added
+// directly (without a message) are never dropped.
+// Nodes running in one process share Shared(), a standalone node can just as
+// well use a store of its own.
+class KeyedScanStore {
+public:
+  typedef std::shared_ptr<KeyedScanStore> Ptr;
+
+  // Budget in bytes, 0 for no limit
+  explicit KeyedScanStore(size_t memory_budget = 0);
+
+  KeyedScanStore(const KeyedScanStore&) = delete;
+  KeyedScanStore& operator=(const KeyedScanStore&) = delete;
+
+  // Process wide instance
+  static Ptr Shared();
+
+  static PointCloud::Ptr Decode(const pose_graph_msgs::KeyedScan& msg);
+
+  void SetMemoryBudget(size_t bytes);
+  size_t GetMemoryBudget() const;
+
+  // Returns the stored scan, decoding the message only if the key is new
+  PointCloudConstPtr Add(const pose_graph_msgs::KeyedScan::ConstPtr& msg);
+  PointCloudConstPtr Add(const gtsam::Key& key, const PointCloudConstPtr& scan);
+
+  bool Has(const gtsam::Key& key) const;
+
+  // Null if the key has no scan
+  PointCloudConstPtr Get(const gtsam::Key& key);
+
+  // ComputeIcpObservability eigenvalues of the scan, computed on first request
+  // and kept even when the decoded scan is evicted. False if the key has no
+  // scan.
+  bool GetObservability(const gtsam::Key& key, Eigen::Vector3d* eigenvalues);
+
+  void Erase(const gtsam::Key& key);
+  void Clear();
+
+  size_t Size() const;
+  KeyedScanStoreStats GetStats() const;
+
+private:
+  struct Entry {
+    pose_graph_msgs::KeyedScan::ConstPtr msg;
+    PointCloudConstPtr scan;
+    size_t bytes = 0;
+    size_t message_bytes = 0;
+    // Position in lru_ while evictable and decoded
+    std::list<gtsam::Key>::iterator lru_it;
+    bool in_lru = false;
+    Eigen::Vector3d observability;
+    bool has_observability = false;
+  };
+
+  static size_t CloudBytes(const PointCloud& scan);
+  static size_t MessageBytes(const pose_graph_msgs::KeyedScan& msg);
+
+  // All of these expect mutex_ to be held
+  PointCloudConstPtr Insert(const gtsam::Key& key,
+                            const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+                            const PointCloudConstPtr& scan);
+  void SetDecoded(Entry* entry,
+                  const gtsam::Key& key,
+                  const PointCloudConstPtr& scan);
+  void Touch(Entry* entry);
+  void Evict();
+
+  mutable std::mutex mutex_;
+  std::unordered_map<gtsam::Key, Entry> entries_;
+  // Most recently used first
+  std::list<gtsam::Key> lru_;
+  size_t memory_budget_;
+  KeyedScanStoreStats stats_;
+};
+
+} // namespace lamp_utils
+
+#endif
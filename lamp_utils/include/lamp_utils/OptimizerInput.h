@@ -0,0 +1,84 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+#ifndef OPTIMIZER_INPUT_H
+#define OPTIMIZER_INPUT_H
+
+#include <cstdint>
+#include <unordered_set>
+
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/OptimizerInput.h>
+#include <pose_graph_msgs/PoseGraphEdge.h>
+
+#include <lamp_utils/PoseGraph.h>
+
+namespace lamp_utils {
+
+// An edge of the pose graph. The same two nodes can be joined by edges of
+// different types
+struct FactorId {
+  gtsam::Key key_from;
+  gtsam::Key key_to;
+  int32_t type;
+
+  static FactorId FromMsg(const pose_graph_msgs::PoseGraphEdge& msg) {
+    return FactorId{msg.key_from, msg.key_to, msg.type};
+  }
+
+  bool operator==(const FactorId& other) const {
+    return key_from == other.key_from && key_to == other.key_to &&
+        type == other.type;
+  }
+};
+
+struct FactorIdHash {
+  size_t operator()(const FactorId& id) const {
+    size_t seed = std::hash<gtsam::Key>()(id.key_from);
+    seed ^= std::hash<gtsam::Key>()(id.key_to) + 0x9e3779b9 + (seed << 6) +
+        (seed >> 2);
+    seed ^= std::hash<int32_t>()(id.type) + 0x9e3779b9 + (seed << 6) +
+        (seed >> 2);
+    return seed;
+  }
+};
+
+typedef std::unordered_set<FactorId, FactorIdHash> FactorIdSet;
+
+// What of a pose graph was sent to the optimizer, so only the changes since
+// are sent (see pose_graph_msgs/OptimizerInput). The first message, the one
+// after RequestFull and the one after nodes were removed (the optimizer can't
+// remove values) carry the whole graph; the latter two start a new epoch.
+class OptimizerInputTracker {
+ public:
+  OptimizerInputTracker();
+
+  // Next message for the optimizer, marks its content as sent
+  pose_graph_msgs::OptimizerInput::Ptr Update(const PoseGraph& graph);
+
+  // The next message carries the whole graph, in a new epoch if new_epoch
+  void RequestFull(bool new_epoch);
+
+  inline uint64_t Epoch() const { return epoch_; }
+  // Of the next message
+  inline uint64_t Sequence() const { return sequence_; }
+
+ private:
+  pose_graph_msgs::OptimizerInput::Ptr FullMessage(const PoseGraph& graph);
+
+  void Stamp(pose_graph_msgs::OptimizerInput* msg);
+
+  // Differs between runs, so an optimizer outliving the sender starts over
+  uint64_t epoch_;
+  uint64_t sequence_ = 0;
+  bool b_full_ = true;
+
+  std::unordered_set<gtsam::Key> sent_nodes_;
+  FactorIdSet sent_edges_;
+};
+
+}  // namespace lamp_utils
+
+#endif
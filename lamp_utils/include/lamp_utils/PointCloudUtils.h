@@ -94,10 +94,18 @@ void ComputeIcpObservability(
     Eigen::Matrix<double, 3, 1>* eigenvalues,
     const NormalComputeParams& params = NormalComputeParams());
 
+// Sum of J^T J over the points for the point-to-point ICP cost at T.
+// Clouds of more than 16 batches of points are split over up to num_threads.
+Eigen::Matrix<double, 6, 6>
+ComputeICPHessianPointPoint(const PointCloud::ConstPtr& pointCloud,
+                            const Eigen::Matrix4f& T,
+                            int num_threads = 1);
+
 bool ComputeICPCovariancePointPoint(const PointCloud::ConstPtr& pointCloud,
                                     const Eigen::Matrix4f& T,
                                     const double& icp_fitness,
-                                    Eigen::Matrix<double, 6, 6>& covariance);
+                                    Eigen::Matrix<double, 6, 6>& covariance,
+                                    int num_threads = 1);
 
 bool ComputeICPCovariancePointPlane(const PointCloud::ConstPtr& query_cloud,
                                     const PointCloud::ConstPtr& reference_cloud,
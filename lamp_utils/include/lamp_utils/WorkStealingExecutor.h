@@ -0,0 +1,227 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+#ifndef WORK_STEALING_EXECUTOR_H
+#define WORK_STEALING_EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lamp_utils {
+
+// Shared flag that lets the submitter cancel tasks that have not started yet.
+// Copies refer to the same flag, so a long running task can also poll it.
+class CancellationToken {
+public:
+  CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+  inline void Cancel() {
+    cancelled_->store(true);
+  }
+  inline bool IsCancelled() const {
+    return cancelled_->load();
+  }
+
+private:
+  std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Set on the future of a task that was cancelled before it ran
+class TaskCancelled : public std::runtime_error {
+public:
+  TaskCancelled() : std::runtime_error("Task cancelled before it ran") {}
+};
+
+// Higher priority tasks are taken first, both from a worker's own deque and
+// when stealing
+enum class TaskPriority { LOW = 0, NORMAL = 1, HIGH = 2 };
+
+struct TaskTiming {
+  // Seconds between submission and start of execution
+  double queue_time = 0;
+  // Seconds spent executing
+  double run_time = 0;
+};
+
+struct TaskOptions {
+  TaskPriority priority = TaskPriority::NORMAL;
+  CancellationToken token;
+  // If set, filled in before the future of the task becomes ready
+  std::shared_ptr<TaskTiming> timing;
+};
+
+struct ExecutorStats {
+  size_t submitted = 0;
+  size_t completed = 0;
+  size_t cancelled = 0;
+  size_t stolen = 0;
+  size_t pending = 0;
+  double total_queue_time = 0;
+  double total_run_time = 0;
+  double max_run_time = 0;
+};
+
+// Thread pool with one task deque per worker. Workers take tasks from their
+// own deque and steal from the others when it runs dry, so there is no single
+// queue lock shared by every submitter and worker, and a slow task only
+// delays the tasks queued behind it on the same worker until they are stolen.
+class WorkStealingExecutor {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit WorkStealingExecutor(size_t num_threads = 0);
+  ~WorkStealingExecutor();
+
+  WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+  WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+  // Grow or shrink the pool. Existing workers keep running; the queued tasks
+  // of removed workers are handed to the remaining ones.
+  void Resize(size_t num_threads);
+
+  // Finish every queued task and join all workers
+  void Stop();
+
+  size_t NumThreads() const;
+
+  ExecutorStats GetStats() const;
+
+  // Queue f on a worker. Without workers (zero threads or stopped) f runs
+  // inline and the returned future is already ready.
+  template <class F>
+  auto Submit(F&& f, const TaskOptions& options = TaskOptions())
+      -> std::future<typename std::result_of<F()>::type>;
+
+private:
+  typedef std::chrono::time_point<Clock> TimePoint;
+
+  class TaskBase {
+  public:
+    TaskBase(const TaskOptions& options)
+      : options_(options), submit_time_(Clock::now()) {}
+    virtual ~TaskBase() {}
+
+    // Run the callable and keep its result or exception
+    virtual void Invoke() = 0;
+    // Make the kept result (or exception) available through the future
+    virtual void Finish() = 0;
+    virtual void Cancel() = 0;
+
+    const TaskOptions options_;
+    const TimePoint submit_time_;
+  };
+
+  template <class R, class F>
+  class Task : public TaskBase {
+  public:
+    Task(F&& f, const TaskOptions& options)
+      : TaskBase(options), f_(std::forward<F>(f)) {}
+
+    std::future<R> GetFuture() {
+      return promise_.get_future();
+    }
+    void Invoke() override {
+      try {
+        Store(std::is_void<R>());
+      } catch (...) {
+        error_ = std::current_exception();
+      }
+    }
+    void Finish() override {
+      if (error_)
+        promise_.set_exception(error_);
+      else
+        Publish(std::is_void<R>());
+    }
+    void Cancel() override {
+      promise_.set_exception(std::make_exception_ptr(TaskCancelled()));
+    }
+
+  private:
+    void Store(std::true_type) {
+      f_();
+    }
+    void Store(std::false_type) {
+      result_.reset(new R(f_()));
+    }
+    void Publish(std::true_type) {
+      promise_.set_value();
+    }
+    void Publish(std::false_type) {
+      promise_.set_value(std::move(*result_));
+    }
+
+    typename std::decay<F>::type f_;
+    std::promise<R> promise_;
+    std::unique_ptr<typename std::conditional<std::is_void<R>::value,
+                                              char,
+                                              R>::type>
+        result_;
+    std::exception_ptr error_;
+  };
+
+  typedef std::unique_ptr<TaskBase> TaskPtr;
+
+  static constexpr size_t kNumPriorities = 3;
+
+  struct Worker {
+    std::mutex mutex;
+    // One deque per priority level
+    std::deque<TaskPtr> tasks[kNumPriorities];
+    std::thread thread;
+    std::atomic<bool> retire{false};
+  };
+
+  void Push(TaskPtr task);
+  bool PopLocal(Worker& worker, TaskPtr* task);
+  bool Steal(size_t thief, TaskPtr* task);
+  void Execute(TaskPtr task);
+  void WorkerLoop(Worker* worker, size_t index);
+
+  // Guards the set of workers (not their deques). Shared for submitting and
+  // stealing, exclusive only while resizing.
+  mutable std::shared_timed_mutex workers_mutex_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // Workers at index num_active_ and above are retiring
+  size_t num_active_ = 0;
+
+  // Idle workers sleep here until a task is pushed
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> next_worker_{0};
+  bool stop_ = false;
+
+  // Statistics
+  mutable std::mutex stats_mutex_;
+  ExecutorStats stats_;
+};
+
+template <class F>
+auto WorkStealingExecutor::Submit(F&& f, const TaskOptions& options)
+    -> std::future<typename std::result_of<F()>::type> {
+  typedef typename std::result_of<F()>::type R;
+  std::unique_ptr<Task<R, F>> task(
+      new Task<R, F>(std::forward<F>(f), options));
+  std::future<R> result = task->GetFuture();
+  Push(TaskPtr(task.release()));
+  return result;
+}
+
+} // namespace lamp_utils
+
+#endif
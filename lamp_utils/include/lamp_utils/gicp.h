@@ -218,6 +218,36 @@ public:
     target_covariances_ = covariances;
   }
 
+  /** \brief Compute the per-point covariances of a target cloud the same way
+   * align() would, so that they can be stored and handed back later through
+   * setTargetCovariances(). \param[in] cloud the point cloud \param[in] tree
+   * KD tree built on \a cloud \param[out] covariances covariance matrix of
+   * each point in \a cloud
+   */
+  inline void computeTargetCloudCovariances(
+      const PointCloudTargetConstPtr& cloud,
+      const InputKdTreePtr& tree,
+      MatricesVector& covariances) {
+    computeCovariances<PointTarget>(
+        cloud, tree, covariances, recompute_target_cov_);
+  }
+
+  /** \brief Same as computeTargetCloudCovariances() for a source cloud, handed
+   * back through setSourceCovariances()
+   */
+  inline void computeSourceCloudCovariances(
+      const PointCloudSourceConstPtr& cloud,
+      const InputKdTreePtr& tree,
+      MatricesVector& covariances) {
+    computeCovariances<PointSource>(
+        cloud, tree, covariances, recompute_source_cov);
+  }
+
+  ///\return whether source and target clouds get the same covariances
+  inline bool sameSourceAndTargetCovariances() const {
+    return recompute_source_cov == recompute_target_cov_;
+  }
+
   /** \brief Estimate a rigid rotation transformation between a source and a
    * target point cloud using an iterative non-linear Levenberg-Marquardt
    * approach. \param[in] cloud_src the source point cloud dataset \param[in]
@@ -0,0 +1,244 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+
+#include <lamp_utils/KeyedScanStore.h>
+#include <lamp_utils/PointCloudUtils.h>
+
+#include <pcl_conversions/pcl_conversions.h>
+
+namespace lamp_utils {
+
+KeyedScanStore::KeyedScanStore(size_t memory_budget)
+  : memory_budget_(memory_budget) {}
+
+KeyedScanStore::Ptr KeyedScanStore::Shared() {
+  static Ptr shared = std::make_shared<KeyedScanStore>();
+  return shared;
+}
+
+PointCloud::Ptr KeyedScanStore::Decode(const pose_graph_msgs::KeyedScan& msg) {
+  PointCloud::Ptr scan(new PointCloud);
+  pcl::fromROSMsg(msg.scan, *scan);
+  return scan;
+}
+
+size_t KeyedScanStore::CloudBytes(const PointCloud& scan) {
+  return sizeof(PointCloud) + scan.points.size() * sizeof(Point);
+}
+
+size_t KeyedScanStore::MessageBytes(const pose_graph_msgs::KeyedScan& msg) {
+  return sizeof(pose_graph_msgs::KeyedScan) + msg.scan.data.size() +
+      msg.scan.fields.size() * sizeof(sensor_msgs::PointField);
+}
+
+void KeyedScanStore::SetMemoryBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  memory_budget_ = bytes;
+  Evict();
+}
+
+size_t KeyedScanStore::GetMemoryBudget() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return memory_budget_;
+}
+
+PointCloudConstPtr KeyedScanStore::Add(
+    const pose_graph_msgs::KeyedScan::ConstPtr& msg) {
+  bool evicted = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(msg->key);
+    if (it != entries_.end()) {
+      if (it->second.scan) {
+        Touch(&it->second);
+        return it->second.scan;
+      }
+      evicted = true;
+    }
+  }
+  if (evicted)
+    return Get(msg->key);
+
+  // Decode outside the lock so other keys can be served meanwhile
+  PointCloudConstPtr scan = Decode(*msg);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.decodes++;
+  return Insert(msg->key, msg, scan);
+}
+
+PointCloudConstPtr KeyedScanStore::Add(const gtsam::Key& key,
+                                       const PointCloudConstPtr& scan) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return Insert(key, nullptr, scan);
+}
+
+bool KeyedScanStore::Has(const gtsam::Key& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.count(key) > 0;
+}
+
+PointCloudConstPtr KeyedScanStore::Get(const gtsam::Key& key) {
+  pose_graph_msgs::KeyedScan::ConstPtr msg;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+      return nullptr;
+    if (it->second.scan) {
+      Touch(&it->second);
+      return it->second.scan;
+    }
+    msg = it->second.msg;
+  }
+  if (!msg)
+    return nullptr;
+
+  // Evicted, decode it again from the kept message
+  PointCloudConstPtr scan = Decode(*msg);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.decodes++;
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return scan;
+  if (it->second.scan) {
+    // Decoded concurrently by another caller
+    Touch(&it->second);
+    return it->second.scan;
+  }
+  SetDecoded(&it->second, key, scan);
+  Evict();
+  return scan;
+}
+
+bool KeyedScanStore::GetObservability(const gtsam::Key& key,
+                                      Eigen::Vector3d* eigenvalues) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+      return false;
+    if (it->second.has_observability) {
+      *eigenvalues = it->second.observability;
+      return true;
+    }
+  }
+  const PointCloudConstPtr scan = Get(key);
+  if (!scan)
+    return false;
+
+  // Computed outside the lock; a concurrent caller may compute it as well,
+  // both get the same result
+  ComputeIcpObservability(scan, eigenvalues);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.observability_computations++;
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    it->second.observability = *eigenvalues;
+    it->second.has_observability = true;
+  }
+  return true;
+}
+
+void KeyedScanStore::Erase(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return;
+  if (it->second.scan) {
+    stats_.num_decoded--;
+    stats_.decoded_bytes -= it->second.bytes;
+  }
+  stats_.message_bytes -= it->second.message_bytes;
+  if (it->second.in_lru)
+    lru_.erase(it->second.lru_it);
+  entries_.erase(it);
+}
+
+void KeyedScanStore::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  stats_.num_decoded = 0;
+  stats_.decoded_bytes = 0;
+  stats_.message_bytes = 0;
+}
+
+size_t KeyedScanStore::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+KeyedScanStoreStats KeyedScanStore::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  KeyedScanStoreStats stats = stats_;
+  stats.num_scans = entries_.size();
+  return stats;
+}
+
+PointCloudConstPtr KeyedScanStore::Insert(
+    const gtsam::Key& key,
+    const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+    const PointCloudConstPtr& scan) {
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    // Added by someone else in the meantime, keep the first scan
+    if (it->second.scan) {
+      Touch(&it->second);
+      return it->second.scan;
+    }
+    SetDecoded(&it->second, key, scan);
+    Evict();
+    return scan;
+  }
+
+  Entry& entry = entries_[key];
+  // Without a budget nothing is evicted and the message is not needed again
+  if (memory_budget_ > 0 && msg) {
+    entry.msg = msg;
+    entry.message_bytes = MessageBytes(*msg);
+    stats_.message_bytes += entry.message_bytes;
+  }
+  SetDecoded(&entry, key, scan);
+  Evict();
+  return scan;
+}
+
+void KeyedScanStore::SetDecoded(Entry* entry,
+                                const gtsam::Key& key,
+                                const PointCloudConstPtr& scan) {
+  entry->scan = scan;
+  entry->bytes = CloudBytes(*scan);
+  stats_.num_decoded++;
+  stats_.decoded_bytes += entry->bytes;
+  if (entry->msg) {
+    lru_.push_front(key);
+    entry->lru_it = lru_.begin();
+    entry->in_lru = true;
+  }
+}
+
+void KeyedScanStore::Touch(Entry* entry) {
+  if (entry->in_lru)
+    lru_.splice(lru_.begin(), lru_, entry->lru_it);
+}
+
+void KeyedScanStore::Evict() {
+  if (memory_budget_ == 0)
+    return;
+  // The messages cannot be dropped, only the decoded clouds
+  while (stats_.decoded_bytes + stats_.message_bytes > memory_budget_ &&
+         !lru_.empty()) {
+    Entry& entry = entries_.at(lru_.back());
+    lru_.pop_back();
+    entry.in_lru = false;
+    entry.scan.reset();
+    stats_.num_decoded--;
+    stats_.decoded_bytes -= entry.bytes;
+    stats_.evictions++;
+  }
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,108 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+
+#include <lamp_utils/OptimizerInput.h>
+
+namespace lamp_utils {
+
+OptimizerInputTracker::OptimizerInputTracker()
+  : epoch_(ros::WallTime::now().toNSec()) {}
+
+pose_graph_msgs::OptimizerInput::Ptr
+OptimizerInputTracker::Update(const PoseGraph& graph) {
+  if (b_full_)
+    return FullMessage(graph);
+
+  pose_graph_msgs::OptimizerInput::Ptr msg(new pose_graph_msgs::OptimizerInput);
+  size_t num_sent_nodes = 0;
+  for (const auto& n : graph.GetNodes()) {
+    if (sent_nodes_.count(n.key))
+      num_sent_nodes++;
+    else
+      msg->nodes.push_back(n);
+  }
+  if (num_sent_nodes < sent_nodes_.size()) {
+    RequestFull(true);
+    return FullMessage(graph);
+  }
+
+  size_t num_sent_edges = 0;
+  for (const EdgeSet* edges : {&graph.GetEdges(), &graph.GetPriors()}) {
+    for (const auto& e : *edges) {
+      if (sent_edges_.count(FactorId::FromMsg(e)))
+        num_sent_edges++;
+      else
+        msg->edges.push_back(e);
+    }
+  }
+  // Only look for the removed edges when some are missing
+  if (num_sent_edges < sent_edges_.size()) {
+    FactorIdSet current;
+    current.reserve(graph.GetEdges().size() + graph.GetPriors().size());
+    for (const EdgeSet* edges : {&graph.GetEdges(), &graph.GetPriors()}) {
+      for (const auto& e : *edges)
+        current.insert(FactorId::FromMsg(e));
+    }
+    for (auto it = sent_edges_.begin(); it != sent_edges_.end();) {
+      if (current.count(*it)) {
+        ++it;
+        continue;
+      }
+      pose_graph_msgs::PoseGraphEdge removed;
+      removed.key_from = it->key_from;
+      removed.key_to = it->key_to;
+      removed.type = it->type;
+      msg->removed_edges.push_back(removed);
+      it = sent_edges_.erase(it);
+    }
+  }
+
+  for (const auto& n : msg->nodes)
+    sent_nodes_.insert(n.key);
+  for (const auto& e : msg->edges)
+    sent_edges_.insert(FactorId::FromMsg(e));
+  Stamp(msg.get());
+  return msg;
+}
+
+void OptimizerInputTracker::RequestFull(bool new_epoch) {
+  b_full_ = true;
+  if (new_epoch) {
+    epoch_++;
+    sequence_ = 0;
+  }
+}
+
+pose_graph_msgs::OptimizerInput::Ptr
+OptimizerInputTracker::FullMessage(const PoseGraph& graph) {
+  pose_graph_msgs::OptimizerInput::Ptr msg(new pose_graph_msgs::OptimizerInput);
+  msg->full = true;
+  sent_nodes_.clear();
+  sent_edges_.clear();
+  msg->nodes.reserve(graph.GetNodes().size());
+  for (const auto& n : graph.GetNodes()) {
+    msg->nodes.push_back(n);
+    sent_nodes_.insert(n.key);
+  }
+  msg->edges.reserve(graph.GetEdges().size() + graph.GetPriors().size());
+  for (const EdgeSet* edges : {&graph.GetEdges(), &graph.GetPriors()}) {
+    for (const auto& e : *edges) {
+      msg->edges.push_back(e);
+      sent_edges_.insert(FactorId::FromMsg(e));
+    }
+  }
+  b_full_ = false;
+  Stamp(msg.get());
+  return msg;
+}
+
+void OptimizerInputTracker::Stamp(pose_graph_msgs::OptimizerInput* msg) {
+  msg->header.stamp = ros::Time::now();
+  msg->epoch = epoch_;
+  msg->sequence = sequence_++;
+}
+
+}  // namespace lamp_utils
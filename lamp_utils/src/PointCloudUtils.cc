@@ -5,6 +5,8 @@ Some utility functions for wokring with Point Clouds
 */
 #include "lamp_utils/PointCloudUtils.h"
 
+#include <Eigen/Eigenvalues>
+#include <Eigen/LU>
 #include <geometry_utils/Transform3.h>
 #include <pcl/features/fpfh_omp.h>
 #include <pcl/filters/voxel_grid.h>
@@ -12,6 +14,11 @@ Some utility functions for wokring with Point Clouds
 #include <pcl/registration/ia_ransac.h>
 #include <pcl_conversions/pcl_conversions.h>
 
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
 namespace lamp_utils {
 
 void ExtractNormals(const PointCloud::ConstPtr& input,
@@ -165,29 +172,43 @@ void ComputeAp_ForPoint2PlaneICP(const PointCloud::Ptr query_normalized,
 void ComputeIcpObservability(PointCloud::ConstPtr cloud,
                              Eigen::Matrix<double, 3, 1>* eigenvalues,
                              const NormalComputeParams& params) {
-  // Get normals
-  Normals::Ptr normals(new Normals);          // pc with normals
-  PointCloud::Ptr normalized(new PointCloud); // pc whose points have been
-                                              // rearranged.
-  lamp_utils::ExtractNormals(cloud, normals, params);
-  lamp_utils::NormalizePCloud(cloud, normalized);
+  *eigenvalues = Eigen::Matrix<double, 3, 1>::Zero();
+  if (cloud->empty())
+    return;
 
-  for (size_t i = 0; i < cloud->size(); i++) {
-    Point p = cloud->points[i];
-    pcl::Normal n = normals->points[i];
+  // The translation block of the point-to-plane Hessian (as accumulated by
+  // ComputeAp_ForPoint2PlaneICP with the identity) is the sum of n n^T, so
+  // neither the normalized cloud nor the rotation block are needed. Reuse the
+  // normals carried by the points when there are any, as ExtractNormals does.
+  Normals::Ptr normals;
+  if (cloud->points[0].normal_x == 0 && cloud->points[0].normal_y == 0 &&
+      cloud->points[0].normal_z == 0) {
+    normals.reset(new Normals);
+    ComputeNormals<Point>(cloud, params, normals);
   }
 
-  // Correspondence with itself (not really used anyways)
-  std::vector<size_t> c(cloud->size());
-  std::iota(std::begin(c), std::end(c), 0); // Fill with 0, 1, ...
-
-  Eigen::Matrix4f T_unsued = Eigen::Matrix4f::Identity(); // Unused
+  // Single pass over the six distinct entries
+  double xx = 0, xy = 0, xz = 0, yy = 0, yz = 0, zz = 0;
+  for (size_t i = 0; i < cloud->size(); i++) {
+    const Point& p = cloud->points[i];
+    const float* n = normals ? normals->points[i].normal : p.normal;
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z) ||
+        !std::isfinite(n[0]) || !std::isfinite(n[1]) || !std::isfinite(n[2]))
+      continue;
+    const double nx = n[0], ny = n[1], nz = n[2];
+    xx += nx * nx;
+    xy += nx * ny;
+    xz += nx * nz;
+    yy += ny * ny;
+    yz += ny * nz;
+    zz += nz * nz;
+  }
+  Eigen::Matrix3d A;
+  A << xx, xy, xz, xy, yy, yz, xz, yz, zz;
 
-  Eigen::Matrix<double, 6, 6> Ap;
-  // Compute Ap and its eigenvalues
-  lamp_utils::ComputeAp_ForPoint2PlaneICP(normalized, normals, c, T_unsued, Ap);
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 3, 3>> eigensolver(
-      Ap.block(3, 3, 3, 3));
+  // Closed form for 3x3, eigenvalues in increasing order
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver;
+  eigensolver.computeDirect(A, Eigen::EigenvaluesOnly);
   if (eigensolver.info() == Eigen::Success) {
     *eigenvalues = eigensolver.eigenvalues();
   } else {
@@ -195,6 +216,221 @@ void ComputeIcpObservability(PointCloud::ConstPtr cloud,
   }
 }
 
+namespace {
+
+// Trigonometric terms of the point-to-point ICP Jacobian, which only depend
+// on the transform and so are computed once per cloud
+struct PointPointJacobianTerms {
+  PointPointJacobianTerms(
+      double r, double p, double y, double tx, double ty, double tz)
+    : t_x(tx), t_y(ty), t_z(tz) {
+    const double sr = std::sin(r), cr = std::cos(r);
+    const double sp = std::sin(p), cp = std::cos(p);
+    const double sy = std::sin(y), cy = std::cos(y);
+    sin_p = sp;
+    cos_p = cp;
+    cy_sp = cy * sp;
+    sp_sy = sp * sy;
+    cp_cy = cp * cy;
+    cp_sy = cp * sy;
+    a = sr * sy - cp * cr * cy;
+    b = cy * sr + cp * cr * sy;
+    c = cr * sy + cp * cy * sr;
+    d = cr * cy - cp * sr * sy;
+    cr_sp = cr * sp;
+    sp_sr = sp * sr;
+    cp_cr = cp * cr;
+    cp_sr = cp * sr;
+    cr_cy_sp = cr * cy * sp;
+    cr_sp_sy = cr * sp * sy;
+    cy_sp_sr = cy * sp * sr;
+    sp_sr_sy = sp * sr * sy;
+  }
+
+  double t_x, t_y, t_z;
+  double sin_p, cos_p, cy_sp, sp_sy, cp_cy, cp_sy;
+  double a, b, c, d;
+  double cr_sp, sp_sr, cp_cr, cp_sr, cr_cy_sp, cr_sp_sy, cy_sp_sr, sp_sr_sy;
+};
+
+// Points per batch, small enough for the batch arrays to stay in cache
+const int kPointPointBatchSize = 256;
+
+// Adds J^T J of the points in [begin, end) to H. Points are copied into
+// structure-of-arrays batches so that Eigen vectorizes the Jacobian entries
+// and the sums. Only the 11 non-zero Jacobian entries are computed.
+void AccumulatePointPointHessian(const Point* points,
+                                 size_t begin,
+                                 size_t end,
+                                 const PointPointJacobianTerms& k,
+                                 Eigen::Matrix<double, 6, 6>* H) {
+  typedef Eigen::Array<double, Eigen::Dynamic, 1> ArrayXd;
+  ArrayXd x(kPointPointBatchSize), y(kPointPointBatchSize),
+      z(kPointPointBatchSize);
+  // Upper triangle of H, summed over all batches
+  double h[6][6] = {};
+  for (size_t start = begin; start < end; start += kPointPointBatchSize) {
+    const int n = static_cast<int>(
+        std::min<size_t>(kPointPointBatchSize, end - start));
+    if (n < kPointPointBatchSize) {
+      x.resize(n);
+      y.resize(n);
+      z.resize(n);
+    }
+    for (int i = 0; i < n; i++) {
+      x[i] = points[start + i].x;
+      y[i] = points[start + i].y;
+      z[i] = points[start + i].z;
+    }
+
+    // Residual-like factors shared by each row of the Jacobian
+    const ArrayXd e1 = k.t_x - x + z * k.cos_p - x * k.cy_sp + y * k.sp_sy;
+    const ArrayXd e2 = y - k.t_y + x * k.a + y * k.b - z * k.cr_sp;
+    const ArrayXd e3 = k.t_z - z + x * k.c + y * k.d + z * k.sp_sr;
+
+    // Row 1 (columns 1, 2, 3)
+    const ArrayXd j12 = -2.0 * (z * k.sin_p + x * k.cp_cy - y * k.cp_sy) * e1;
+    const ArrayXd j13 = 2.0 * (y * k.cy_sp + x * k.sp_sy) * e1;
+    const ArrayXd j14 = 2.0 * e1;
+    // Row 2 (columns 0, 1, 2, 4)
+    const ArrayXd j21 = 2.0 * (x * k.c + y * k.d + z * k.sp_sr) * e2;
+    const ArrayXd j22 =
+        -2.0 * (z * k.cp_cr - x * k.cr_cy_sp + y * k.cr_sp_sy) * e2;
+    const ArrayXd j23 = 2.0 * (x * k.b - y * k.a) * e2;
+    const ArrayXd j25 = -2.0 * e2;
+    // Row 3 (columns 0, 1, 2, 5)
+    const ArrayXd j31 = -2.0 * (x * k.a + y * k.b - z * k.cr_sp) * e3;
+    const ArrayXd j32 =
+        2.0 * (z * k.cp_sr - x * k.cy_sp_sr + y * k.sp_sr_sy) * e3;
+    const ArrayXd j33 = 2.0 * (x * k.d - y * k.c) * e3;
+    const ArrayXd j36 = 2.0 * e3;
+
+    h[0][0] += (j21 * j21 + j31 * j31).sum();
+    h[0][1] += (j21 * j22 + j31 * j32).sum();
+    h[0][2] += (j21 * j23 + j31 * j33).sum();
+    h[0][4] += (j21 * j25).sum();
+    h[0][5] += (j31 * j36).sum();
+    h[1][1] += (j12 * j12 + j22 * j22 + j32 * j32).sum();
+    h[1][2] += (j12 * j13 + j22 * j23 + j32 * j33).sum();
+    h[1][3] += (j12 * j14).sum();
+    h[1][4] += (j22 * j25).sum();
+    h[1][5] += (j32 * j36).sum();
+    h[2][2] += (j13 * j13 + j23 * j23 + j33 * j33).sum();
+    h[2][3] += (j13 * j14).sum();
+    h[2][4] += (j23 * j25).sum();
+    h[2][5] += (j33 * j36).sum();
+    h[3][3] += (j14 * j14).sum();
+    h[4][4] += (j25 * j25).sum();
+    h[5][5] += (j36 * j36).sum();
+  }
+  for (int i = 0; i < 6; i++) {
+    for (int j = i; j < 6; j++) {
+      (*H)(i, j) += h[i][j];
+      if (i != j)
+        (*H)(j, i) += h[i][j];
+    }
+  }
+}
+
+Eigen::Matrix<double, 6, 6> PointPointHessian(const Point* points,
+                                              size_t size,
+                                              const PointPointJacobianTerms& k,
+                                              int num_threads) {
+  Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+  // Not worth starting a thread for less than 16 batches
+  const size_t num_batches =
+      (size + kPointPointBatchSize - 1) / kPointPointBatchSize;
+  const size_t num_workers = std::max<size_t>(
+      1, std::min<size_t>(std::max(num_threads, 1), num_batches / 16));
+  if (num_workers == 1) {
+    AccumulatePointPointHessian(points, 0, size, k, &H);
+    return H;
+  }
+
+  // Each thread reduces a contiguous range of batches, the partial sums are
+  // added at the end
+  std::vector<Eigen::Matrix<double, 6, 6>,
+              Eigen::aligned_allocator<Eigen::Matrix<double, 6, 6>>>
+      partial(num_workers, Eigen::Matrix<double, 6, 6>::Zero());
+  std::vector<std::thread> workers;
+  const size_t batches_per_worker =
+      (num_batches + num_workers - 1) / num_workers;
+  for (size_t w = 0; w < num_workers; w++) {
+    const size_t begin =
+        std::min(size, w * batches_per_worker * kPointPointBatchSize);
+    const size_t end =
+        std::min(size, (w + 1) * batches_per_worker * kPointPointBatchSize);
+    workers.emplace_back([=, &k, &partial]() {
+      AccumulatePointPointHessian(points, begin, end, k, &partial[w]);
+    });
+  }
+  for (size_t w = 0; w < num_workers; w++) {
+    workers[w].join();
+    H += partial[w];
+  }
+  return H;
+}
+
+} // namespace
+
+Eigen::Matrix<double, 6, 6>
+ComputeICPHessianPointPoint(const PointCloud::ConstPtr& pointCloud,
+                            const Eigen::Matrix4f& T,
+                            int num_threads) {
+  // Extract roll, pitch and yaw from T
+  const geometry_utils::Rot3 rotation(T(0, 0),
+                                      T(0, 1),
+                                      T(0, 2),
+                                      T(1, 0),
+                                      T(1, 1),
+                                      T(1, 2),
+                                      T(2, 0),
+                                      T(2, 1),
+                                      T(2, 2));
+  const PointPointJacobianTerms terms(rotation.Roll(),
+                                      rotation.Pitch(),
+                                      rotation.Yaw(),
+                                      T(0, 3),
+                                      T(1, 3),
+                                      T(2, 3));
+  return PointPointHessian(
+      pointCloud->points.data(), pointCloud->size(), terms, num_threads);
+}
+
+bool ComputeICPCovariancePointPoint(const PointCloud::ConstPtr& pointCloud,
+                                    const Eigen::Matrix4f& T,
+                                    const double& icp_fitness,
+                                    Eigen::Matrix<double, 6, 6>& covariance,
+                                    int num_threads) {
+  const Eigen::Matrix<double, 6, 6> H =
+      ComputeICPHessianPointPoint(pointCloud, T, num_threads);
+  covariance = H.inverse() * icp_fitness;
+
+  // Here bound the covariance using eigen values
+  Eigen::EigenSolver<Eigen::MatrixXd> eigensolver;
+  eigensolver.compute(covariance);
+  Eigen::VectorXd eigen_values = eigensolver.eigenvalues().real();
+  Eigen::MatrixXd eigen_vectors = eigensolver.eigenvectors().real();
+  double lower_bound = 0.001; // Should be positive semidef
+  double upper_bound = 1000;
+  if (eigen_values.size() < 6) {
+    covariance = Eigen::MatrixXd::Identity(6, 6) * upper_bound;
+    ROS_ERROR("Failed to find eigen values when computing icp covariance");
+    return false;
+  }
+  for (size_t i = 0; i < 6; i++) {
+    if (eigen_values[i] < lower_bound)
+      eigen_values[i] = lower_bound;
+    if (eigen_values[i] > upper_bound)
+      eigen_values[i] = upper_bound;
+  }
+  // Update covariance matrix after bound
+  covariance =
+      eigen_vectors * eigen_values.asDiagonal() * eigen_vectors.inverse();
+
+  return true;
+}
+
 void ConvertPointCloud(const PointCloud::ConstPtr& point_normal_cloud,
                        PointXyziCloud::Ptr point_cloud) {
   assert(NULL != point_normal_cloud);
@@ -0,0 +1,241 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+
+#include <lamp_utils/WorkStealingExecutor.h>
+
+namespace lamp_utils {
+
+namespace {
+// Lets a task submitted from inside a worker go to that worker's own deque
+thread_local const WorkStealingExecutor* tl_executor = nullptr;
+thread_local size_t tl_worker_index = 0;
+} // namespace
+
+constexpr size_t WorkStealingExecutor::kNumPriorities;
+
+WorkStealingExecutor::WorkStealingExecutor(size_t num_threads) {
+  if (num_threads > 0)
+    Resize(num_threads);
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+  Stop();
+}
+
+void WorkStealingExecutor::Resize(size_t num_threads) {
+  if (num_threads == 0) {
+    Stop();
+    return;
+  }
+
+  size_t num_workers;
+  {
+    std::unique_lock<std::shared_timed_mutex> lock(workers_mutex_);
+    {
+      std::lock_guard<std::mutex> idle_lock(idle_mutex_);
+      stop_ = false;
+    }
+
+    num_workers = workers_.size();
+    if (num_threads >= num_workers) {
+      for (size_t i = num_workers; i < num_threads; i++) {
+        workers_.emplace_back(new Worker);
+        Worker* worker = workers_.back().get();
+        worker->thread =
+            std::thread(&WorkStealingExecutor::WorkerLoop, this, worker, i);
+      }
+      num_active_ = num_threads;
+      return;
+    }
+
+    // Hand the queued tasks of the retiring workers to the remaining ones
+    num_active_ = num_threads;
+    for (size_t i = num_threads; i < num_workers; i++) {
+      Worker& retiring = *workers_[i];
+      Worker& heir = *workers_[i % num_threads];
+      std::lock(retiring.mutex, heir.mutex);
+      std::lock_guard<std::mutex> retiring_lock(retiring.mutex,
+                                                std::adopt_lock);
+      std::lock_guard<std::mutex> heir_lock(heir.mutex, std::adopt_lock);
+      retiring.retire = true;
+      for (size_t p = 0; p < kNumPriorities; p++) {
+        for (auto& task : retiring.tasks[p]) {
+          heir.tasks[p].push_back(std::move(task));
+        }
+        retiring.tasks[p].clear();
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> idle_lock(idle_mutex_);
+  }
+  idle_cv_.notify_all();
+  for (size_t i = num_threads; i < num_workers; i++) {
+    workers_[i]->thread.join();
+  }
+
+  std::unique_lock<std::shared_timed_mutex> lock(workers_mutex_);
+  workers_.resize(num_threads);
+}
+
+void WorkStealingExecutor::Stop() {
+  {
+    std::lock_guard<std::mutex> idle_lock(idle_mutex_);
+    stop_ = true;
+  }
+  idle_cv_.notify_all();
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable())
+      worker->thread.join();
+  }
+
+  std::unique_lock<std::shared_timed_mutex> lock(workers_mutex_);
+  workers_.clear();
+  num_active_ = 0;
+}
+
+size_t WorkStealingExecutor::NumThreads() const {
+  std::shared_lock<std::shared_timed_mutex> lock(workers_mutex_);
+  return num_active_;
+}
+
+ExecutorStats WorkStealingExecutor::GetStats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  ExecutorStats stats = stats_;
+  stats.pending = pending_.load();
+  return stats;
+}
+
+void WorkStealingExecutor::Push(TaskPtr task) {
+  std::shared_lock<std::shared_timed_mutex> lock(workers_mutex_);
+  if (num_active_ == 0) {
+    // Without workers the submitter runs the task itself
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+      stats_.submitted++;
+    }
+    Execute(std::move(task));
+    return;
+  }
+
+  size_t index;
+  if (tl_executor == this && tl_worker_index < num_active_) {
+    index = tl_worker_index;
+  } else {
+    index = next_worker_++ % num_active_;
+  }
+
+  Worker& worker = *workers_[index];
+  const size_t priority = static_cast<size_t>(task->options_.priority);
+  // Count before pushing so a worker never takes a task that is not counted
+  pending_++;
+  {
+    std::lock_guard<std::mutex> worker_lock(worker.mutex);
+    worker.tasks[priority].push_back(std::move(task));
+  }
+  lock.unlock();
+
+  {
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    stats_.submitted++;
+  }
+  {
+    std::lock_guard<std::mutex> idle_lock(idle_mutex_);
+  }
+  idle_cv_.notify_one();
+}
+
+bool WorkStealingExecutor::PopLocal(Worker& worker, TaskPtr* task) {
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  for (size_t p = kNumPriorities; p-- > 0;) {
+    if (!worker.tasks[p].empty()) {
+      *task = std::move(worker.tasks[p].front());
+      worker.tasks[p].pop_front();
+      pending_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkStealingExecutor::Steal(size_t thief, TaskPtr* task) {
+  std::shared_lock<std::shared_timed_mutex> lock(workers_mutex_);
+  const size_t num_workers = workers_.size();
+  // Owners take from the front, thieves from the back
+  for (size_t p = kNumPriorities; p-- > 0;) {
+    for (size_t k = 1; k < num_workers; k++) {
+      Worker& victim = *workers_[(thief + k) % num_workers];
+      std::lock_guard<std::mutex> victim_lock(victim.mutex);
+      if (!victim.tasks[p].empty()) {
+        *task = std::move(victim.tasks[p].back());
+        victim.tasks[p].pop_back();
+        pending_--;
+        std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+        stats_.stolen++;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void WorkStealingExecutor::Execute(TaskPtr task) {
+  if (task->options_.token.IsCancelled()) {
+    {
+      std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+      stats_.cancelled++;
+    }
+    task->Cancel();
+    return;
+  }
+
+  const TimePoint start = Clock::now();
+  task->Invoke();
+  const TimePoint end = Clock::now();
+
+  const double queue_time =
+      std::chrono::duration<double>(start - task->submit_time_).count();
+  const double run_time = std::chrono::duration<double>(end - start).count();
+  if (task->options_.timing) {
+    task->options_.timing->queue_time = queue_time;
+    task->options_.timing->run_time = run_time;
+  }
+  {
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    stats_.completed++;
+    stats_.total_queue_time += queue_time;
+    stats_.total_run_time += run_time;
+    if (run_time > stats_.max_run_time)
+      stats_.max_run_time = run_time;
+  }
+  task->Finish();
+}
+
+void WorkStealingExecutor::WorkerLoop(Worker* worker, size_t index) {
+  tl_executor = this;
+  tl_worker_index = index;
+  while (true) {
+    // Resize has already handed this worker's tasks to another one
+    if (worker->retire)
+      return;
+
+    TaskPtr task;
+    if (PopLocal(*worker, &task) || Steal(index, &task)) {
+      Execute(std::move(task));
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    if (stop_ && pending_ == 0)
+      return;
+    idle_cv_.wait(lock,
+                  [&] { return stop_ || worker->retire || pending_ > 0; });
+  }
+}
+
+} // namespace lamp_utils
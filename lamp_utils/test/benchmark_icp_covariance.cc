@@ -0,0 +1,80 @@
+/**
+ *  @brief Micro-benchmark of the point-to-point ICP covariance kernel against
+ *  the original per-point implementation
+ *
+ *  Usage: benchmark_icp_covariance [num_threads]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include <lamp_utils/PointCloudUtils.h>
+
+#include "icp_covariance_reference.h"
+
+namespace {
+
+template <typename F>
+double MeanMicroseconds(const F& f, size_t repetitions) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < repetitions; i++) {
+    f();
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+      repetitions;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const int num_threads = argc > 1 ? std::atoi(argv[1]) : 4;
+
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T.block<3, 3>(0, 0) =
+      (Eigen::AngleAxisf(0.3, Eigen::Vector3f::UnitZ()) *
+       Eigen::AngleAxisf(-0.2, Eigen::Vector3f::UnitY()) *
+       Eigen::AngleAxisf(0.1, Eigen::Vector3f::UnitX()))
+          .toRotationMatrix();
+  T.block<3, 1>(0, 3) = Eigen::Vector3f(1.0, -2.0, 0.5);
+
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> coordinate(-50, 50);
+  std::cout << "points, reference (us), batched (us), batched with "
+            << num_threads << " threads (us), max relative error"
+            << std::endl;
+  for (size_t num_points : {1000, 10000, 100000}) {
+    PointCloud::Ptr cloud(new PointCloud);
+    for (size_t i = 0; i < num_points; i++) {
+      Point point;
+      point.x = coordinate(generator);
+      point.y = coordinate(generator);
+      point.z = coordinate(generator);
+      cloud->push_back(point);
+    }
+
+    const size_t repetitions = 10000000 / num_points;
+    Eigen::Matrix<double, 6, 6> reference, batched, threaded;
+    const double reference_time = MeanMicroseconds(
+        [&]() { reference = ReferenceICPHessianPointPoint(cloud, T); },
+        repetitions);
+    const double batched_time = MeanMicroseconds(
+        [&]() { batched = lamp_utils::ComputeICPHessianPointPoint(cloud, T); },
+        repetitions);
+    const double threaded_time = MeanMicroseconds(
+        [&]() {
+          threaded =
+              lamp_utils::ComputeICPHessianPointPoint(cloud, T, num_threads);
+        },
+        repetitions);
+
+    const double error =
+        std::max((batched - reference).norm(), (threaded - reference).norm()) /
+        reference.norm();
+    std::cout << num_points << ", " << reference_time << ", " << batched_time
+              << ", " << threaded_time << ", " << error << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*
+icp_covariance_reference.h
+Author: Yun Chang
+Original per-point implementation of the point-to-point ICP Hessian, used
+to check and benchmark lamp_utils::ComputeICPHessianPointPoint
+*/
+
+#pragma once
+
+#include <cmath>
+
+#include <geometry_utils/Transform3.h>
+#include <lamp_utils/PointCloudUtils.h>
+
+inline Eigen::Matrix<double, 6, 6>
+ReferenceICPHessianPointPoint(const PointCloud::ConstPtr& pointCloud,
+                              const Eigen::Matrix4f& T) {
+  double t_x = T(0, 3);
+  double t_y = T(1, 3);
+  double t_z = T(2, 3);
+
+  geometry_utils::Rot3 rotation(T(0, 0),
+                                T(0, 1),
+                                T(0, 2),
+                                T(1, 0),
+                                T(1, 1),
+                                T(1, 2),
+                                T(2, 0),
+                                T(2, 1),
+                                T(2, 2));
+  double r = rotation.Roll();
+  double p = rotation.Pitch();
+  double y = rotation.Yaw();
+
+  double J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
+      J33, J34, J35, J36;
+
+  Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+  for (size_t i = 0; i < pointCloud->points.size(); ++i) {
+    double p_x = pointCloud->points[i].x;
+    double p_y = pointCloud->points[i].y;
+    double p_z = pointCloud->points[i].z;
+
+    J11 = 0.0;
+    J12 = -2.0 *
+        (p_z * sin(p) + p_x * cos(p) * cos(y) - p_y * cos(p) * sin(y)) *
+        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
+         p_y * sin(p) * sin(y));
+    J13 = 2.0 * (p_y * cos(y) * sin(p) + p_x * sin(p) * sin(y)) *
+        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
+         p_y * sin(p) * sin(y));
+    J14 = 2.0 * t_x - 2.0 * p_x + 2.0 * p_z * cos(p) -
+        2.0 * p_x * cos(y) * sin(p) + 2.0 * p_y * sin(p) * sin(y);
+    J15 = 0.0;
+    J16 = 0.0;
+
+    J21 = 2.0 *
+        (p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
+         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
+         p_z * sin(p) * sin(r)) *
+        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
+         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
+         p_z * cos(r) * sin(p));
+    J22 = -2.0 *
+        (p_z * cos(p) * cos(r) - p_x * cos(r) * cos(y) * sin(p) +
+         p_y * cos(r) * sin(p) * sin(y)) *
+        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
+         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
+         p_z * cos(r) * sin(p));
+    J23 = 2.0 *
+        (p_x * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
+         p_y * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y))) *
+        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
+         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
+         p_z * cos(r) * sin(p));
+    J24 = 0.0;
+    J25 = 2.0 * t_y - 2.0 * p_y -
+        2.0 * p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) -
+        2.0 * p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) +
+        2.0 * p_z * cos(r) * sin(p);
+    J26 = 0.0;
+
+    J31 = -2.0 *
+        (p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
+         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
+         p_z * cos(r) * sin(p)) *
+        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
+         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
+         p_z * sin(p) * sin(r));
+    J32 = 2.0 *
+        (p_z * cos(p) * sin(r) - p_x * cos(y) * sin(p) * sin(r) +
+         p_y * sin(p) * sin(r) * sin(y)) *
+        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
+         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
+         p_z * sin(p) * sin(r));
+    J33 = 2.0 *
+        (p_x * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) -
+         p_y * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r))) *
+        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
+         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
+         p_z * sin(p) * sin(r));
+    J34 = 0.0;
+    J35 = 0.0;
+    J36 = 2.0 * t_z - 2.0 * p_z +
+        2.0 * p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
+        2.0 * p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
+        2.0 * p_z * sin(p) * sin(r);
+
+    Eigen::Matrix<double, 3, 6> J;
+    J << J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
+        J33, J34, J35, J36;
+    H += J.transpose() * J;
+  }
+  return H;
+}
@@ -19,6 +19,9 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/KeyedScanStore.h>
+#include <lamp_utils/WorkStealingExecutor.h>
+#include <pcl_conversions/pcl_conversions.h>
 
 class TestUtils : public ::testing::Test {
   public:
@@ -172,6 +175,124 @@ TEST(TestCommonFunctions, TestGtsamToRosPoseCovar) {
   EXPECT_NEAR(ros_pose.covariance[0], 1.0, 1e-7);
 }
 
+TEST(TestWorkStealingExecutor, RunsAllTasks) {
+  lamp_utils::WorkStealingExecutor executor(4);
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 200; i++) {
+    lamp_utils::TaskOptions options;
+    options.priority = lamp_utils::TaskPriority(i % 3);
+    futures.push_back(executor.Submit([i]() { return 2 * i; }, options));
+  }
+  // Shrinking must not lose queued tasks
+  executor.Resize(2);
+  for (int i = 0; i < 200; i++) {
+    EXPECT_EQ(2 * i, futures[i].get());
+  }
+  EXPECT_EQ(200, executor.GetStats().completed);
+  EXPECT_EQ(2, executor.NumThreads());
+}
+
+TEST(TestWorkStealingExecutor, CancelAndTiming) {
+  lamp_utils::WorkStealingExecutor executor(2);
+
+  lamp_utils::TaskOptions cancelled;
+  cancelled.token.Cancel();
+  auto cancelled_future = executor.Submit([]() { return 1; }, cancelled);
+  EXPECT_THROW(cancelled_future.get(), lamp_utils::TaskCancelled);
+
+  lamp_utils::TaskOptions timed;
+  timed.timing = std::make_shared<lamp_utils::TaskTiming>();
+  executor
+      .Submit([]() { std::this_thread::sleep_for(std::chrono::milliseconds(10)); },
+              timed)
+      .get();
+  EXPECT_GE(timed.timing->run_time, 0.009);
+  EXPECT_EQ(1, executor.GetStats().cancelled);
+}
+
+TEST(TestWorkStealingExecutor, RunsInlineWithoutWorkers) {
+  lamp_utils::WorkStealingExecutor executor(0);
+  EXPECT_EQ(0, executor.NumThreads());
+  auto future = executor.Submit([]() { return std::this_thread::get_id(); });
+  EXPECT_EQ(std::this_thread::get_id(), future.get());
+
+  executor.Resize(1);
+  executor.Stop();
+  EXPECT_EQ(3, executor.Submit([]() { return 3; }).get());
+  EXPECT_EQ(2, executor.GetStats().completed);
+}
+
+pose_graph_msgs::KeyedScan::ConstPtr MakeKeyedScan(gtsam::Key key,
+                                                   size_t num_points) {
+  PointCloud cloud;
+  cloud.points.resize(num_points);
+  pose_graph_msgs::KeyedScan::Ptr msg(new pose_graph_msgs::KeyedScan);
+  msg->key = key;
+  pcl::toROSMsg(cloud, msg->scan);
+  return msg;
+}
+
+TEST(TestKeyedScanStore, DecodesOnce) {
+  lamp_utils::KeyedScanStore store;
+  const gtsam::Key key = gtsam::Symbol('a', 0);
+  PointCloudConstPtr first = store.Add(MakeKeyedScan(key, 10));
+  // Every consumer gets the same cloud
+  EXPECT_EQ(first, store.Add(MakeKeyedScan(key, 10)));
+  EXPECT_EQ(first, store.Get(key));
+  EXPECT_EQ(10, first->size());
+  EXPECT_EQ(1, store.GetStats().decodes);
+  EXPECT_FALSE(store.Get(gtsam::Symbol('a', 1)));
+}
+
+TEST(TestKeyedScanStore, MemoryBudget) {
+  const size_t scan_bytes = sizeof(PointCloud) + 100 * sizeof(Point);
+  const pose_graph_msgs::KeyedScan::ConstPtr probe = MakeKeyedScan(0, 100);
+  const size_t message_bytes = sizeof(pose_graph_msgs::KeyedScan) +
+      probe->scan.data.size() +
+      probe->scan.fields.size() * sizeof(sensor_msgs::PointField);
+  // The kept messages count against the budget as well
+  const size_t budget = 3 * message_bytes + 2 * scan_bytes;
+  lamp_utils::KeyedScanStore store(budget);
+  store.Add(MakeKeyedScan(0, 100));
+  store.Add(MakeKeyedScan(1, 100));
+  store.Get(0);
+  // Evicts scan 1, the least recently used
+  store.Add(MakeKeyedScan(2, 100));
+  lamp_utils::KeyedScanStoreStats stats = store.GetStats();
+  EXPECT_EQ(3, stats.num_scans);
+  EXPECT_EQ(2, stats.num_decoded);
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_EQ(3 * message_bytes, stats.message_bytes);
+  EXPECT_LE(stats.decoded_bytes + stats.message_bytes, budget);
+
+  // Evicted scans are decoded again from the kept message
+  EXPECT_TRUE(store.Has(1));
+  EXPECT_EQ(100, store.Get(1)->size());
+  EXPECT_EQ(4, store.GetStats().decodes);
+}
+
+TEST(TestKeyedScanStore, ObservabilityComputedOnce) {
+  lamp_utils::KeyedScanStore store;
+  PointCloud::Ptr plane(new PointCloud);
+  for (size_t i = 0; i < 10; i++) {
+    Point point;
+    point.x = static_cast<float>(i);
+    point.normal_z = 1;
+    plane->push_back(point);
+  }
+  store.Add(0, plane);
+
+  Eigen::Vector3d eigenvalues;
+  ASSERT_TRUE(store.GetObservability(0, &eigenvalues));
+  EXPECT_NEAR(0, eigenvalues(0), 1e-9);
+  EXPECT_NEAR(0, eigenvalues(1), 1e-9);
+  EXPECT_NEAR(10, eigenvalues(2), 1e-9);
+  ASSERT_TRUE(store.GetObservability(0, &eigenvalues));
+  EXPECT_NEAR(10, eigenvalues(2), 1e-9);
+  EXPECT_EQ(1, store.GetStats().observability_computations);
+  EXPECT_FALSE(store.GetObservability(1, &eigenvalues));
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_utils");
@@ -6,12 +6,14 @@
 #include <gtest/gtest.h>
 
 #include <math.h>
+#include <random>
 #include <pcl/common/transforms.h>
 #include <pcl/io/pcd_io.h>
 #include <ros/ros.h>
 
 #include <lamp_utils/PointCloudUtils.h>
 
+#include "icp_covariance_reference.h"
 #include "test_artifacts.h"
 
 namespace lamp_utils {
@@ -180,6 +182,27 @@ TEST_F(TestPointCloudUtils, ComputeIcpObservability) {
   EXPECT_NEAR(eigenvalues_new(2), 100, tolerance_);
 }
 
+TEST_F(TestPointCloudUtils, ComputeIcpObservabilityMatchesAp) {
+  // The corner carries its normals, which are used as they are
+  auto corner = GenerateCorner();
+  Normals::Ptr normals(new Normals);
+  PointCloud::Ptr normalized(new PointCloud);
+  ExtractNormals(corner, normals);
+  NormalizePCloud(corner, normalized);
+  std::vector<size_t> correspondences(corner->size());
+  std::iota(std::begin(correspondences), std::end(correspondences), 0);
+  Eigen::Matrix<double, 6, 6> Ap;
+  ComputeAp_ForPoint2PlaneICP(
+      normalized, normals, correspondences, Eigen::Matrix4f::Identity(), Ap);
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver(
+      Ap.block<3, 3>(3, 3));
+
+  Eigen::Matrix<double, 3, 1> eigenvalues;
+  ComputeIcpObservability(corner, &eigenvalues);
+  for (size_t i = 0; i < 3; i++)
+    EXPECT_NEAR(eigensolver.eigenvalues()(i), eigenvalues(i), tolerance_);
+}
+
 TEST_F(TestPointCloudUtils, ComputeAp_ForPoint2PlaneICP) {
   PointCloud::Ptr plane(new PointCloud);
   plane = GeneratePlane();
@@ -230,6 +253,40 @@ TEST_F(TestPointCloudUtils, ComputeAp_ForPoint2PlaneICP) {
   EXPECT_NEAR(Ap(5, 5), 100, tolerance_);
 }
 
+TEST_F(TestPointCloudUtils, ComputeICPHessianPointPoint) {
+  // Enough points for several batches and for the threaded reduction
+  PointCloud::Ptr cloud(new PointCloud);
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> coordinate(-20, 20);
+  for (size_t i = 0; i < 10000; i++) {
+    Point point;
+    point.x = coordinate(generator);
+    point.y = coordinate(generator);
+    point.z = coordinate(generator);
+    cloud->push_back(point);
+  }
+
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T.block<3, 3>(0, 0) =
+      (Eigen::AngleAxisf(0.3, Eigen::Vector3f::UnitZ()) *
+       Eigen::AngleAxisf(-0.2, Eigen::Vector3f::UnitY()) *
+       Eigen::AngleAxisf(0.1, Eigen::Vector3f::UnitX()))
+          .toRotationMatrix();
+  T.block<3, 1>(0, 3) = Eigen::Vector3f(1.0, -2.0, 0.5);
+
+  const Eigen::Matrix<double, 6, 6> expected =
+      ReferenceICPHessianPointPoint(cloud, T);
+  const Eigen::Matrix<double, 6, 6> single_thread =
+      ComputeICPHessianPointPoint(cloud, T, 1);
+  const Eigen::Matrix<double, 6, 6> multi_thread =
+      ComputeICPHessianPointPoint(cloud, T, 4);
+  EXPECT_TRUE(expected.isApprox(single_thread, 1e-9));
+  EXPECT_TRUE(expected.isApprox(multi_thread, 1e-9));
+
+  Eigen::Matrix<double, 6, 6> covariance;
+  EXPECT_TRUE(ComputeICPCovariancePointPoint(cloud, T, 0.1, covariance, 4));
+}
+
 } // namespace lamp_utils
 
 int main(int argc, char** argv) {
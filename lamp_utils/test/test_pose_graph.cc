@@ -19,6 +19,7 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/OptimizerInput.h>
 #include <lamp_utils/PoseGraph.h>
 
 class TestPoseGraphClass : public ::testing::Test {
@@ -244,6 +245,67 @@ TEST_F(TestPoseGraphClass, RemoveRobotFromGraph){
 }
 
 
+TEST_F(TestPoseGraphClass, OptimizerInputChanges){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 0), gtsam::Symbol('a', 1), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(gtsam::Rot3(),gtsam::Point3(1.0, 0.0, 0.0) ), noise);
+
+  // Whole graph first
+  lamp_utils::OptimizerInputTracker tracker;
+  auto msg = tracker.Update(pose_graph_);
+  EXPECT_TRUE(msg->full);
+  EXPECT_EQ(msg->sequence, 0);
+  EXPECT_EQ(msg->nodes.size(), 2);
+  EXPECT_EQ(msg->edges.size(), 2);
+  const uint64_t epoch = msg->epoch;
+
+  // Then the changes only
+  pose_graph_.TrackNode(n1);
+  pose_graph_.TrackFactor(e0);
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 0), gtsam::Symbol('a', 2), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE, gtsam::Pose3(gtsam::Rot3(),gtsam::Point3(1.0, 0.0, 0.0) ), noise);
+  msg = tracker.Update(pose_graph_);
+  EXPECT_FALSE(msg->full);
+  EXPECT_EQ(msg->epoch, epoch);
+  EXPECT_EQ(msg->sequence, 1);
+  EXPECT_EQ(msg->nodes.size(), 1);
+  EXPECT_EQ(msg->edges.size(), 2);
+  EXPECT_EQ(msg->removed_edges.size(), 0);
+
+  // Loop closure rejected by the optimizer
+  pose_graph_.UpdateLoopClosures(
+      pose_graph_msgs::PoseGraph::ConstPtr(new pose_graph_msgs::PoseGraph));
+  msg = tracker.Update(pose_graph_);
+  EXPECT_EQ(msg->sequence, 2);
+  EXPECT_EQ(msg->nodes.size(), 0);
+  EXPECT_EQ(msg->edges.size(), 0);
+  ASSERT_EQ(msg->removed_edges.size(), 1);
+  EXPECT_EQ(msg->removed_edges[0].key_to, gtsam::Symbol('a', 2));
+
+  // Resync in the same epoch
+  tracker.RequestFull(false);
+  msg = tracker.Update(pose_graph_);
+  EXPECT_TRUE(msg->full);
+  EXPECT_EQ(msg->epoch, epoch);
+  EXPECT_EQ(msg->sequence, 3);
+  EXPECT_EQ(msg->nodes.size(), 3);
+  EXPECT_EQ(msg->edges.size(), 3);
+
+  // Removed nodes can't be changes, the graph is sent again in a new epoch
+  pose_graph_.RemoveRobotFromGraph("husky1");
+  msg = tracker.Update(pose_graph_);
+  EXPECT_TRUE(msg->full);
+  EXPECT_EQ(msg->epoch, epoch + 1);
+  EXPECT_EQ(msg->sequence, 0);
+  EXPECT_EQ(msg->nodes.size(), pose_graph_.GetNodes().size());
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_utils");
@@ -0,0 +1,126 @@
+/**
+ * @file   AdaptiveBatchSizer.h
+ * @brief  Sizes the candidate batches released to the loop computation from
+ * its reported throughput
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace lamp_loop_closure {
+
+struct AdaptiveBatchParams {
+  bool enabled = false;
+  // Batch when disabled or until the first computation time is reported
+  size_t initial_batch = 100;
+  size_t min_batch = 1;
+  size_t max_batch = 1000;
+  // Seconds of work to hand each computation worker per batch
+  double target_round_time = 2.0;
+  // A backlog taking longer than this (s) to drain at the measured
+  // throughput grows the batches proportionally
+  double max_backlog_wait = 30.0;
+  // Weight of the newest measurement in the running averages
+  double smoothing = 0.3;
+};
+
+// Closes the loop between the queue and the loop computation: each
+// completion status reports how many candidates were computed and how long
+// one took on a worker, and the next batch is sized to keep every worker
+// busy for about target_round_time, so the pool neither idles between
+// rounds nor builds up a backlog of its own. Not thread safe.
+class AdaptiveBatchSizer {
+public:
+  void SetParams(const AdaptiveBatchParams& params) {
+    params_ = params;
+    params_.min_batch = std::max<size_t>(params_.min_batch, 1);
+    params_.max_batch = std::max(params_.max_batch, params_.min_batch);
+  }
+
+  const AdaptiveBatchParams& GetParams() const {
+    return params_;
+  }
+
+  // A completion status received at time now (s)
+  void AddStatus(size_t num_computed,
+                 double mean_computation_time,
+                 size_t num_workers,
+                 double now) {
+    num_workers_ = std::max<size_t>(num_workers, 1);
+    if (num_computed > 0 && mean_computation_time > 0) {
+      mean_latency_ = mean_latency_ > 0
+          ? Smooth(mean_latency_, mean_computation_time)
+          : mean_computation_time;
+    }
+
+    total_computed_ += num_computed;
+    if (window_start_ < 0) {
+      window_start_ = now;
+      return;
+    }
+    window_computed_ += num_computed;
+    // Statuses can come many times a second, average over at least one
+    const double elapsed = now - window_start_;
+    if (elapsed < 1.0)
+      return;
+    const double rate = window_computed_ / elapsed;
+    throughput_ = has_throughput_ ? Smooth(throughput_, rate) : rate;
+    has_throughput_ = true;
+    window_start_ = now;
+    window_computed_ = 0;
+  }
+
+  // Candidates to release given the number waiting in the queue
+  size_t NextBatchSize(size_t backlog) const {
+    if (!params_.enabled || mean_latency_ <= 0)
+      return params_.initial_batch;
+
+    // Candidates per second the workers can take
+    const double capacity = num_workers_ / mean_latency_;
+    double batch = capacity * params_.target_round_time;
+    const double drain_rate =
+        has_throughput_ && throughput_ > 0 ? throughput_ : capacity;
+    const double backlog_wait = backlog / drain_rate;
+    if (params_.max_backlog_wait > 0 &&
+        backlog_wait > params_.max_backlog_wait)
+      batch *= backlog_wait / params_.max_backlog_wait;
+
+    const double bounded =
+        std::min<double>(std::max<double>(std::ceil(batch), params_.min_batch),
+                         params_.max_batch);
+    return static_cast<size_t>(bounded);
+  }
+
+  // Achieved candidates per second, 0 until measured
+  double Throughput() const {
+    return has_throughput_ ? throughput_ : 0;
+  }
+
+  // Seconds per candidate on one worker, 0 until reported
+  double MeanLatency() const {
+    return mean_latency_;
+  }
+
+  size_t TotalComputed() const {
+    return total_computed_;
+  }
+
+private:
+  double Smooth(double average, double value) const {
+    return (1 - params_.smoothing) * average + params_.smoothing * value;
+  }
+
+  AdaptiveBatchParams params_;
+  size_t num_workers_ = 1;
+  double mean_latency_ = 0;
+  double throughput_ = 0;
+  bool has_throughput_ = false;
+  double window_start_ = -1;
+  size_t window_computed_ = 0;
+  size_t total_computed_ = 0;
+};
+
+} // namespace lamp_loop_closure
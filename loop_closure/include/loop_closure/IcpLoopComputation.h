@@ -5,7 +5,6 @@
  */
 #pragma once
 
-#include "ThreadPool.h"
 #include "lamp_utils/PointCloudUtils.h"
 #include <geometry_utils/GeometryUtils.h>
 #include <gtsam/geometry/Pose3.h>
@@ -14,10 +13,19 @@
 #include <pcl/io/pcd_io.h>
 #include <pcl_ros/point_cloud.h>
 #include <pose_graph_msgs/KeyedScan.h>
+#include <atomic>
+#include <future>
+#include <list>
+#include <shared_mutex>
 #include <unordered_map>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/KeyedScanStore.h>
+#include <lamp_utils/WorkStealingExecutor.h>
 
+#include "loop_closure/LoopClosureVerifier.h"
 #include "loop_closure/LoopComputation.h"
+#include "loop_closure/ObjectPool.h"
+#include "loop_closure/ScanWindowCache.h"
 
 namespace lamp_loop_closure {
 
@@ -25,9 +33,46 @@ class IcpLoopComputation : public LoopComputation {
   typedef pcl::PointCloud<pcl::Normal> Normals;
   typedef pcl::PointCloud<pcl::FPFHSignature33> Features;
   typedef pcl::search::KdTree<Point> KdTree;
+  typedef pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>
+      Gicp;
   friend class TestLoopComputation;
   friend class EvalIcpLoopCompute;
 
+  // A cloud with everything GICP derives from it
+  struct PreparedCloud {
+    PointCloudConstPtr cloud;
+    KdTree::Ptr tree;
+    // GICP covariances of the cloud as target, and as source (the same
+    // unless GICP computes them differently)
+    MatricesVectorPtr covariances;
+    MatricesVectorPtr source_covariances;
+  };
+
+  // Accumulated scan window, at full resolution and (for coarse-to-fine
+  // alignment) downsampled from coarsest to finest
+  struct PreparedScan : PreparedCloud {
+    std::vector<PreparedCloud> levels;
+    // Leaf size of the finest level (0 without levels). Together with the
+    // number of levels it tells if the scan fits the alignment settings.
+    double levels_leaf_size = 0;
+    // Number of keyed scans that went into cloud (used to detect windows
+    // that have gained scans since they were cached)
+    size_t num_scans;
+    // poses_version_ when the scans were accumulated
+    size_t poses_version = 0;
+  };
+  typedef boost::shared_ptr<const PreparedScan> PreparedScanConstPtr;
+
+  // Harris keypoints and their FPFH features, shared by the SAC-IA and
+  // TEASER++ initializations. Not modified once computed.
+  struct ScanFeatures {
+    PointCloud::Ptr keypoints;
+    Features::Ptr features;
+    // Number of keyed scans in the cloud the features were computed from
+    size_t num_scans;
+  };
+  typedef boost::shared_ptr<const ScanFeatures> ScanFeaturesConstPtr;
+
 public:
   IcpLoopComputation();
   ~IcpLoopComputation();
@@ -40,9 +85,25 @@ public:
 
   bool RegisterCallbacks(const ros::NodeHandle& n) override;
 
-  // Compute transform and populate output queue
+  // Compute transform and populate output queue. With the thread pool this
+  // only dispatches the candidates, each loop closure is added to the output
+  // queue (and published if possible) as soon as its alignment finishes.
   void ComputeTransforms() override;
 
+  // Also dispatches the new candidates right away when using the thread pool
+  void InputCallback(const pose_graph_msgs::LoopCandidateArray::ConstPtr&
+                         input_candidates) override;
+
+  // True if dispatched alignments have not finished yet
+  bool HasPendingAlignments();
+
+  // Block until every dispatched alignment has finished
+  void WaitForPendingAlignments();
+
+  // Drop the computed loop closures that are inconsistent with the rest of
+  // the batch
+  void VerifyOutputQueue();
+
   void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
 
   void KeyedPoseCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
@@ -51,6 +112,14 @@ public:
 
   bool SetupICP(pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>& icp);
 
+  size_t NumWorkers() const override;
+
+  // Align a candidate and create the loop closure edge if it is accepted
+  bool ComputeLoopClosure(const pose_graph_msgs::LoopCandidate& candidate,
+                          pose_graph_msgs::PoseGraphEdge* loop_closure);
+
+  // With b_candidate_guess ICP starts from the relative pose of pose1 and
+  // pose2 whatever the initialization method
   bool PerformAlignment(const gtsam::Symbol& key1,
                         const gtsam::Symbol& key2,
                         const gtsam::Pose3& pose1,
@@ -58,17 +127,39 @@ public:
                         geometry_utils::Transform3* delta,
                         gtsam::Matrix66* covariance,
                         double* fitness_score,
-                        bool re_initialize_icp = false);
+                        bool b_candidate_guess = false);
 
   void GetSacInitialAlignment(PointCloud::ConstPtr source,
                               PointCloud::ConstPtr target,
                               Eigen::Matrix4f* tf_out,
                               double& sac_fitness_score);
 
+  void GetSacInitialAlignment(const ScanFeatures& source,
+                              const ScanFeatures& target,
+                              Eigen::Matrix4f* tf_out,
+                              double& sac_fitness_score);
+
   void GetTeaserInitialAlignment(PointCloud::ConstPtr source,
                                  PointCloud::ConstPtr target,
                                  Eigen::Matrix4f* tf_out);
 
+  void GetTeaserInitialAlignment(const ScanFeatures& source,
+                                 const ScanFeatures& target,
+                                 Eigen::Matrix4f* tf_out);
+
+  boost::shared_ptr<ScanFeatures> ComputeScanFeatures(
+      const PointCloudConstPtr& cloud) const;
+
+  // Get the features of a prepared scan window, from the cache if possible
+  ScanFeaturesConstPtr GetScanFeatures(const ScanWindow& window,
+                                       const PreparedScan& scan);
+
+  ScanWindowCacheStats GetFeatureCacheStats() const;
+
+  // Memory held by the keypoints and features, counted against the feature
+  // cache budget
+  static size_t FeatureBytes(const ScanFeatures& scan_features);
+
   bool
   ComputeICPCovariancePointPlane(const PointCloud::ConstPtr& query_cloud,
                                  const PointCloud::ConstPtr& reference_cloud,
@@ -83,6 +174,46 @@ public:
 
   void AccumulateScans(const gtsam::Key& key, PointCloud::Ptr scan_out);
 
+  void AccumulateScans(const ScanWindow& window, PointCloud::Ptr scan_out);
+
+  size_t NumScansInWindow(const ScanWindow& window) const;
+
+  // Get the accumulated cloud, search tree and covariances of a scan window,
+  // from the cache if possible
+  PreparedScanConstPtr PrepareScan(
+      const ScanWindow& window,
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>& icp);
+
+  // Number of coarse-to-fine levels and finest leaf size of the scans
+  // prepared with the current alignment settings
+  size_t NumAlignmentLevels() const;
+  double AlignmentLevelsLeafSize() const;
+
+  void PrepareCloud(const PointCloudConstPtr& cloud,
+                    Gicp& icp,
+                    PreparedCloud* prepared);
+
+  // Fraction of (up to num_samples) random source points that have a target
+  // point within max_distance after applying the guess
+  double EstimateOverlap(const PreparedScan& source,
+                         const PreparedScan& target,
+                         const Eigen::Matrix4f& guess,
+                         const gtsam::Key& seed) const;
+
+  // Align the downsampled levels, coarsest first, refining the guess in place.
+  // Returns false as soon as a level does not converge or its fitness is too
+  // high for the candidate to pass at full resolution.
+  bool AlignCoarseToFine(const PreparedScan& source,
+                         const PreparedScan& target,
+                         Gicp& icp,
+                         Eigen::Matrix4f* guess);
+
+  ScanWindowCacheStats GetScanCacheStats() const;
+
+  // Share the decoded keyed scans with the other consumers in this process
+  // (e.g. lamp_utils::KeyedScanStore::Shared()). Call before Initialize.
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store);
+
 protected:
   // Define subscriber
   ros::Subscriber keyed_scans_sub_;
@@ -91,9 +222,38 @@ protected:
   // Timer
   ros::Timer update_timer_;
 
-  // Store keyed scans
-  std::unordered_map<gtsam::Key, PointCloudConstPtr> keyed_scans_;
+  // Store keyed scans (decoded once, shared with the other consumers of the
+  // store)
+  lamp_utils::KeyedScanStore::Ptr keyed_scans_;
+  // Latest (optimized) pose of every node
   std::unordered_map<gtsam::Key, gtsam::Pose3> keyed_poses_;
+  // Relative pose from the previous key of each key as of the last
+  // invalidation of the cached windows that have both
+  std::unordered_map<gtsam::Key, gtsam::Pose3> window_relative_poses_;
+  // Cached windows stay valid while the relative poses of their keys change
+  // by less than this (m, rad)
+  double window_translation_tolerance_;
+  double window_rotation_tolerance_;
+  // Bumped whenever moved poses invalidate cached windows, so a window
+  // accumulated from the old poses is not cached after the invalidation
+  size_t poses_version_ = 0;
+
+  // Cache a window computed at poses_version unless moved poses have
+  // invalidated windows since
+  template <typename ValueT>
+  void InsertIfPosesUnchanged(
+      ScanWindowCache<ValueT>* cache,
+      const ScanWindow& window,
+      const typename ScanWindowCache<ValueT>::ValueConstPtr& value,
+      size_t poses_version,
+      size_t bytes = 0) {
+    std::shared_lock<std::shared_timed_mutex> lock(keyed_data_mutex_);
+    if (poses_version == poses_version_)
+      cache->Insert(window, value, bytes);
+  }
+  // Guards keyed_poses_, which the alignment workers read while the callbacks
+  // add to them (the scan store has its own lock)
+  std::shared_timed_mutex keyed_data_mutex_;
 
   double max_tolerable_fitness_;
   double icp_tf_epsilon_;
@@ -140,15 +300,50 @@ protected:
 
   enum class IcpCovarianceMethod { POINT2POINT, POINT2PLANE };
 
+  enum class IcpAlignmentMethod { SINGLE_RESOLUTION, COARSE_TO_FINE };
+
   IcpInitMethod icp_init_method_;
 
+  IcpAlignmentMethod icp_alignment_method_;
+
+  // Coarse-to-fine parameters
+  unsigned int coarse_to_fine_levels_;
+  double coarse_to_fine_leaf_size_;
+  unsigned int coarse_to_fine_iterations_;
+  double coarse_to_fine_reject_scale_;
+  // Overlap pre-check parameters (0 samples disables it)
+  unsigned int precheck_num_samples_;
+  double precheck_max_distance_;
+  double precheck_min_overlap_;
+
+  // Candidates aligned and how many were rejected before full resolution ICP
+  std::atomic<size_t> num_alignments_{0};
+  std::atomic<size_t> num_precheck_rejections_{0};
+  std::atomic<size_t> num_coarse_rejections_{0};
+
   IcpCovarianceMethod icp_covariance_method_;
 
-  // ICP
-  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point> icp_;
+  // Hold computed closures until their batch is complete and publish only
+  // the mutually consistent ones
+  bool b_verify_closures_ = false;
+  LoopClosureVerifier verifier_;
+
+  // ICP objects set up by SetupICP, each alignment checks one out
+  ObjectPool<Gicp> icp_pool_;
+
+  // Accumulated clouds, KD-trees and GICP covariances per scan window
+  ScanWindowCache<PreparedScan> scan_cache_;
+
+  // Keypoints and features per scan window, bounded by memory
+  ScanWindowCache<ScanFeatures> feature_cache_;
 
+  lamp_utils::WorkStealingExecutor icp_computation_pool_;
+  // Cancels alignments that have not started when shutting down
+  lamp_utils::CancellationToken icp_computation_token_;
+  // Alignments dispatched to the pool that have not been collected yet
+  std::list<std::future<void>> in_flight_alignments_;
 
-  ThreadPool icp_computation_pool_;
+  void PruneFinishedAlignments();
 
   size_t number_of_threads_in_icp_computation_pool_;
 };
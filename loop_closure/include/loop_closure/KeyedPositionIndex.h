@@ -0,0 +1,159 @@
+/**
+ * @file   KeyedPositionIndex.h
+ * @brief  Voxel hash over keyed node positions for radius queries
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+
+namespace lamp_loop_closure {
+
+// Positions are bucketed into cubic cells so a radius query only visits the
+// cells overlapping the query ball instead of every node. With the cell size
+// close to the usual query radius a query touches 27 cells. Positions can be
+// moved (re-inserted) and erased, so the index can follow an optimized graph.
+class KeyedPositionIndex {
+public:
+  typedef std::pair<gtsam::Key, double> KeyDistance;
+
+  explicit KeyedPositionIndex(double cell_size = 1.0)
+    : cell_size_(cell_size > 0 ? cell_size : 1.0) {}
+
+  // Rebuilds the cells if the size changes
+  void SetCellSize(double cell_size) {
+    if (cell_size <= 0 || cell_size == cell_size_)
+      return;
+    cell_size_ = cell_size;
+    cells_.clear();
+    for (const auto& entry : positions_)
+      cells_[CellOf(entry.second)].push_back(entry.first);
+  }
+
+  double GetCellSize() const {
+    return cell_size_;
+  }
+
+  // Insert a new key or move an existing one
+  void Insert(const gtsam::Key& key, const Eigen::Vector3d& position) {
+    auto it = positions_.find(key);
+    if (it != positions_.end()) {
+      const Cell old_cell = CellOf(it->second);
+      it->second = position;
+      const Cell new_cell = CellOf(position);
+      if (old_cell == new_cell)
+        return;
+      RemoveFromCell(old_cell, key);
+      cells_[new_cell].push_back(key);
+      return;
+    }
+    positions_.emplace(key, position);
+    cells_[CellOf(position)].push_back(key);
+  }
+
+  bool Erase(const gtsam::Key& key) {
+    auto it = positions_.find(key);
+    if (it == positions_.end())
+      return false;
+    RemoveFromCell(CellOf(it->second), key);
+    positions_.erase(it);
+    return true;
+  }
+
+  bool Contains(const gtsam::Key& key) const {
+    return positions_.count(key) > 0;
+  }
+
+  void Clear() {
+    positions_.clear();
+    cells_.clear();
+  }
+
+  size_t Size() const {
+    return positions_.size();
+  }
+
+  // Keys within radius of the query position (inclusive) with their
+  // distance, sorted by key
+  std::vector<KeyDistance> RadiusSearch(const Eigen::Vector3d& position,
+                                        double radius) const {
+    std::vector<KeyDistance> result;
+    if (radius < 0)
+      return result;
+    const Cell lo = CellOf(position - Eigen::Vector3d::Constant(radius));
+    const Cell hi = CellOf(position + Eigen::Vector3d::Constant(radius));
+    const double radius_sq = radius * radius;
+    for (int64_t x = lo.x; x <= hi.x; x++) {
+      for (int64_t y = lo.y; y <= hi.y; y++) {
+        for (int64_t z = lo.z; z <= hi.z; z++) {
+          auto cell = cells_.find(Cell{x, y, z});
+          if (cell == cells_.end())
+            continue;
+          for (const gtsam::Key& key : cell->second) {
+            const double dist_sq =
+                (positions_.at(key) - position).squaredNorm();
+            if (dist_sq <= radius_sq)
+              result.emplace_back(key, std::sqrt(dist_sq));
+          }
+        }
+      }
+    }
+    std::sort(result.begin(),
+              result.end(),
+              [](const KeyDistance& lhs, const KeyDistance& rhs) {
+                return lhs.first < rhs.first;
+              });
+    return result;
+  }
+
+private:
+  struct Cell {
+    int64_t x, y, z;
+    bool operator==(const Cell& other) const {
+      return x == other.x && y == other.y && z == other.z;
+    }
+  };
+
+  struct CellHash {
+    size_t operator()(const Cell& cell) const {
+      // Large primes from Teschner et al., Optimized Spatial Hashing
+      return (static_cast<size_t>(cell.x) * 73856093) ^
+          (static_cast<size_t>(cell.y) * 19349663) ^
+          (static_cast<size_t>(cell.z) * 83492791);
+    }
+  };
+
+  Cell CellOf(const Eigen::Vector3d& position) const {
+    return Cell{static_cast<int64_t>(std::floor(position.x() / cell_size_)),
+                static_cast<int64_t>(std::floor(position.y() / cell_size_)),
+                static_cast<int64_t>(std::floor(position.z() / cell_size_))};
+  }
+
+  void RemoveFromCell(const Cell& cell, const gtsam::Key& key) {
+    auto it = cells_.find(cell);
+    if (it == cells_.end())
+      return;
+    std::vector<gtsam::Key>& keys = it->second;
+    auto pos = std::find(keys.begin(), keys.end(), key);
+    if (pos != keys.end()) {
+      *pos = keys.back();
+      keys.pop_back();
+    }
+    if (keys.empty())
+      cells_.erase(it);
+  }
+
+  double cell_size_;
+  std::unordered_map<gtsam::Key, Eigen::Vector3d> positions_;
+  std::unordered_map<Cell, std::vector<gtsam::Key>, CellHash> cells_;
+};
+
+} // namespace lamp_loop_closure
@@ -28,6 +28,7 @@ Lidar pointcloud based loop closure
 
 #include <map>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/KeyedScanStore.h>
 
 class LaserLoopClosure : public LoopClosure {
 public:
@@ -36,6 +37,12 @@ public:
 
   bool Initialize(const ros::NodeHandle& n);
 
+  // Take decoded keyed scans from a store shared with the other consumers in
+  // this process instead of decoding them here. Call before Initialize.
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store) {
+    keyed_scans_ = store;
+  }
+
   typedef pcl::PointCloud<pcl::Normal> Normals;
   typedef pcl::PointCloud<pcl::FPFHSignature33> Features;
 
@@ -104,7 +111,8 @@ private:
   ros::Subscriber loop_closure_seed_sub_;
   ros::Subscriber pc_gt_trigger_sub_;
 
-  std::unordered_map<gtsam::Key, PointCloud::ConstPtr> keyed_scans_;
+  // Decoded keyed scans (shared with the other consumers of the store)
+  lamp_utils::KeyedScanStore::Ptr keyed_scans_;
 
   ros::Publisher gt_pub_;
   ros::Publisher current_scan_pub_;
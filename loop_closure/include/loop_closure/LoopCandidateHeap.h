@@ -0,0 +1,194 @@
+/**
+ * @file   LoopCandidateHeap.h
+ * @brief  Indexed max-heap of scored loop candidates with expiry by stamp
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <pose_graph_msgs/LoopCandidate.h>
+#include <ros/time.h>
+
+namespace lamp_loop_closure {
+
+struct LoopCandidateHeapStats {
+  size_t depth = 0;
+  size_t pushed = 0;
+  size_t popped = 0;
+  size_t expired = 0;
+  // Seconds between push and pop of the popped candidates
+  double total_time_in_queue = 0;
+  double max_time_in_queue = 0;
+
+  double MeanTimeInQueue() const {
+    return popped > 0 ? total_time_in_queue / popped : 0;
+  }
+};
+
+// Binary max-heap over candidate slots; each slot knows its heap position so
+// any candidate can be removed in O(log n). A second index ordered by
+// candidate stamp lets expired candidates be removed from the oldest on,
+// without visiting the others. Equal scores pop newest first. Not thread
+// safe.
+class LoopCandidateHeap {
+public:
+  void Push(const pose_graph_msgs::LoopCandidate& candidate,
+            double score,
+            const ros::Time& now) {
+    size_t slot;
+    if (free_slots_.empty()) {
+      slot = entries_.size();
+      entries_.emplace_back();
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    Entry& entry = entries_[slot];
+    entry.candidate = candidate;
+    entry.score = score;
+    entry.order = next_order_++;
+    entry.pushed = now;
+    entry.expiry_it =
+        by_stamp_.insert(std::make_pair(candidate.header.stamp, slot));
+    entry.heap_pos = heap_.size();
+    heap_.push_back(slot);
+    SiftUp(entry.heap_pos);
+    stats_.pushed++;
+  }
+
+  bool Empty() const {
+    return heap_.empty();
+  }
+
+  size_t Size() const {
+    return heap_.size();
+  }
+
+  // Highest score. Heap must not be empty.
+  const pose_graph_msgs::LoopCandidate& Top() const {
+    return entries_[heap_.front()].candidate;
+  }
+
+  double TopScore() const {
+    return entries_[heap_.front()].score;
+  }
+
+  pose_graph_msgs::LoopCandidate Pop(const ros::Time& now) {
+    const size_t slot = heap_.front();
+    pose_graph_msgs::LoopCandidate candidate =
+        std::move(entries_[slot].candidate);
+    const double time_in_queue = (now - entries_[slot].pushed).toSec();
+    stats_.popped++;
+    stats_.total_time_in_queue += time_in_queue;
+    stats_.max_time_in_queue =
+        std::max(stats_.max_time_in_queue, time_in_queue);
+    Remove(slot);
+    return candidate;
+  }
+
+  // Remove every candidate stamped at or before the cutoff
+  size_t RemoveStampedBefore(const ros::Time& cutoff) {
+    size_t n_removed = 0;
+    while (!by_stamp_.empty() && by_stamp_.begin()->first <= cutoff) {
+      Remove(by_stamp_.begin()->second);
+      n_removed++;
+    }
+    stats_.expired += n_removed;
+    return n_removed;
+  }
+
+  void Clear() {
+    entries_.clear();
+    free_slots_.clear();
+    heap_.clear();
+    by_stamp_.clear();
+  }
+
+  LoopCandidateHeapStats GetStats() const {
+    LoopCandidateHeapStats stats = stats_;
+    stats.depth = heap_.size();
+    return stats;
+  }
+
+private:
+  typedef std::multiset<std::pair<ros::Time, size_t>> StampIndex;
+
+  struct Entry {
+    pose_graph_msgs::LoopCandidate candidate;
+    double score = 0;
+    // Push order, breaks ties between equal scores
+    uint64_t order = 0;
+    ros::Time pushed;
+    size_t heap_pos = 0;
+    StampIndex::iterator expiry_it;
+  };
+
+  bool Before(size_t slot_a, size_t slot_b) const {
+    const Entry& a = entries_[slot_a];
+    const Entry& b = entries_[slot_b];
+    return a.score > b.score || (a.score == b.score && a.order > b.order);
+  }
+
+  void Place(size_t pos, size_t slot) {
+    heap_[pos] = slot;
+    entries_[slot].heap_pos = pos;
+  }
+
+  void SiftUp(size_t pos) {
+    const size_t slot = heap_[pos];
+    while (pos > 0) {
+      const size_t parent = (pos - 1) / 2;
+      if (!Before(slot, heap_[parent]))
+        break;
+      Place(pos, heap_[parent]);
+      pos = parent;
+    }
+    Place(pos, slot);
+  }
+
+  void SiftDown(size_t pos) {
+    const size_t slot = heap_[pos];
+    const size_t n = heap_.size();
+    while (true) {
+      size_t child = 2 * pos + 1;
+      if (child >= n)
+        break;
+      if (child + 1 < n && Before(heap_[child + 1], heap_[child]))
+        child++;
+      if (!Before(heap_[child], slot))
+        break;
+      Place(pos, heap_[child]);
+      pos = child;
+    }
+    Place(pos, slot);
+  }
+
+  void Remove(size_t slot) {
+    const size_t pos = entries_[slot].heap_pos;
+    const size_t last = heap_.back();
+    heap_.pop_back();
+    if (last != slot) {
+      Place(pos, last);
+      SiftDown(pos);
+      SiftUp(entries_[last].heap_pos);
+    }
+    by_stamp_.erase(entries_[slot].expiry_it);
+    entries_[slot].candidate = pose_graph_msgs::LoopCandidate();
+    free_slots_.push_back(slot);
+  }
+
+  std::vector<Entry> entries_;
+  std::vector<size_t> free_slots_;
+  // Slots in heap order
+  std::vector<size_t> heap_;
+  StampIndex by_stamp_;
+  uint64_t next_order_ = 0;
+  LoopCandidateHeapStats stats_;
+};
+
+} // namespace lamp_loop_closure
@@ -22,12 +22,15 @@
 #include <ros/console.h>
 #include <ros/ros.h>
 
+#include "loop_closure/AdaptiveBatchSizer.h"
+#include "loop_closure/SentCandidateSet.h"
+
 namespace lamp_loop_closure {
 
 class LoopCandidateQueue {
 public:
   LoopCandidateQueue();
-  ~LoopCandidateQueue();
+  virtual ~LoopCandidateQueue();
 
   virtual bool Initialize(const ros::NodeHandle& n);
 
@@ -44,6 +47,13 @@ public:
 
   void LoopComputationStatusCallback(const pose_graph_msgs::LoopComputationStatus::ConstPtr& status);
 
+  // Batches of amount_per_round, or sized from the computation throughput
+  // when queue/adaptive/enabled
+  bool LoadBatchParameters(int amount_per_round);
+
+  // Candidates waiting in queues
+  size_t NumQueued() const;
+
   virtual void OnNewLoopClosure();
 
   virtual void OnLoopComputationCompleted();
@@ -53,7 +63,6 @@ public:
   void PublishLoopCandidate(
       const pose_graph_msgs::LoopCandidateArray& candidates, bool check_sent=true);
 
-  std::string make_key(const pose_graph_msgs::LoopCandidate& loop_closure);
   virtual bool LoopClosureHasBeenSent(const pose_graph_msgs::LoopCandidate& loop_closure);
 
   virtual void AddLoopClosureToSent(const pose_graph_msgs::LoopCandidate& loop_closure);
@@ -64,11 +73,15 @@ public:
   ros::Publisher loop_candidate_pub_;
   ros::Subscriber loop_candidate_sub_;
   ros::Subscriber loop_closure_status_sub_;
+  // Achieved loop computation throughput (candidates/sec)
+  ros::Publisher throughput_pub_;
   std::unordered_map<int, std::deque<pose_graph_msgs::LoopCandidate>> queues;
 
-  //Keys are: key_from, key_to, type
-  std::unordered_set<std::string> sent_loop_closures_;
+  // By key_from, key_to and type
+  SentCandidateSet sent_loop_closures_;
   std::string param_ns_;
+
+  AdaptiveBatchSizer batch_sizer_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
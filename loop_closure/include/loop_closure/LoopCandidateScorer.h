@@ -0,0 +1,148 @@
+/**
+ * @file   LoopCandidateScorer.h
+ * @brief  Scorers for ranking loop candidates and their weighted combination
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/LoopCandidate.h>
+#include <pose_graph_msgs/PoseGraph.h>
+#include <ros/time.h>
+
+namespace lamp_loop_closure {
+
+// Higher scores are prioritized
+class LoopCandidateScorer {
+public:
+  typedef std::shared_ptr<LoopCandidateScorer> Ptr;
+
+  virtual ~LoopCandidateScorer() {}
+
+  virtual std::string Name() const = 0;
+
+  // False if the candidate cannot be scored (yet)
+  virtual bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+                     double* score) const = 0;
+};
+
+// Sum of the observability of both scans, read from the owner's map
+class ObservabilityScorer : public LoopCandidateScorer {
+public:
+  explicit ObservabilityScorer(
+      const std::unordered_map<gtsam::Key, double>* keyed_observability)
+    : keyed_observability_(keyed_observability) {}
+
+  std::string Name() const override {
+    return "observability";
+  }
+
+  bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+             double* score) const override;
+
+private:
+  const std::unordered_map<gtsam::Key, double>* keyed_observability_;
+};
+
+// Favors candidates whose (odometric) poses are close: scale / (scale + d),
+// so 1 at the same position and 0.5 at the scale distance
+class DistanceScorer : public LoopCandidateScorer {
+public:
+  explicit DistanceScorer(double scale) : scale_(scale) {}
+
+  std::string Name() const override {
+    return "distance";
+  }
+
+  bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+             double* score) const override;
+
+private:
+  double scale_;
+};
+
+// Favors robots that have not closed a loop for a while: the time between
+// the candidate and the last closure of either robot involved, divided by
+// the saturation time and capped at 1. Robots without closures score 1.
+class TimeSinceClosureScorer : public LoopCandidateScorer {
+public:
+  explicit TimeSinceClosureScorer(double saturation)
+    : saturation_(saturation) {}
+
+  std::string Name() const override {
+    return "time_since_closure";
+  }
+
+  bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+             double* score) const override;
+
+  void AddLoopClosure(const gtsam::Key& key_from,
+                      const gtsam::Key& key_to,
+                      const ros::Time& stamp);
+
+private:
+  double ScoreRobot(char prefix, const ros::Time& stamp) const;
+
+  double saturation_;
+  mutable std::mutex mutex_;
+  std::unordered_map<char, ros::Time> last_closure_;
+};
+
+// Favors closures expected to remove the most uncertainty, from the marginal
+// covariances in the optimized pose graph. The relative covariance of the
+// two nodes is approximated by the sum of their marginals (the correlation
+// is not published), and its position trace t scores t / (t + scale).
+// Nodes without a covariance yet are newer than the last optimization and
+// score as uncertain as possible (1).
+class UncertaintyScorer : public LoopCandidateScorer {
+public:
+  explicit UncertaintyScorer(double scale) : scale_(scale) {}
+
+  std::string Name() const override {
+    return "uncertainty";
+  }
+
+  bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+             double* score) const override;
+
+  // Replaces the covariances of the nodes in the graph
+  void Update(const pose_graph_msgs::PoseGraph& graph);
+
+  size_t NumNodes() const;
+
+private:
+  double scale_;
+  mutable std::mutex mutex_;
+  // Trace of the position block of the marginal covariance
+  std::unordered_map<gtsam::Key, double> position_trace_;
+};
+
+// Weighted sum of any number of scorers
+class LoopScoringEngine {
+public:
+  // Scorers with a weight of 0 or less are left out
+  void AddScorer(const LoopCandidateScorer::Ptr& scorer, double weight);
+
+  size_t NumScorers() const {
+    return scorers_.size();
+  }
+
+  // False if any scorer cannot score the candidate
+  bool Score(const pose_graph_msgs::LoopCandidate& candidate,
+             double* score) const;
+
+  // One line per scorer, for logging
+  std::string Describe() const;
+
+private:
+  std::vector<std::pair<LoopCandidateScorer::Ptr, double>> scorers_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,84 @@
+/**
+ * @file   LoopClosureVerifier.h
+ * @brief  Pairwise consistency check of a batch of computed loop closures
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/PoseGraphEdge.h>
+
+namespace lamp_loop_closure {
+
+struct LoopClosureVerifierParams {
+  // Largest error of the cycle formed by two closures and the odometry
+  // between their ends (m, rad). The translation bound grows by drift_rate
+  // times the odometric distance covered by the cycle.
+  double max_translation = 1.0;
+  double max_rotation = 0.2;
+  double drift_rate = 0.05;
+  // Largest difference between a closure and the relative pose of its nodes
+  // in the current estimate (m, rad), 0 to skip
+  double odom_max_translation = 0;
+  double odom_max_rotation = 0;
+};
+
+struct LoopClosureVerifierStats {
+  size_t verified = 0;
+  size_t rejected_odometry = 0;
+  size_t rejected_inconsistent = 0;
+};
+
+// Closures computed in the same batch are checked pairwise: two closures are
+// consistent when going around closure i, the odometry between the "to"
+// nodes, closure j backwards and the odometry between the "from" nodes
+// comes back (close to) where it started. As in PCM, closures vote only with
+// the closures between the same pair of robots, and of each such group only
+// the largest set of mutually consistent closures is kept, found with a
+// greedy clique search. A group in which no two closures agree (or with a
+// single closure) gives nothing to vote on and is kept whole, the
+// optimizer's outlier rejection still gets to see it. Not thread safe.
+class LoopClosureVerifier {
+public:
+  typedef std::unordered_map<gtsam::Key, gtsam::Pose3> Poses;
+
+  void SetParams(const LoopClosureVerifierParams& params) {
+    params_ = params;
+  }
+
+  // Whether each closure is kept. Closures with a node missing from poses
+  // cannot be checked and are kept.
+  std::vector<bool> Verify(
+      const std::vector<pose_graph_msgs::PoseGraphEdge>& closures,
+      const Poses& poses);
+
+  bool Consistent(const pose_graph_msgs::PoseGraphEdge& closure_i,
+                  const pose_graph_msgs::PoseGraphEdge& closure_j,
+                  const Poses& poses) const;
+
+  bool ConsistentWithOdometry(const pose_graph_msgs::PoseGraphEdge& closure,
+                              const Poses& poses) const;
+
+  LoopClosureVerifierStats GetStats() const {
+    return stats_;
+  }
+
+private:
+  // The closure from the lower to the higher key, so that closures between
+  // the same robots in either direction can be compared
+  static pose_graph_msgs::PoseGraphEdge Oriented(
+      const pose_graph_msgs::PoseGraphEdge& closure);
+
+  // Vertices (indices into the adjacency) of a large clique
+  static std::vector<size_t> LargeClique(
+      const std::vector<std::vector<bool>>& adjacency);
+
+  LoopClosureVerifierParams params_;
+  LoopClosureVerifierStats stats_;
+};
+
+} // namespace lamp_loop_closure
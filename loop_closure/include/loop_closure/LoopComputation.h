@@ -6,6 +6,7 @@
 #pragma once
 
 #include <map>
+#include <mutex>
 #include <queue>
 #include <vector>
 
@@ -35,13 +36,16 @@ public:
   // Compute transform and populate output queue
   virtual void ComputeTransforms() = 0;
 
+  // Publish computed loop closures followed by the completed status
   void PublishLoopClosures();
 
+  // Publish computed loop closures (if any) without reporting completion
+  void PublishOutputQueue();
 
-
-  void InputCallback(
+  virtual void InputCallback(
       const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates);
 
+  // Also reports the candidates computed since the previous status
   void PublishCompletedAllStatus();
 
   pose_graph_msgs::PoseGraphEdge
@@ -51,7 +55,18 @@ public:
                         const gtsam::Matrix66& covariance) const;
   std::vector<pose_graph_msgs::PoseGraphEdge> GetCurrentOutputQueue();
 
+  // Thread safe, may be called by computation workers
+  void AddToOutputQueue(const pose_graph_msgs::PoseGraphEdge& loop_closure);
+
+  // Thread safe, count one computed candidate for the next status
+  void RecordComputation(double seconds);
+
 protected:
+  // Candidates computed in parallel, reported with the status
+  virtual size_t NumWorkers() const {
+    return 1;
+  }
+
   // Define publishers and subscribers
   ros::Publisher status_pub_;
   ros::Publisher loop_closure_pub_;
@@ -59,12 +74,18 @@ protected:
 
   // Computed loop closures
   std::vector<pose_graph_msgs::PoseGraphEdge> output_queue_;
+  std::mutex output_mutex_;
   // Loop closure queue as received from candidate generation
   std::queue<pose_graph_msgs::LoopCandidate> input_queue_;
   // Duration (sec) allowed to wait for keyed scans until removed
   double keyed_scans_max_delay_;
 
   std::string param_ns_;
+
+private:
+  std::mutex status_mutex_;
+  size_t status_num_computed_ = 0;
+  double status_computation_time_ = 0;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -48,8 +48,11 @@ protected:
   inline void PublishLoops() const {
     if (candidates_.size() == 0)
       return;
-    pose_graph_msgs::LoopCandidateArray candidates_msg;
-    candidates_msg.candidates = candidates_;
+    // Published by pointer so subscribers loaded in the same nodelet manager
+    // receive it without serialization
+    pose_graph_msgs::LoopCandidateArray::Ptr candidates_msg(
+        new pose_graph_msgs::LoopCandidateArray);
+    candidates_msg->candidates = candidates_;
     loop_candidate_pub_.publish(candidates_msg);
   }
 
@@ -12,6 +12,7 @@
 #include <vector>
 #include <mutex>
 
+#include <lamp_utils/KeyedScanStore.h>
 #include <pose_graph_msgs/LoopCandidate.h>
 #include <pose_graph_msgs/LoopCandidateArray.h>
 #include <ros/console.h>
@@ -23,7 +24,7 @@ namespace lamp_loop_closure {
 class LoopPrioritization {
 public:
   LoopPrioritization();
-  ~LoopPrioritization();
+  virtual ~LoopPrioritization();
 
   virtual bool Initialize(const ros::NodeHandle& n) = 0;
 
@@ -35,6 +36,12 @@ public:
 
   virtual std::vector<ros::AsyncSpinner> SetAsyncSpinners(const ros::NodeHandle& n);
 
+  // Take decoded keyed scans from a store shared with the other consumers in
+  // this process instead of decoding them here
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store) {
+    keyed_scan_store_ = store;
+  }
+
 protected:
   // Use different priority metrics to populate output (priority) queue
   virtual void PopulatePriorityQueue() = 0;
@@ -66,6 +73,9 @@ protected:
 
   double keyed_scans_max_delay_;
 
+  // Optional, scans are only decoded and scored (not kept) without it
+  lamp_utils::KeyedScanStore::Ptr keyed_scan_store_;
+
 
   std::mutex priority_queue_mutex_;
 };
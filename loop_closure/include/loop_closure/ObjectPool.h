@@ -0,0 +1,130 @@
+/**
+ * @file   ObjectPool.h
+ * @brief  Thread-safe pool of reusable, pre-configured objects
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace lamp_loop_closure {
+
+// Objects are created by the factory the first time the pool runs dry and are
+// handed back to the pool (not destroyed) when their lease goes out of scope,
+// so the pool only ever holds as many objects as were in use at once.
+// The pool must outlive every lease.
+template <typename T>
+class ObjectPool {
+public:
+  typedef std::function<std::unique_ptr<T>()> Factory;
+
+  // Exclusive use of one pooled object
+  class Lease {
+  public:
+    Lease() : pool_(nullptr), generation_(0) {}
+    Lease(ObjectPool* pool, std::unique_ptr<T> object, size_t generation)
+      : pool_(pool), object_(std::move(object)), generation_(generation) {}
+    Lease(Lease&& other)
+      : pool_(other.pool_),
+        object_(std::move(other.object_)),
+        generation_(other.generation_) {}
+    Lease& operator=(Lease&& other) {
+      Release();
+      pool_ = other.pool_;
+      object_ = std::move(other.object_);
+      generation_ = other.generation_;
+      return *this;
+    }
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease() {
+      Release();
+    }
+
+    T& operator*() const {
+      return *object_;
+    }
+    T* operator->() const {
+      return object_.get();
+    }
+    T* get() const {
+      return object_.get();
+    }
+
+  private:
+    void Release() {
+      if (pool_ && object_)
+        pool_->Return(std::move(object_), generation_);
+    }
+
+    ObjectPool* pool_;
+    std::unique_ptr<T> object_;
+    size_t generation_;
+  };
+
+  ObjectPool() {}
+  explicit ObjectPool(const Factory& factory) : factory_(factory) {}
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // Objects created by the previous factory are dropped (now if idle, when
+  // returned otherwise) so they are not handed out again
+  void SetFactory(const Factory& factory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    factory_ = factory;
+    idle_.clear();
+    generation_++;
+  }
+
+  Lease Acquire() {
+    std::unique_ptr<T> object;
+    Factory factory;
+    size_t generation;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      generation = generation_;
+      if (!idle_.empty()) {
+        object = std::move(idle_.back());
+        idle_.pop_back();
+        return Lease(this, std::move(object), generation);
+      }
+      factory = factory_;
+      num_created_++;
+    }
+    // Create outside the lock, setting up an object can be expensive
+    object = factory ? factory() : std::unique_ptr<T>(new T);
+    return Lease(this, std::move(object), generation);
+  }
+
+  // Number of objects created since construction
+  size_t NumCreated() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_created_;
+  }
+
+  size_t NumIdle() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+private:
+  void Return(std::unique_ptr<T> object, size_t generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation == generation_)
+      idle_.push_back(std::move(object));
+  }
+
+  mutable std::mutex mutex_;
+  Factory factory_;
+  std::vector<std::unique_ptr<T>> idle_;
+  size_t num_created_ = 0;
+  size_t generation_ = 0;
+};
+
+} // namespace lamp_loop_closure
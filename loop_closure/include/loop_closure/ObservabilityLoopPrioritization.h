@@ -10,10 +10,13 @@
 #include <map>
 #include <mutex>
 #include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/PoseGraph.h>
 #include <ros/console.h>
 #include <ros/ros.h>
 #include <lamp_utils/CommonStructs.h>
 
+#include "loop_closure/LoopCandidateHeap.h"
+#include "loop_closure/LoopCandidateScorer.h"
 #include "loop_closure/LoopPrioritization.h"
 
 namespace lamp_loop_closure {
@@ -34,6 +37,9 @@ public:
 
   bool RegisterCallbacks(const ros::NodeHandle& n) override;
 
+  // Queue depth and time-in-queue counters of the priority queue
+  LoopCandidateHeapStats GetQueueStats();
+
 protected:
   void PopulatePriorityQueue() override;
 
@@ -46,19 +52,34 @@ protected:
 
   void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
 
+  void LoopClosureCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
+
+  void OptimizedValuesCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& msg);
+
   void ProcessTimerCallback(const ros::TimerEvent& ev);
 
   // Store keyed scans
   std::unordered_map<gtsam::Key, double> keyed_observability_;
 
-  // Store observability in deque along with candidate
-  std::deque<double> observability_score_;
+  // Scored candidates, highest observability first (guarded by
+  // priority_queue_mutex_)
+  LoopCandidateHeap candidate_heap_;
+
+  // Weighted scorers ranking the candidates that pass min_observability_
+  LoopScoringEngine scoring_;
+  // Null unless weighted, fed from the loop closures
+  std::shared_ptr<TimeSinceClosureScorer> time_since_closure_scorer_;
+  // Null unless weighted, fed from the optimized values
+  std::shared_ptr<UncertaintyScorer> uncertainty_scorer_;
 
   // Track max observability for each robot (different so need to normalize)
   std::unordered_map<char, double> max_observability_;
 
   // Define subscriber
   ros::Subscriber keyed_scans_sub_;
+  ros::Subscriber loop_closure_sub_;
+  ros::Subscriber optimized_values_sub_;
 
   // Timer
   ros::Timer update_timer_;
@@ -14,6 +14,7 @@
 #include <pose_graph_msgs/KeyedScan.h>
 #include <queue>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/KeyedScanStore.h>
 #include <vector>
 
 namespace lamp_loop_closure {
@@ -33,6 +34,10 @@ class ObservabilityQueue : public LoopCandidateQueue  {
 
 
   void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
+
+  // Share the decoded keyed scans with the other consumers in this process.
+  // Call before Initialize.
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store);
  protected:
 //  void InputCallback(
 //      const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates) override;
@@ -52,11 +57,13 @@ class ObservabilityQueue : public LoopCandidateQueue  {
   double normals_radius_;     // radius used for cloud normal computation
   double min_observability_;
   int num_threads_;
+  // Candidates whose keyed scans are not there yet are dropped after this (s)
+  double keyed_scans_max_delay_;
 
   ros::Subscriber keyed_scans_sub_;
 
   // Store keyed scans
-  std::map<gtsam::Key, PointCloudConstPtr> keyed_scans_;
+  lamp_utils::KeyedScanStore::Ptr keyed_scans_;
 
   struct ObservabilityCompare
   {
@@ -7,7 +7,9 @@
 
 #include <gtsam/inference/Symbol.h>
 
+#include "loop_closure/KeyedPositionIndex.h"
 #include "loop_closure/LoopGeneration.h"
+#include "loop_closure/SentCandidateSet.h"
 
 namespace lamp_loop_closure {
 
@@ -35,11 +37,25 @@ protected:
   double DistanceBetweenKeys(const gtsam::Symbol& key1,
                              const gtsam::Symbol& key2) const;
 
+  // Largest radius any candidate can be accepted at
+  double MaxSearchRadius() const;
+
   double proximity_threshold_max_;
   double proximity_threshold_min_;
   double increase_rate_;
   int n_closest_;
   size_t skip_recent_poses_;
+
+  // Known nodes that moved more than this are updated and searched again
+  double pose_update_translation_threshold_;
+  double pose_update_rotation_threshold_;
+
+  // Node pairs (lower key first) proposed within pose_update/proposed_expiry,
+  // so searching again around a moved node does not propose them twice
+  SentCandidateSet proposed_pairs_;
+
+  // Positions of keyed_poses_, searched instead of every pose
+  KeyedPositionIndex position_index_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
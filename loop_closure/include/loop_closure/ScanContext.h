@@ -0,0 +1,141 @@
+/**
+ * @file   ScanContext.h
+ * @brief  Scan context place descriptor of a keyed scan and its index
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_loop_closure {
+
+struct ScanContextParams {
+  size_t num_rings = 20;
+  size_t num_sectors = 60;
+  // Points further than this (m) from the sensor are left out
+  double max_radius = 80.0;
+  // Added to the point heights so the ground is above 0
+  double lidar_height = 2.0;
+};
+
+// Polar grid of the highest point per bin (ring: range, sector: azimuth)
+// around the sensor, from Kim and Kim, "Scan Context" (IROS 2018). A yaw of
+// the sensor shifts the sectors, so the mean of each ring (the ring key) does
+// not depend on it and the mean of each sector (the sector key) tells the
+// shift between two scans.
+class ScanContext {
+public:
+  typedef std::shared_ptr<const ScanContext> ConstPtr;
+
+  ScanContext(const ScanContextParams& params, const PointCloud& cloud);
+
+  const Eigen::MatrixXf& Descriptor() const {
+    return descriptor_;
+  }
+
+  const Eigen::VectorXf& RingKey() const {
+    return ring_key_;
+  }
+
+  // Mean over the sectors of the column wise cosine distance at the best
+  // sector shift, 0 for the same place up to yaw and 1 for unrelated places.
+  // The shift aligns column j of this descriptor with column j + shift of the
+  // other's.
+  double Distance(const ScanContext& other, int* shift) const;
+
+  // Yaw (rad) of the other scan's sensor relative to this one for a shift
+  // returned by Distance
+  double ShiftToYaw(int shift) const;
+
+private:
+  double ColumnDistance(const ScanContext& other, int shift) const;
+
+  Eigen::MatrixXf descriptor_;
+  Eigen::VectorXf ring_key_;
+  Eigen::VectorXf sector_key_;
+};
+
+struct ScanContextMatch {
+  gtsam::Key key;
+  double distance;
+  // Yaw of the matched scan relative to the query
+  double yaw;
+};
+
+// Descriptors of the keyed scans seen so far. Ring keys are stored
+// contiguously and indexed by KD-trees over consecutive scans, at most one per
+// power of two sizes: once enough scans were inserted since the last build
+// (the newer ones are searched linearly) they are built into a tree together
+// with the smaller trees before them, so each scan is only rebuilt a
+// logarithmic number of times. The closest ring keys are then compared by
+// their full descriptors. Not thread safe.
+class ScanContextIndex {
+public:
+  void Insert(const gtsam::Key& key, const ScanContext::ConstPtr& context);
+
+  size_t Size() const {
+    return keys_.size();
+  }
+
+  // Number of scans in the KD-trees
+  size_t NumIndexed() const {
+    return tree_.size();
+  }
+
+  // The (up to) num_matches best matches below max_distance among the
+  // num_candidates keys with the closest ring keys, best first. Keys for
+  // which accept returns false are skipped.
+  std::vector<ScanContextMatch>
+  Query(const ScanContext& query,
+        size_t num_candidates,
+        size_t num_matches,
+        double max_distance,
+        const std::function<bool(const gtsam::Key&)>& accept) const;
+
+private:
+  // Squared ring key distance and index into keys_, largest distance on top
+  typedef std::priority_queue<std::pair<float, size_t>> CandidateHeap;
+
+  void BuildTree(size_t begin, size_t end);
+
+  // Offer entry i as one of the num_candidates closest ring keys
+  void AddCandidate(const Eigen::VectorXf& ring_key,
+                    size_t i,
+                    size_t num_candidates,
+                    const std::function<bool(const gtsam::Key&)>& accept,
+                    CandidateHeap* closest) const;
+
+  void SearchTree(size_t begin,
+                  size_t end,
+                  const Eigen::VectorXf& ring_key,
+                  size_t num_candidates,
+                  const std::function<bool(const gtsam::Key&)>& accept,
+                  CandidateHeap* closest) const;
+
+  float RingKeyValue(size_t i, size_t ring) const {
+    return ring_keys_[i * num_rings_ + ring];
+  }
+
+  std::vector<gtsam::Key> keys_;
+  std::vector<ScanContext::ConstPtr> contexts_;
+  // Ring keys of keys_, one after the other
+  std::vector<float> ring_keys_;
+  size_t num_rings_ = 0;
+  // Implicit KD-trees over the first tree_.size() entries, the one ending at
+  // tree_ends_[j] starting at the end of the previous one (largest first).
+  // The median of each range [begin, end) sits at its middle and splits it
+  // along split_rings_
+  std::vector<size_t> tree_;
+  std::vector<size_t> tree_ends_;
+  std::vector<size_t> split_rings_;
+};
+
+} // namespace lamp_loop_closure
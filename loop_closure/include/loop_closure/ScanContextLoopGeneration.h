@@ -0,0 +1,72 @@
+/**
+ * @file   ScanContextLoopGeneration.h
+ * @brief  Find potentital loop closures by matching scan context descriptors
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <gtsam/inference/Symbol.h>
+#include <unordered_set>
+
+#include <lamp_utils/KeyedScanStore.h>
+#include <pose_graph_msgs/KeyedScan.h>
+
+#include "loop_closure/LoopGeneration.h"
+#include "loop_closure/ScanContext.h"
+
+namespace lamp_loop_closure {
+
+// Candidates from place recognition rather than from the pose estimate, so
+// places are recognized regardless of the drift. The candidate pose_to is the
+// pose_from rotated by the yaw between the descriptors, which the CANDIDATE
+// ICP initialization uses as initial guess.
+class ScanContextLoopGeneration : public LoopGeneration {
+public:
+  ScanContextLoopGeneration();
+  ~ScanContextLoopGeneration();
+
+  bool Initialize(const ros::NodeHandle& n) override;
+
+  bool LoadParameters(const ros::NodeHandle& n) override;
+
+  bool CreatePublishers(const ros::NodeHandle& n) override;
+
+  bool RegisterCallbacks(const ros::NodeHandle& n) override;
+
+  // Decode the keyed scans through a store shared with the other consumers
+  // in this process (e.g. lamp_utils::KeyedScanStore::Shared()) instead of
+  // on their own
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store);
+
+protected:
+  void GenerateLoops(const gtsam::Key& new_key,
+                     const ScanContext::ConstPtr& context);
+
+  void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
+
+  void KeyedPoseCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) override;
+
+  void PublishAndClearLoops();
+
+  ros::Subscriber keyed_scans_sub_;
+  // Null unless shared, the scans are then decoded on their own
+  lamp_utils::KeyedScanStore::Ptr keyed_scans_;
+
+  ScanContextParams context_params_;
+  ScanContextIndex index_;
+  // Descriptors of scans whose node has no pose yet
+  std::unordered_map<gtsam::Key, ScanContext::ConstPtr> pending_contexts_;
+  // Keys whose descriptor is in the index
+  std::unordered_set<gtsam::Key> described_keys_;
+
+  size_t num_ring_key_candidates_;
+  size_t n_matches_;
+  double max_descriptor_distance_;
+  size_t skip_recent_poses_;
+
+  size_t num_queries_ = 0;
+  double total_query_time_ = 0;
+};
+
+} // namespace lamp_loop_closure
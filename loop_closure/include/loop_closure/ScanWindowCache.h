@@ -0,0 +1,206 @@
+/**
+ * @file   ScanWindowCache.h
+ * @brief  Bounded, thread-safe LRU cache of data derived from keyed scans
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+#include <gtsam/inference/Key.h>
+
+namespace lamp_loop_closure {
+
+// A keyed scan together with the number of neighbouring scans accumulated
+// around it. The same key with a different window is a different entry.
+struct ScanWindow {
+  gtsam::Key key;
+  unsigned int num_prev;
+  unsigned int num_next;
+
+  bool operator==(const ScanWindow& other) const {
+    return key == other.key && num_prev == other.num_prev &&
+        num_next == other.num_next;
+  }
+
+  // True if the scan of other_key is part of this window
+  bool Contains(const gtsam::Key& other_key) const {
+    return other_key + num_prev >= key && other_key <= key + num_next;
+  }
+};
+
+struct ScanWindowHash {
+  size_t operator()(const ScanWindow& window) const {
+    size_t seed = std::hash<gtsam::Key>()(window.key);
+    seed ^= std::hash<unsigned int>()(window.num_prev) + 0x9e3779b9 +
+        (seed << 6) + (seed >> 2);
+    seed ^= std::hash<unsigned int>()(window.num_next) + 0x9e3779b9 +
+        (seed << 6) + (seed >> 2);
+    return seed;
+  }
+};
+
+struct ScanWindowCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t size = 0;
+  // Sum of the sizes given on insert
+  size_t bytes = 0;
+};
+
+// Least recently used cache, bounded by the number of entries and optionally
+// by the sum of their sizes in bytes. A capacity of zero disables caching:
+// lookups always miss (without being counted) and inserts are dropped.
+template <typename ValueT>
+class ScanWindowCache {
+public:
+  typedef boost::shared_ptr<const ValueT> ValueConstPtr;
+
+  explicit ScanWindowCache(size_t capacity = 0, size_t memory_budget = 0)
+    : capacity_(capacity), memory_budget_(memory_budget) {}
+
+  void SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    EvictToCapacity();
+  }
+
+  size_t Capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+  }
+
+  // Budget in bytes, 0 for no limit
+  void SetMemoryBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    memory_budget_ = bytes;
+    EvictToCapacity();
+  }
+
+  size_t GetMemoryBudget() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memory_budget_;
+  }
+
+  bool Enabled() const {
+    return Capacity() > 0;
+  }
+
+  // Returns null on a miss
+  ValueConstPtr Get(const ScanWindow& window) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capacity_ == 0)
+      return ValueConstPtr();
+    auto it = index_.find(window);
+    if (it == index_.end()) {
+      stats_.misses++;
+      return ValueConstPtr();
+    }
+    stats_.hits++;
+    // Move to the front of the recency list
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->value;
+  }
+
+  // bytes is what the value counts against the memory budget
+  void Insert(const ScanWindow& window,
+              const ValueConstPtr& value,
+              size_t bytes = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capacity_ == 0 || !value)
+      return;
+    auto it = index_.find(window);
+    if (it != index_.end()) {
+      stats_.bytes -= it->second->bytes;
+      it->second->value = value;
+      it->second->bytes = bytes;
+      stats_.bytes += bytes;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      EvictToCapacity();
+      return;
+    }
+    entries_.push_front(Entry{window, value, bytes});
+    index_[window] = entries_.begin();
+    stats_.bytes += bytes;
+    EvictToCapacity();
+  }
+
+  // Drop a single window (e.g. when it is found to be stale)
+  void Erase(const ScanWindow& window) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(window);
+    if (it == index_.end())
+      return;
+    stats_.bytes -= it->second->bytes;
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+
+  // Drop every window that contains the scan of the given key
+  size_t EraseContaining(const gtsam::Key& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n_erased = 0;
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->window.Contains(key)) {
+        index_.erase(it->window);
+        stats_.bytes -= it->bytes;
+        it = entries_.erase(it);
+        n_erased++;
+      } else {
+        ++it;
+      }
+    }
+    return n_erased;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    stats_.bytes = 0;
+  }
+
+  ScanWindowCacheStats GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ScanWindowCacheStats stats = stats_;
+    stats.size = entries_.size();
+    return stats;
+  }
+
+private:
+  struct Entry {
+    ScanWindow window;
+    ValueConstPtr value;
+    size_t bytes;
+  };
+  typedef std::list<Entry> EntryList;
+
+  void EvictToCapacity() {
+    while (!entries_.empty() &&
+           (entries_.size() > capacity_ ||
+            (memory_budget_ > 0 && stats_.bytes > memory_budget_))) {
+      index_.erase(entries_.back().window);
+      stats_.bytes -= entries_.back().bytes;
+      entries_.pop_back();
+      stats_.evictions++;
+    }
+  }
+
+  mutable std::mutex mutex_;
+  size_t capacity_;
+  size_t memory_budget_;
+  // Most recently used at the front
+  EntryList entries_;
+  std::unordered_map<ScanWindow, typename EntryList::iterator, ScanWindowHash>
+      index_;
+  ScanWindowCacheStats stats_;
+};
+
+} // namespace lamp_loop_closure
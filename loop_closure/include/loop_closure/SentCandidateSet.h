@@ -0,0 +1,131 @@
+/**
+ * @file   SentCandidateSet.h
+ * @brief  Open addressing set of the loop candidates already sent
+ * @author Yun Chang
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace lamp_loop_closure {
+
+// Candidates are identified by (key_from, key_to, type) and stored inline in
+// a linear probing table, 32 bytes each with the time sent. With an expiry
+// a candidate counts as sent only for that long, so it can be retried after
+// the graph changed; expired entries are dropped when the table fills up.
+class SentCandidateSet {
+public:
+  explicit SentCandidateSet(double expiry = 0) : expiry_(expiry) {}
+
+  // Seconds a candidate counts as sent, 0 for ever
+  void SetExpiry(double expiry) {
+    expiry_ = expiry;
+  }
+
+  bool Contains(uint64_t key_from,
+                uint64_t key_to,
+                int32_t type,
+                double now) const {
+    if (slots_.empty())
+      return false;
+    const Slot* slot = &slots_[Find(key_from, key_to, type)];
+    return slot->used && !Expired(*slot, now);
+  }
+
+  // Inserts or refreshes the time sent
+  void Insert(uint64_t key_from, uint64_t key_to, int32_t type, double now) {
+    // Keep the load at most one half
+    if (2 * (num_used_ + 1) > slots_.size())
+      Rehash(now);
+    Slot& slot = slots_[Find(key_from, key_to, type)];
+    if (!slot.used) {
+      slot.used = true;
+      slot.key_from = key_from;
+      slot.key_to = key_to;
+      slot.type = type;
+      num_used_++;
+    }
+    slot.sent = now;
+  }
+
+  // Entries held, including expired ones not dropped yet
+  size_t Size() const {
+    return num_used_;
+  }
+
+  size_t Capacity() const {
+    return slots_.size();
+  }
+
+  void Clear() {
+    slots_.clear();
+    num_used_ = 0;
+  }
+
+private:
+  struct Slot {
+    uint64_t key_from = 0;
+    uint64_t key_to = 0;
+    double sent = 0;
+    int32_t type = 0;
+    bool used = false;
+  };
+
+  static uint64_t Mix(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  size_t Find(uint64_t key_from, uint64_t key_to, int32_t type) const {
+    const size_t mask = slots_.size() - 1;
+    size_t i = Mix(key_from ^ Mix(key_to ^ Mix(static_cast<uint32_t>(type)))) &
+        mask;
+    while (slots_[i].used &&
+           !(slots_[i].key_from == key_from && slots_[i].key_to == key_to &&
+             slots_[i].type == type)) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  bool Expired(const Slot& slot, double now) const {
+    return expiry_ > 0 && slot.sent + expiry_ < now;
+  }
+
+  // Drops expired entries and grows the table if still needed
+  void Rehash(double now) {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    size_t num_live = 0;
+    for (const Slot& slot : old) {
+      if (slot.used && !Expired(slot, now))
+        num_live++;
+    }
+    size_t capacity = 16;
+    while (2 * (num_live + 1) > capacity)
+      capacity *= 2;
+    // Only shrink once mostly expired
+    if (capacity < old.size() && 4 * (num_live + 1) > old.size())
+      capacity = old.size();
+    slots_.resize(capacity);
+    num_used_ = 0;
+    for (const Slot& slot : old) {
+      if (!slot.used || Expired(slot, now))
+        continue;
+      slots_[Find(slot.key_from, slot.key_to, slot.type)] = slot;
+      num_used_++;
+    }
+  }
+
+  double expiry_;
+  std::vector<Slot> slots_;
+  size_t num_used_ = 0;
+};
+
+} // namespace lamp_loop_closure
@@ -148,7 +148,8 @@ void GenericLoopPrioritization::PopulatePriorityQueue() {
 }
 
 void GenericLoopPrioritization::PublishBestCandidates() {
-  pose_graph_msgs::LoopCandidateArray output_msg = GetBestCandidates();
+  pose_graph_msgs::LoopCandidateArray::Ptr output_msg(
+      new pose_graph_msgs::LoopCandidateArray(GetBestCandidates()));
   loop_candidate_pub_.publish(output_msg);
 }
 
@@ -179,11 +180,16 @@ void GenericLoopPrioritization::KeyedScanCallback(
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  PointCloudConstPtr scan;
+  if (keyed_scan_store_)
+    scan = keyed_scan_store_->Add(scan_msg);
+  else
+    scan = lamp_utils::KeyedScanStore::Decode(*scan_msg);
 
   Eigen::Matrix<double, 3, 1> obs_eigenv;
-  lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
+  if (!keyed_scan_store_ ||
+      !keyed_scan_store_->GetObservability(key, &obs_eigenv))
+    lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
   double min_obs = obs_eigenv.minCoeff();
   // Add the key and observability
   keyed_observability_.insert(std::pair<gtsam::Key, double>(key, min_obs));
@@ -4,9 +4,14 @@
  * @author Yun Chang
  */
 #include <Eigen/LU>
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <random>
+#include <unordered_set>
 #include <geometry_utils/GeometryUtilsROS.h>
 #include <parameter_utils/ParameterUtils.h>
+#include <pcl/filters/voxel_grid.h>
 #include <pcl/registration/ia_ransac.h>
 #include <teaser/matcher.h>
 #include <teaser/evaluation.h>
@@ -22,9 +27,17 @@ namespace gu = geometry_utils;
 
 namespace lamp_loop_closure {
 
+// Neighbours used to compute the GICP covariances (PCL default)
+static const int kCovarianceNeighbours = 20;
+
 IcpLoopComputation::IcpLoopComputation()
-  : icp_computation_pool_(0), b_accumulate_source_(false) {}
-IcpLoopComputation::~IcpLoopComputation() {}
+  : keyed_scans_(std::make_shared<lamp_utils::KeyedScanStore>()),
+    icp_computation_pool_(0),
+    b_accumulate_source_(false) {}
+IcpLoopComputation::~IcpLoopComputation() {
+  icp_computation_token_.Cancel();
+  icp_computation_pool_.Stop();
+}
 
 bool IcpLoopComputation::Initialize(const ros::NodeHandle& n) {
   std::string name = ros::names::append(n.getNamespace(), "IcpLoopComputation");
@@ -47,7 +60,7 @@ bool IcpLoopComputation::Initialize(const ros::NodeHandle& n) {
   }
   if (number_of_threads_in_icp_computation_pool_ > 1) {
       ROS_INFO_STREAM("Thread Pool Initialized with " << number_of_threads_in_icp_computation_pool_ << " threads");
-      icp_computation_pool_.resize(number_of_threads_in_icp_computation_pool_);
+      icp_computation_pool_.Resize(number_of_threads_in_icp_computation_pool_);
   }
   else{
       ROS_INFO_STREAM("Not initializing thread pool");
@@ -64,6 +77,19 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
 
   if (!pu::Get(param_ns_ + "/max_tolerable_fitness", max_tolerable_fitness_))
     return false;
+  if (!pu::Get(param_ns_ + "/pose_update/window_translation_tolerance",
+               window_translation_tolerance_))
+    return false;
+  if (!pu::Get(param_ns_ + "/pose_update/window_rotation_tolerance",
+               window_rotation_tolerance_))
+    return false;
+
+  double scan_store_budget_mb;
+  if (!pu::Get(param_ns_ + "/keyed_scan_store/memory_budget_mb",
+               scan_store_budget_mb))
+    return false;
+  keyed_scans_->SetMemoryBudget(
+      static_cast<size_t>(std::max(scan_store_budget_mb, 0.0) * 1024 * 1024));
 
   // Load ICP parameters (from point_cloud localization)
   if (!pu::Get(param_ns_ + "/icp_lc/tf_epsilon", icp_tf_epsilon_))
@@ -81,6 +107,12 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get(param_ns_ + "/icp_lc/max_rotation", icp_max_rotation_))
     return false;
+  unsigned int scan_cache_size;
+  if (!pu::Get(param_ns_ + "/icp_lc/scan_cache_size", scan_cache_size))
+    return false;
+  // Scans prepared with the previous parameters are dropped
+  scan_cache_.Clear();
+  scan_cache_.SetCapacity(scan_cache_size);
 
   // Load SAC parameters
   if (!pu::Get(param_ns_ + "/sac_ia/iterations", sac_iterations_))
@@ -93,6 +125,18 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get(param_ns_ + "/sac_ia/features_radius", sac_features_radius_))
     return false;
+  double feature_cache_budget_mb;
+  if (!pu::Get(param_ns_ + "/sac_ia/feature_cache_budget_mb",
+               feature_cache_budget_mb))
+    return false;
+  const size_t feature_cache_budget = static_cast<size_t>(
+      std::max(feature_cache_budget_mb, 0.0) * 1024 * 1024);
+  // Features computed with the previous parameters are dropped
+  feature_cache_.Clear();
+  // Bounded by memory only, a budget of 0 disables the cache
+  feature_cache_.SetCapacity(
+      feature_cache_budget > 0 ? std::numeric_limits<size_t>::max() : 0);
+  feature_cache_.SetMemoryBudget(feature_cache_budget);
   if (!pu::Get(param_ns_ + "/sac_ia/fitness_score_threshold",
                sac_fitness_score_threshold_))
     return false;
@@ -135,12 +179,67 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
     return false;
   icp_init_method_ = IcpInitMethod(icp_init_method);
 
+  int icp_alignment_method;
+  if (!pu::Get(param_ns_ + "/icp_alignment_method", icp_alignment_method))
+    return false;
+  icp_alignment_method_ = IcpAlignmentMethod(icp_alignment_method);
+  if (!pu::Get(param_ns_ + "/icp_lc/coarse_to_fine/levels",
+               coarse_to_fine_levels_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/coarse_to_fine/leaf_size",
+               coarse_to_fine_leaf_size_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/coarse_to_fine/iterations",
+               coarse_to_fine_iterations_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/coarse_to_fine/reject_fitness_scale",
+               coarse_to_fine_reject_scale_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/precheck/num_samples",
+               precheck_num_samples_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/precheck/max_distance",
+               precheck_max_distance_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/precheck/min_overlap",
+               precheck_min_overlap_))
+    return false;
+
   int icp_covar_method;
   if (!pu::Get(param_ns_ + "/icp_covariance_calculation", icp_covar_method))
     return false;
   icp_covariance_method_ = IcpCovarianceMethod(icp_covar_method);
 
-  SetupICP(icp_);
+  LoopClosureVerifierParams verifier_params;
+  double verifier_max_rotation_deg, verifier_odom_max_rotation_deg;
+  if (!pu::Get(param_ns_ + "/verification/enabled", b_verify_closures_))
+    return false;
+  if (!pu::Get(param_ns_ + "/verification/max_translation",
+               verifier_params.max_translation))
+    return false;
+  if (!pu::Get(param_ns_ + "/verification/max_rotation",
+               verifier_max_rotation_deg))
+    return false;
+  if (!pu::Get(param_ns_ + "/verification/drift_rate",
+               verifier_params.drift_rate))
+    return false;
+  if (!pu::Get(param_ns_ + "/verification/odom_max_translation",
+               verifier_params.odom_max_translation))
+    return false;
+  if (!pu::Get(param_ns_ + "/verification/odom_max_rotation",
+               verifier_odom_max_rotation_deg))
+    return false;
+  verifier_params.max_rotation = verifier_max_rotation_deg * M_PI / 180.0;
+  verifier_params.odom_max_rotation =
+      verifier_odom_max_rotation_deg * M_PI / 180.0;
+  verifier_.SetParams(verifier_params);
+
+  // Objects set up with the previous parameters are dropped
+  icp_pool_.SetFactory([this]() {
+    std::unique_ptr<Gicp> icp(new Gicp);
+    SetupICP(*icp);
+    return icp;
+  });
 
   // Hard coded covariances
   if (!pu::Get("laser_lc_rot_sigma", laser_lc_rot_sigma_))
@@ -202,154 +301,275 @@ bool IcpLoopComputation::SetupICP(pcl::MultithreadedGeneralizedIterativeClosestP
 void IcpLoopComputation::ComputeTransforms() {
   // First make copy of input queue
   size_t n = input_queue_.size();
-
-  if (number_of_threads_in_icp_computation_pool_ == 1){
-      //If we have decided to not use the thread pool
-      // Iterate and compute transforms
-      for (size_t i = 0; i < n; i++) {
-          auto candidate = input_queue_.front();
-          input_queue_.pop();
-
-          // Keyed scans do not exist
-          if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-              keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-              if ((ros::Time::now() - candidate.header.stamp).toSec() <
-                  keyed_scans_max_delay_)
-                  input_queue_.push(candidate);
-              if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end()){
-                  ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
-              }
-
-              if (keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-                  ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
-              }
-              continue;
-
-          }
-
-          gtsam::Key key_from = candidate.key_from;
-          gtsam::Key key_to = candidate.key_to;
-          gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
-          gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
-
-          gu::Transform3 transform;
-          gtsam::Matrix66 covariance;
-          double icp_fitness;
-          if (!PerformAlignment(key_from,
-                                key_to,
-                                pose_from,
-                                pose_to,
-                                &transform,
-                                &covariance,
-                                &icp_fitness,
-                                false))
-            continue;
-
-          // If aligned create PoseGraphEdge msg
-          pose_graph_msgs::PoseGraphEdge loop_closure =
-                  CreateLoopClosureEdge(key_from, key_to, transform, covariance);
-          loop_closure.range_error = icp_fitness;
-          output_queue_.push_back(loop_closure);
-      }
-  } else {
+  if (number_of_threads_in_icp_computation_pool_ > 1) {
     ROS_DEBUG_STREAM("Threaded, Queue Size " << n);
-    std::vector<std::future<std::pair<bool, pose_graph_msgs::PoseGraphEdge>>>
-        futures;
-    // Iterate and compute transforms
-    for (size_t i = 0; i < n; i++) {
-      auto candidate = input_queue_.front();
-      input_queue_.pop();
-      // Keyed scans do not exist
-      if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-          keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-        if ((ros::Time::now() - candidate.header.stamp).toSec() <
-            keyed_scans_max_delay_)
-          input_queue_.push(candidate);
-        if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end()) {
-          ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
-        }
-
-        if (keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-          ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
-        }
-        continue;
+  }
+
+  // Iterate and compute transforms
+  for (size_t i = 0; i < n; i++) {
+    auto candidate = input_queue_.front();
+    input_queue_.pop();
+
+    bool has_scan_from = keyed_scans_->Has(candidate.key_from);
+    bool has_scan_to = keyed_scans_->Has(candidate.key_to);
+
+    // Keyed scans do not exist
+    if (!has_scan_from || !has_scan_to) {
+      if ((ros::Time::now() - candidate.header.stamp).toSec() <
+          keyed_scans_max_delay_)
+        input_queue_.push(candidate);
+      if (!has_scan_from) {
+        ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
       }
 
-      // pose_graph_msgs::LoopCandidate* candidate_ptr = new
-      // pose_graph_msgs::LoopCandidate(candidate);
-      futures.emplace_back(icp_computation_pool_.enqueue([&, candidate]() {
-        gtsam::Key key_from = candidate.key_from;
-        gtsam::Key key_to = candidate.key_to;
-        gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
-        gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
-
-        gu::Transform3 transform;
-        gtsam::Matrix66 covariance;
-        double icp_fitness;
-        if (!PerformAlignment(key_from,
-                              key_to,
-                              pose_from,
-                              pose_to,
-                              &transform,
-                              &covariance,
-                              &icp_fitness,
-                              true))
-          return std::make_pair(false, pose_graph_msgs::PoseGraphEdge());
-        // If aligned create PoseGraphEdge msg
-        pose_graph_msgs::PoseGraphEdge loop_closure =
-            CreateLoopClosureEdge(key_from, key_to, transform, covariance);
-        loop_closure.range_error = icp_fitness;
-        return std::make_pair(true, loop_closure);
-      }));
+      if (!has_scan_to) {
+        ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
       }
-      for (auto &future : futures) {
-          future.wait();
-          auto result = future.get();
-          bool alignment_was_successful = result.first;
-          if (alignment_was_successful) {
-              output_queue_.push_back(result.second);
+      continue;
+    }
+
+    if (number_of_threads_in_icp_computation_pool_ == 1) {
+      // If we have decided to not use the thread pool
+      pose_graph_msgs::PoseGraphEdge loop_closure;
+      if (ComputeLoopClosure(candidate, &loop_closure))
+        AddToOutputQueue(loop_closure);
+      continue;
+    }
+
+    // Manually requested closures go ahead of generated ones
+    lamp_utils::TaskOptions options;
+    options.token = icp_computation_token_;
+    if (candidate.type == pose_graph_msgs::LoopCandidate::MANUAL)
+      options.priority = lamp_utils::TaskPriority::HIGH;
+
+    // Do not wait for the result: the worker adds (and if possible publishes)
+    // the loop closure as soon as it is computed
+    in_flight_alignments_.push_back(icp_computation_pool_.Submit(
+        [this, candidate]() {
+          pose_graph_msgs::PoseGraphEdge loop_closure;
+          if (!ComputeLoopClosure(candidate, &loop_closure))
+            return;
+          AddToOutputQueue(loop_closure);
+          if (!b_verify_closures_ &&
+              loop_closure_pub_.getNumSubscribers() > 0) {
+            PublishOutputQueue();
           }
+        },
+        options));
+  }
+
+  PruneFinishedAlignments();
+}
+
+bool IcpLoopComputation::ComputeLoopClosure(
+    const pose_graph_msgs::LoopCandidate& candidate,
+    pose_graph_msgs::PoseGraphEdge* loop_closure) {
+  gtsam::Key key_from = candidate.key_from;
+  gtsam::Key key_to = candidate.key_to;
+  gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
+  gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
+
+  gu::Transform3 transform;
+  gtsam::Matrix66 covariance;
+  double icp_fitness;
+  // A descriptor match brings its own guess (the yaw between the scans),
+  // which the odometry or features know nothing about
+  const bool b_candidate_guess =
+      candidate.type == pose_graph_msgs::LoopCandidate::DESCRIPTOR;
+  const ros::WallTime start = ros::WallTime::now();
+  const bool aligned = PerformAlignment(key_from,
+                                        key_to,
+                                        pose_from,
+                                        pose_to,
+                                        &transform,
+                                        &covariance,
+                                        &icp_fitness,
+                                        b_candidate_guess);
+  // Rejected candidates took a worker all the same
+  RecordComputation((ros::WallTime::now() - start).toSec());
+  if (!aligned)
+    return false;
+
+  // If aligned create PoseGraphEdge msg
+  *loop_closure =
+      CreateLoopClosureEdge(key_from, key_to, transform, covariance);
+  loop_closure->range_error = icp_fitness;
+  return true;
+}
+
+size_t IcpLoopComputation::NumWorkers() const {
+  return std::max<size_t>(number_of_threads_in_icp_computation_pool_, 1);
+}
+
+void IcpLoopComputation::PruneFinishedAlignments() {
+  for (auto it = in_flight_alignments_.begin();
+       it != in_flight_alignments_.end();) {
+    if (it->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      ++it;
+      continue;
+    }
+    try {
+      it->get();
+    } catch (const lamp_utils::TaskCancelled&) {
+    }
+    it = in_flight_alignments_.erase(it);
+  }
+
+  const lamp_utils::ExecutorStats stats = icp_computation_pool_.GetStats();
+  if (stats.completed > 0) {
+    ROS_DEBUG_STREAM("ICP pool: " << in_flight_alignments_.size()
+                                  << " in flight, " << stats.completed
+                                  << " completed, " << stats.stolen
+                                  << " stolen, mean queue time "
+                                  << stats.total_queue_time / stats.completed
+                                  << " s, mean run time "
+                                  << stats.total_run_time / stats.completed
+                                  << " s, max run time " << stats.max_run_time
+                                  << " s");
+  }
+}
+
+bool IcpLoopComputation::HasPendingAlignments() {
+  PruneFinishedAlignments();
+  return !in_flight_alignments_.empty();
+}
+
+void IcpLoopComputation::WaitForPendingAlignments() {
+  for (auto& alignment : in_flight_alignments_) {
+    alignment.wait();
+  }
+  PruneFinishedAlignments();
+}
+
+void IcpLoopComputation::VerifyOutputQueue() {
+  std::lock_guard<std::mutex> lock(output_mutex_);
+  if (output_queue_.size() < 2)
+    return;
+
+  LoopClosureVerifier::Poses poses;
+  {
+    std::shared_lock<std::shared_timed_mutex> poses_lock(keyed_data_mutex_);
+    for (const auto& closure : output_queue_) {
+      for (const gtsam::Key& key : {closure.key_from, closure.key_to}) {
+        auto it = keyed_poses_.find(key);
+        if (it != keyed_poses_.end())
+          poses.emplace(key, it->second);
       }
+    }
+  }
+
+  const std::vector<bool> keep = verifier_.Verify(output_queue_, poses);
+  std::vector<pose_graph_msgs::PoseGraphEdge> verified;
+  for (size_t i = 0; i < output_queue_.size(); i++) {
+    if (keep[i]) {
+      verified.push_back(output_queue_[i]);
+      continue;
+    }
+    ROS_INFO_STREAM("Loop closure between "
+                    << gtsam::DefaultKeyFormatter(output_queue_[i].key_from)
+                    << " and "
+                    << gtsam::DefaultKeyFormatter(output_queue_[i].key_to)
+                    << " is inconsistent with its batch. Not publishing.");
+  }
+  output_queue_.swap(verified);
+}
+
+void IcpLoopComputation::InputCallback(
+    const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates) {
+  LoopComputation::InputCallback(input_candidates);
+  // With the thread pool, start on new candidates right away instead of
+  // waiting for the next timer tick
+  if (number_of_threads_in_icp_computation_pool_ > 1) {
+    ComputeTransforms();
   }
 }
 
 void IcpLoopComputation::ProcessTimerCallback(const ros::TimerEvent& ev) {
   ComputeTransforms();
 
+  const lamp_utils::KeyedScanStoreStats store_stats = keyed_scans_->GetStats();
+  ROS_DEBUG_STREAM("Keyed scan store: "
+                   << store_stats.num_scans << " scans, "
+                   << store_stats.num_decoded << " decoded ("
+                   << store_stats.decoded_bytes / (1024 * 1024) << " MB, "
+                   << store_stats.message_bytes / (1024 * 1024)
+                   << " MB of messages), "
+                   << store_stats.decodes << " decodes, "
+                   << store_stats.evictions << " evictions");
+
+  if (scan_cache_.Enabled()) {
+    const ScanWindowCacheStats stats = GetScanCacheStats();
+    ROS_DEBUG_STREAM("Scan cache: " << stats.size << " entries, "
+                                    << stats.hits << " hits, " << stats.misses
+                                    << " misses, " << stats.evictions
+                                    << " evictions");
+  }
+  if (feature_cache_.Enabled()) {
+    const ScanWindowCacheStats stats = GetFeatureCacheStats();
+    ROS_DEBUG_STREAM("Feature cache: " << stats.size << " entries ("
+                                      << stats.bytes / (1024 * 1024)
+                                      << " MB), " << stats.hits << " hits, "
+                                      << stats.misses << " misses, "
+                                      << stats.evictions << " evictions");
+  }
+  if (num_alignments_ > 0) {
+    ROS_DEBUG_STREAM("ICP: " << num_alignments_ << " candidates, "
+                             << num_precheck_rejections_
+                             << " rejected by pre-check ("
+                             << 100.0 * num_precheck_rejections_ /
+                                    num_alignments_
+                             << "%), " << num_coarse_rejections_
+                             << " rejected at a coarse level");
+  }
+
+  if (b_verify_closures_) {
+    const LoopClosureVerifierStats stats = verifier_.GetStats();
+    ROS_DEBUG_STREAM("Verification: " << stats.verified << " closures, "
+                                      << stats.rejected_odometry
+                                      << " rejected against odometry, "
+                                      << stats.rejected_inconsistent
+                                      << " inconsistent with their batch");
+  }
+
   if (loop_closure_pub_.getNumSubscribers() > 0) {
-    PublishLoopClosures();
+    // Only report completion once every dispatched candidate is done so that
+    // the candidate queue does not release the next batch early
+    const bool batch_done = !HasPendingAlignments();
+    // Verified closures are held until their whole batch is computed
+    if (b_verify_closures_ && batch_done)
+      VerifyOutputQueue();
+    if (!b_verify_closures_ || batch_done)
+      PublishOutputQueue();
+    if (batch_done) {
+      PublishCompletedAllStatus();
+    }
   }
 }
 
 void IcpLoopComputation::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_scans_.find(key) != keyed_scans_.end()) {
+  if (keyed_scans_->Has(key)) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                      << gtsam::DefaultKeyFormatter(key)
                      << " already has a scan. Not adding.");
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
-
-  // Add the key and scan.
-  keyed_scans_.insert(std::pair<gtsam::Key, PointCloudConstPtr>(key, scan));
+  // Add the key and scan (not decoded again if another consumer sharing the
+  // store already did)
+  keyed_scans_->Add(scan_msg);
 }
 
 void IcpLoopComputation::KeyedPoseCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
-  pose_graph_msgs::PoseGraphNode node_msg;
+  std::unique_lock<std::shared_timed_mutex> lock(keyed_data_mutex_);
+  // Every pose at once, so the windows are accumulated from one consistent
+  // set of poses
   for (const auto& node_msg : graph_msg->nodes) {
     gtsam::Key new_key = node_msg.key; // extract new key
-    // Check if the node is new
-    if (keyed_poses_.count(new_key) > 0) {
-      continue; // Not a new node
-    }
 
-    // also extract poses (NOTE(Yun) this pose will not be updated...)
-    gtsam::Pose3 new_pose;
+    // also extract poses
     gtsam::Point3 pose_translation(node_msg.pose.position.x,
                                    node_msg.pose.position.y,
                                    node_msg.pose.position.z);
@@ -357,11 +577,37 @@ void IcpLoopComputation::KeyedPoseCallback(
                                  node_msg.pose.orientation.x,
                                  node_msg.pose.orientation.y,
                                  node_msg.pose.orientation.z);
-    new_pose = gtsam::Pose3(pose_orientation, pose_translation);
+    keyed_poses_[new_key] = gtsam::Pose3(pose_orientation, pose_translation);
+  }
 
-    // add new key and pose to keyed_poses_
-    keyed_poses_[new_key] = new_pose;
+  // Accumulated scan windows only go stale where the relative pose between
+  // consecutive keys changed, not where the trajectory moved rigidly
+  std::unordered_set<gtsam::Key> checked;
+  bool invalidated = false;
+  for (const auto& node_msg : graph_msg->nodes) {
+    for (const gtsam::Key& key : {node_msg.key, node_msg.key + 1}) {
+      const gtsam::Key prev_key = key - 1;
+      if (!checked.insert(key).second || !keyed_poses_.count(key) ||
+          !keyed_poses_.count(prev_key))
+        continue;
+      const gtsam::Pose3 relative =
+          keyed_poses_.at(prev_key).between(keyed_poses_.at(key));
+      auto reference = window_relative_poses_.find(key);
+      if (reference == window_relative_poses_.end()) {
+        window_relative_poses_.emplace(key, relative);
+      } else if (lamp_utils::PoseChanged(reference->second,
+                                         relative,
+                                         window_translation_tolerance_,
+                                         window_rotation_tolerance_)) {
+        scan_cache_.EraseContaining(key);
+        feature_cache_.EraseContaining(key);
+        reference->second = relative;
+        invalidated = true;
+      }
+    }
   }
+  if (invalidated)
+    poses_version_++;
 }
 
 bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
@@ -371,7 +617,7 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
                                           gu::Transform3* delta,
                                           gtsam::Matrix66* covariance,
                                           double* fitness_score,
-                                          bool re_initialize_icp) {
+                                          bool b_candidate_guess) {
   ROS_DEBUG_STREAM("Performing alignment between "
                    << gtsam::DefaultKeyFormatter(key1) << " and "
                    << gtsam::DefaultKeyFormatter(key2));
@@ -381,22 +627,30 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
     return false;
   }
 
-  // Check for available information
-  if (!keyed_scans_.count(key1) || !keyed_scans_.count(key2)) {
-    ROS_WARN(
-        "PerformAlignment: Missing keyed-scans when performing alignment. ");
-    return false;
-  }
+  // Get poses and keys (copied so the keyed scan and pose callbacks are not
+  // blocked while aligning)
+  PointCloudConstPtr scan1, scan2;
+  gtsam::Pose3 odom_pose1, odom_pose2;
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(keyed_data_mutex_);
+    // Check for available information
+    if (!keyed_scans_->Has(key1) || !keyed_scans_->Has(key2)) {
+      ROS_WARN(
+          "PerformAlignment: Missing keyed-scans when performing alignment. ");
+      return false;
+    }
 
-  if (!keyed_poses_.count(key1) || !keyed_poses_.count(key2)) {
-    ROS_WARN(
-        "PerformAlignment: Missing keyed-poses when performing alignment. ");
-    return false;
-  }
+    if (!keyed_poses_.count(key1) || !keyed_poses_.count(key2)) {
+      ROS_WARN(
+          "PerformAlignment: Missing keyed-poses when performing alignment. ");
+      return false;
+    }
 
-  // Get poses and keys
-  const PointCloudConstPtr scan1 = keyed_scans_.at(key1.key());
-  const PointCloudConstPtr scan2 = keyed_scans_.at(key2.key());
+    scan1 = keyed_scans_->Get(key1.key());
+    scan2 = keyed_scans_->Get(key2.key());
+    odom_pose1 = keyed_poses_.at(key1.key());
+    odom_pose2 = keyed_poses_.at(key2.key());
+  }
 
   if (scan1 == NULL || scan2 == NULL) {
     ROS_ERROR("PerformAlignment: Null point clouds.");
@@ -411,41 +665,41 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
     return false;
   }
 
-  PointCloud::Ptr accumulated_target(new PointCloud);
-  *accumulated_target = *scan2;
-  AccumulateScans(key2, accumulated_target);
-
-  PointCloud::Ptr accumulated_source(new PointCloud);
-  *accumulated_source = *scan1;
-
-  if (b_accumulate_source_) {
-    AccumulateScans(key1, accumulated_source);
-  }
-
-  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>* icp;
-  if (re_initialize_icp){
-    icp = new  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>();
-    SetupICP(*icp);
-  } else {
-      icp = &icp_;
-  }
+  // Returned to the pool when leaving scope
+  ObjectPool<Gicp>::Lease icp = icp_pool_.Acquire();
+
+  const ScanWindow target_window{
+      key2.key(), sac_num_prev_scans_, sac_num_next_scans_};
+  const ScanWindow source_window = b_accumulate_source_
+      ? ScanWindow{key1.key(), sac_num_prev_scans_, sac_num_next_scans_}
+      : ScanWindow{key1.key(), 0, 0};
+  const PreparedScanConstPtr target = PrepareScan(target_window, *icp);
+  const PreparedScanConstPtr source = PrepareScan(source_window, *icp);
+  const PointCloudConstPtr accumulated_target = target->cloud;
+  const PointCloudConstPtr accumulated_source = source->cloud;
+
+  // Hand GICP the prepared trees and covariances so it does not rebuild them
+  // (covariances must be set after the clouds, which reset them)
   icp->setInputSource(accumulated_source);
+  icp->setSearchMethodSource(source->tree, true);
+  icp->setSourceCovariances(source->source_covariances);
   icp->setInputTarget(accumulated_target);
-  if (accumulated_source->size() < 20) {
-    icp->setCorrespondenceRandomness(accumulated_source->size());
-  }
+  icp->setSearchMethodTarget(target->tree, true);
+  icp->setTargetCovariances(target->covariances);
 
   ///// ICP initialization scheme
   // Default is to initialize by identity. Other options include
   // initializing with odom measurement
   // or initialize with 0 translation byt rotation from odom
   Eigen::Matrix4f initial_guess;
-  gtsam::Pose3 pose_21 = keyed_poses_[key2].between(keyed_poses_[key1]);
+  gtsam::Pose3 pose_21 = odom_pose2.between(odom_pose1);
   initial_guess = Eigen::Matrix4f::Identity(4, 4);
   initial_guess.block(0, 0, 3, 3) = pose_21.rotation().matrix().cast<float>();
   initial_guess.block(0, 3, 3, 1) = pose_21.translation().cast<float>();
 
-  switch (icp_init_method_) {
+  const IcpInitMethod init_method =
+      b_candidate_guess ? IcpInitMethod::CANDIDATE : icp_init_method_;
+  switch (init_method) {
   case IcpInitMethod::IDENTITY: // initialize with idientity
   {
     initial_guess = Eigen::Matrix4f::Identity(4, 4);
@@ -461,21 +715,10 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
     initial_guess = Eigen::Matrix4f::Identity(4, 4);
     initial_guess.block(0, 0, 3, 3) = pose_21.rotation().matrix().cast<float>();
   } break;
-  case IcpInitMethod::FEATURES: {
-    double sac_fitness_score = sac_fitness_score_threshold_;
-    GetSacInitialAlignment(accumulated_source,
-                           accumulated_target,
-                           &initial_guess,
-                           sac_fitness_score);
-    if (sac_fitness_score >= sac_fitness_score_threshold_) {
-      ROS_DEBUG("SAC fitness score is too high");
-      return false;
-    }
-  } break;
-  case IcpInitMethod::TEASERPP: {
-    GetTeaserInitialAlignment(
-        accumulated_source, accumulated_target, &initial_guess);
-  } break;
+  case IcpInitMethod::FEATURES:
+  case IcpInitMethod::TEASERPP:
+    // Computed from the scan features below
+    break;
   case IcpInitMethod::CANDIDATE: {
     gtsam::Pose3 candidate_pose21 = pose2.between(pose1);
     initial_guess.block(0, 0, 3, 3) =
@@ -489,6 +732,56 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   }
   }
 
+  num_alignments_++;
+  // Only a guess from the poses can be checked before the feature matching
+  // and ICP it is meant to save
+  const bool feature_init = init_method == IcpInitMethod::FEATURES ||
+      init_method == IcpInitMethod::TEASERPP;
+  if (precheck_num_samples_ > 0 && !feature_init) {
+    const double overlap =
+        EstimateOverlap(*source, *target, initial_guess, key1.key());
+    if (overlap < precheck_min_overlap_) {
+      ROS_DEBUG_STREAM("ICP: Rejected by pre-check, overlap: "
+                       << overlap << ", threshold: " << precheck_min_overlap_);
+      num_precheck_rejections_++;
+      return false;
+    }
+  }
+
+  if (init_method == IcpInitMethod::FEATURES) {
+    double sac_fitness_score = sac_fitness_score_threshold_;
+    GetSacInitialAlignment(*GetScanFeatures(source_window, *source),
+                           *GetScanFeatures(target_window, *target),
+                           &initial_guess,
+                           sac_fitness_score);
+    if (sac_fitness_score >= sac_fitness_score_threshold_) {
+      ROS_DEBUG("SAC fitness score is too high");
+      return false;
+    }
+  } else if (init_method == IcpInitMethod::TEASERPP) {
+    GetTeaserInitialAlignment(*GetScanFeatures(source_window, *source),
+                              *GetScanFeatures(target_window, *target),
+                              &initial_guess);
+  }
+
+  if (icp_alignment_method_ == IcpAlignmentMethod::COARSE_TO_FINE) {
+    const bool passed =
+        AlignCoarseToFine(*source, *target, *icp, &initial_guess);
+    // The coarse levels changed these, so restore the full resolution setup
+    icp->setMaxCorrespondenceDistance(icp_corr_dist_);
+    icp->setMaximumIterations(icp_iterations_);
+    if (!passed) {
+      num_coarse_rejections_++;
+      return false;
+    }
+    icp->setInputSource(accumulated_source);
+    icp->setSearchMethodSource(source->tree, true);
+    icp->setSourceCovariances(source->source_covariances);
+    icp->setInputTarget(accumulated_target);
+    icp->setSearchMethodTarget(target->tree, true);
+    icp->setTargetCovariances(target->covariances);
+  }
+
   // Perform ICP_.
   PointCloud::Ptr icp_result(new PointCloud);
   icp->align(*icp_result, initial_guess);
@@ -541,8 +834,8 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
 
   // Check if the rotation exceeds thresholds
   // Get difference between odom and icp estimation
-  gtsam::Pose3 diff = (keyed_poses_[key2].between(keyed_poses_[key1]))
-                          .between(lamp_utils::ToGtsam(*delta));
+  gtsam::Pose3 diff =
+      pose_21.between(lamp_utils::ToGtsam(*delta));
   gtsam::Vector diff_log = gtsam::Pose3::Logmap(diff);
   double trans_diff =
       std::sqrt(diff_log.tail(3).transpose() * diff_log.tail(3));
@@ -598,42 +891,21 @@ void IcpLoopComputation::GetSacInitialAlignment(PointCloudConstPtr source,
                                                 PointCloudConstPtr target,
                                                 Eigen::Matrix4f* tf_out,
                                                 double& sac_fitness_score) {
-  // Get Normals
-  Normals::Ptr source_normals(new Normals);
-  Normals::Ptr target_normals(new Normals);
-  lamp_utils::ExtractNormals(source, source_normals);
-  lamp_utils::ExtractNormals(target, target_normals);
+  GetSacInitialAlignment(*ComputeScanFeatures(source),
+                         *ComputeScanFeatures(target),
+                         tf_out,
+                         sac_fitness_score);
+}
 
-  // Get Harris keypoints for source and target
-  PointCloud::Ptr source_keypoints(new PointCloud);
-  PointCloud::Ptr target_keypoints(new PointCloud);
+void IcpLoopComputation::GetSacInitialAlignment(const ScanFeatures& source,
+                                                const ScanFeatures& target,
+                                                Eigen::Matrix4f* tf_out,
+                                                double& sac_fitness_score) {
+  const PointCloud::Ptr& source_keypoints = source.keypoints;
+  const PointCloud::Ptr& target_keypoints = target.keypoints;
+  const Features::Ptr& source_features = source.features;
+  const Features::Ptr& target_features = target.features;
 
-  lamp_utils::ComputeKeypoints(
-      source, source_normals, harris_params_, icp_threads_, source_keypoints);
-  lamp_utils::ComputeKeypoints(
-      target, target_normals, harris_params_, icp_threads_, target_keypoints);
-
-  Features::Ptr source_features(new Features);
-  Features::Ptr target_features(new Features);
-  lamp_utils::ComputeFeatures(source_keypoints,
-                         source,
-                         source_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         source_features);
-  lamp_utils::ComputeFeatures(target_keypoints,
-                         target,
-                         target_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         target_features);
-
-  // std::cout << "loop - SAC  src cloud size: " << source_keypoints->size() <<
-  // std::endl; std::cout << "loop - SAC target cloud size: " <<
-  // target_keypoints->size() << std::endl; std::cout << "loop - SAC src
-  // features size: " << source_features->size() << std::endl; std::cout <<
-  // "loop - SAC target features size: " << target_features->size() <<
-  // std::endl; Align
   pcl::SampleConsensusInitialAlignment<Point, Point, pcl::FPFHSignature33>
       sac_ia;
   sac_ia.setMaximumIterations(sac_iterations_);
@@ -719,150 +991,26 @@ bool IcpLoopComputation::ComputeICPCovariancePointPoint(
     const Eigen::Matrix4f& T,
     const double& icp_fitness,
     Eigen::Matrix<double, 6, 6>& covariance) {
-  geometry_utils::Transform3 ICP_transformation;
-
-  // Extract translation values from T
-  double t_x = T(0, 3);
-  double t_y = T(1, 3);
-  double t_z = T(2, 3);
-
-  // Extract roll, pitch and yaw from T
-  ICP_transformation.rotation = gu::Rot3(T(0, 0),
-                                         T(0, 1),
-                                         T(0, 2),
-                                         T(1, 0),
-                                         T(1, 1),
-                                         T(1, 2),
-                                         T(2, 0),
-                                         T(2, 1),
-                                         T(2, 2));
-  double r = ICP_transformation.rotation.Roll();
-  double p = ICP_transformation.rotation.Pitch();
-  double y = ICP_transformation.rotation.Yaw();
-
-  // Symbolic expression of the Jacobian matrix
-  double J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
-      J33, J34, J35, J36;
-
-  Eigen::Matrix<double, 6, 6> H;
-  H = Eigen::MatrixXd::Zero(6, 6);
-
-  // Compute the entries of Jacobian
-  // Entries of Jacobian matrix are obtained from MATLAB Symbolic Toolbox
-  for (size_t i = 0; i < pointCloud->points.size(); ++i) {
-    double p_x = pointCloud->points[i].x;
-    double p_y = pointCloud->points[i].y;
-    double p_z = pointCloud->points[i].z;
-
-    J11 = 0.0;
-    J12 = -2.0 *
-        (p_z * sin(p) + p_x * cos(p) * cos(y) - p_y * cos(p) * sin(y)) *
-        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
-         p_y * sin(p) * sin(y));
-    J13 = 2.0 * (p_y * cos(y) * sin(p) + p_x * sin(p) * sin(y)) *
-        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
-         p_y * sin(p) * sin(y));
-    J14 = 2.0 * t_x - 2.0 * p_x + 2.0 * p_z * cos(p) -
-        2.0 * p_x * cos(y) * sin(p) + 2.0 * p_y * sin(p) * sin(y);
-    J15 = 0.0;
-    J16 = 0.0;
-
-    J21 = 2.0 *
-        (p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r)) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J22 = -2.0 *
-        (p_z * cos(p) * cos(r) - p_x * cos(r) * cos(y) * sin(p) +
-         p_y * cos(r) * sin(p) * sin(y)) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J23 = 2.0 *
-        (p_x * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_y * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y))) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J24 = 0.0;
-    J25 = 2.0 * t_y - 2.0 * p_y -
-        2.0 * p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) -
-        2.0 * p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) +
-        2.0 * p_z * cos(r) * sin(p);
-    J26 = 0.0;
-
-    J31 = -2.0 *
-        (p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p)) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J32 = 2.0 *
-        (p_z * cos(p) * sin(r) - p_x * cos(y) * sin(p) * sin(r) +
-         p_y * sin(p) * sin(r) * sin(y)) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J33 = 2.0 *
-        (p_x * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) -
-         p_y * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r))) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J34 = 0.0;
-    J35 = 0.0;
-    J36 = 2.0 * t_z - 2.0 * p_z +
-        2.0 * p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-        2.0 * p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-        2.0 * p_z * sin(p) * sin(r);
-
-    // Form the 3X6 Jacobian matrix
-    Eigen::Matrix<double, 3, 6> J;
-    J << J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
-        J33, J34, J35, J36;
-    // Compute J'XJ (6X6) matrix and keep adding for all the points in the point
-    // cloud
-    H += J.transpose() * J;
-  }
-  covariance = H.inverse() * icp_fitness;
-
-  // Here bound the covariance using eigen values
-  Eigen::EigenSolver<Eigen::MatrixXd> eigensolver;
-  eigensolver.compute(covariance);
-  Eigen::VectorXd eigen_values = eigensolver.eigenvalues().real();
-  Eigen::MatrixXd eigen_vectors = eigensolver.eigenvectors().real();
-  double lower_bound = 0.001; // Should be positive semidef
-  double upper_bound = 1000;
-  if (eigen_values.size() < 6) {
-    covariance = Eigen::MatrixXd::Identity(6, 6) * upper_bound;
-    ROS_ERROR("Failed to find eigen values when computing icp covariance");
-    return false;
-  }
-  for (size_t i = 0; i < 6; i++) {
-    if (eigen_values[i] < lower_bound)
-      eigen_values[i] = lower_bound;
-    if (eigen_values[i] > upper_bound)
-      eigen_values[i] = upper_bound;
-  }
-  // Update covariance matrix after bound
-  covariance =
-      eigen_vectors * eigen_values.asDiagonal() * eigen_vectors.inverse();
-
-  return true;
+  return lamp_utils::ComputeICPCovariancePointPoint(
+      pointCloud, T, icp_fitness, covariance, icp_threads_);
 }
 
 void IcpLoopComputation::AccumulateScans(const gtsam::Key& key,
                                          PointCloud::Ptr scan_out) {
-  for (int i = 0; i < sac_num_prev_scans_; i++) {
+  AccumulateScans(ScanWindow{key, sac_num_prev_scans_, sac_num_next_scans_},
+                  scan_out);
+}
+
+void IcpLoopComputation::AccumulateScans(const ScanWindow& window,
+                                         PointCloud::Ptr scan_out) {
+  const gtsam::Key& key = window.key;
+  for (int i = 0; i < window.num_prev; i++) {
     gtsam::Key prev_key = key - i - 1;
     // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(prev_key) || !keyed_scans_.count(prev_key)) {
+    if (!keyed_poses_.count(prev_key) || !keyed_scans_->Has(prev_key)) {
       continue;
     }
-    const PointCloudConstPtr prev_scan = keyed_scans_[prev_key];
+    const PointCloudConstPtr prev_scan = keyed_scans_->Get(prev_key);
 
     // Transform and Accumulate
     const gtsam::Pose3 new_pose = keyed_poses_.at(key);
@@ -874,13 +1022,13 @@ void IcpLoopComputation::AccumulateScans(const gtsam::Key& key,
     *scan_out += *transformed;
   }
 
-  for (int i = 0; i < sac_num_next_scans_; i++) {
+  for (int i = 0; i < window.num_next; i++) {
     gtsam::Key next_key = key + i + 1;
     // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(next_key) || !keyed_scans_.count(next_key)) {
+    if (!keyed_poses_.count(next_key) || !keyed_scans_->Has(next_key)) {
       continue;
     }
-    const PointCloudConstPtr next_scan = keyed_scans_[next_key];
+    const PointCloudConstPtr next_scan = keyed_scans_->Get(next_key);
 
     // Transform and Accumulate
     const gtsam::Pose3 new_pose = keyed_poses_.at(key);
@@ -893,46 +1041,246 @@ void IcpLoopComputation::AccumulateScans(const gtsam::Key& key,
   }
 }
 
+size_t IcpLoopComputation::NumScansInWindow(const ScanWindow& window) const {
+  size_t num_scans = 1;
+  for (int i = 0; i < window.num_prev; i++) {
+    gtsam::Key prev_key = window.key - i - 1;
+    if (keyed_poses_.count(prev_key) && keyed_scans_->Has(prev_key))
+      num_scans++;
+  }
+  for (int i = 0; i < window.num_next; i++) {
+    gtsam::Key next_key = window.key + i + 1;
+    if (keyed_poses_.count(next_key) && keyed_scans_->Has(next_key))
+      num_scans++;
+  }
+  return num_scans;
+}
+
+IcpLoopComputation::PreparedScanConstPtr IcpLoopComputation::PrepareScan(
+    const ScanWindow& window,
+    pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>& icp) {
+  PointCloud::Ptr accumulated(new PointCloud);
+  size_t num_scans, poses_version;
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(keyed_data_mutex_);
+    poses_version = poses_version_;
+    num_scans = NumScansInWindow(window);
+    PreparedScanConstPtr cached = scan_cache_.Get(window);
+    // A window prepared for other alignment settings is prepared again
+    if (cached && cached->num_scans == num_scans &&
+        cached->levels.size() == NumAlignmentLevels() &&
+        cached->levels_leaf_size == AlignmentLevelsLeafSize()) {
+      return cached;
+    }
+
+    *accumulated = *keyed_scans_->Get(window.key);
+    AccumulateScans(window, accumulated);
+  }
+
+  boost::shared_ptr<PreparedScan> prepared(new PreparedScan);
+  PrepareCloud(accumulated, icp, prepared.get());
+  prepared->num_scans = num_scans;
+  prepared->poses_version = poses_version;
+  prepared->levels_leaf_size = AlignmentLevelsLeafSize();
+
+  // Each coarser level doubles the leaf size
+  for (int level = static_cast<int>(NumAlignmentLevels()) - 1; level >= 0;
+       level--) {
+    const float leaf_size = prepared->levels_leaf_size * std::pow(2, level);
+    PointCloud::Ptr downsampled(new PointCloud);
+    pcl::VoxelGrid<Point> grid;
+    grid.setLeafSize(leaf_size, leaf_size, leaf_size);
+    grid.setInputCloud(accumulated);
+    grid.filter(*downsampled);
+
+    PreparedCloud prepared_level;
+    PrepareCloud(downsampled, icp, &prepared_level);
+    prepared->levels.push_back(prepared_level);
+  }
+
+  // A stale entry (window gained scans) is simply replaced
+  InsertIfPosesUnchanged(&scan_cache_, window, prepared, poses_version);
+  return prepared;
+}
+
+size_t IcpLoopComputation::NumAlignmentLevels() const {
+  if (icp_alignment_method_ != IcpAlignmentMethod::COARSE_TO_FINE)
+    return 0;
+  return coarse_to_fine_levels_;
+}
+
+double IcpLoopComputation::AlignmentLevelsLeafSize() const {
+  if (NumAlignmentLevels() == 0)
+    return 0;
+  return coarse_to_fine_leaf_size_;
+}
+
+void IcpLoopComputation::PrepareCloud(const PointCloudConstPtr& cloud,
+                                      Gicp& icp,
+                                      PreparedCloud* prepared) {
+  prepared->cloud = cloud;
+  prepared->tree.reset(new KdTree);
+  prepared->tree->setInputCloud(cloud);
+  prepared->covariances.reset(new MatricesVector);
+  // Pooled ICP objects keep this from their last scan, so always set it (a
+  // scan with fewer points than neighbours uses all of its points)
+  icp.setCorrespondenceRandomness(
+      std::min<int>(kCovarianceNeighbours, cloud->size()));
+  icp.computeTargetCloudCovariances(
+      cloud, prepared->tree, *prepared->covariances);
+  if (icp.sameSourceAndTargetCovariances()) {
+    prepared->source_covariances = prepared->covariances;
+  } else {
+    prepared->source_covariances.reset(new MatricesVector);
+    icp.computeSourceCloudCovariances(
+        cloud, prepared->tree, *prepared->source_covariances);
+  }
+}
+
+double IcpLoopComputation::EstimateOverlap(const PreparedScan& source,
+                                          const PreparedScan& target,
+                                          const Eigen::Matrix4f& guess,
+                                          const gtsam::Key& seed) const {
+  const size_t source_size = source.cloud->size();
+  if (source_size == 0)
+    return 0;
+
+  // Seeded by the key so that a candidate always gets the same samples
+  std::mt19937 generator(static_cast<std::mt19937::result_type>(seed));
+  std::uniform_int_distribution<size_t> distribution(0, source_size - 1);
+  const float max_sq_distance =
+      precheck_max_distance_ * precheck_max_distance_;
+
+  std::vector<int> matched_indices(1);
+  std::vector<float> matched_distances(1);
+  size_t num_inliers = 0;
+  for (size_t i = 0; i < precheck_num_samples_; i++) {
+    Point point = source.cloud->points[distribution(generator)];
+    point.getVector3fMap() =
+        guess.block<3, 3>(0, 0) * point.getVector3fMap() +
+        guess.block<3, 1>(0, 3);
+    if (target.tree->nearestKSearch(
+            point, 1, matched_indices, matched_distances) > 0 &&
+        matched_distances[0] <= max_sq_distance)
+      num_inliers++;
+  }
+  return static_cast<double>(num_inliers) / precheck_num_samples_;
+}
+
+bool IcpLoopComputation::AlignCoarseToFine(const PreparedScan& source,
+                                           const PreparedScan& target,
+                                           Gicp& icp,
+                                           Eigen::Matrix4f* guess) {
+  const double max_fitness =
+      coarse_to_fine_reject_scale_ * max_tolerable_fitness_;
+  for (size_t i = 0; i < source.levels.size() && i < target.levels.size();
+       i++) {
+    const PreparedCloud& source_level = source.levels[i];
+    const PreparedCloud& target_level = target.levels[i];
+    // Too few points left to say anything about this candidate
+    if (static_cast<int>(source_level.cloud->size()) < kCovarianceNeighbours ||
+        static_cast<int>(target_level.cloud->size()) < kCovarianceNeighbours)
+      continue;
+
+    // Allow correspondences across neighbouring voxels
+    const double leaf_size = coarse_to_fine_leaf_size_ *
+        std::pow(2, coarse_to_fine_levels_ - 1 - i);
+    icp.setMaxCorrespondenceDistance(std::max(icp_corr_dist_, 2 * leaf_size));
+    icp.setMaximumIterations(coarse_to_fine_iterations_);
+    icp.setInputSource(source_level.cloud);
+    icp.setSearchMethodSource(source_level.tree, true);
+    icp.setSourceCovariances(source_level.source_covariances);
+    icp.setInputTarget(target_level.cloud);
+    icp.setSearchMethodTarget(target_level.tree, true);
+    icp.setTargetCovariances(target_level.covariances);
+
+    PointCloud aligned;
+    icp.align(aligned, *guess);
+    const double fitness = icp.getFitnessScore();
+    if (!icp.hasConverged() || fitness > max_fitness) {
+      ROS_DEBUG_STREAM("ICP: Rejected at coarse level with leaf size "
+                       << leaf_size << ", score: " << fitness
+                       << ", threshold: " << max_fitness);
+      return false;
+    }
+    *guess = icp.getFinalTransformation();
+  }
+  return true;
+}
+
+boost::shared_ptr<IcpLoopComputation::ScanFeatures>
+IcpLoopComputation::ComputeScanFeatures(const PointCloudConstPtr& cloud) const {
+  // Get Normals
+  Normals::Ptr normals(new Normals);
+  lamp_utils::ExtractNormals(cloud, normals);
+
+  // Get Harris keypoints and their FPFH features
+  boost::shared_ptr<ScanFeatures> scan_features(new ScanFeatures);
+  scan_features->keypoints.reset(new PointCloud);
+  lamp_utils::ComputeKeypoints(
+      cloud, normals, harris_params_, icp_threads_, scan_features->keypoints);
+  scan_features->features.reset(new Features);
+  lamp_utils::ComputeFeatures(scan_features->keypoints,
+                              cloud,
+                              normals,
+                              sac_features_radius_,
+                              icp_threads_,
+                              scan_features->features);
+  scan_features->num_scans = 1;
+  return scan_features;
+}
+
+IcpLoopComputation::ScanFeaturesConstPtr IcpLoopComputation::GetScanFeatures(
+    const ScanWindow& window, const PreparedScan& scan) {
+  ScanFeaturesConstPtr cached = feature_cache_.Get(window);
+  if (cached && cached->num_scans == scan.num_scans) {
+    return cached;
+  }
+
+  boost::shared_ptr<ScanFeatures> computed = ComputeScanFeatures(scan.cloud);
+  computed->num_scans = scan.num_scans;
+  // A stale entry (window gained scans) is simply replaced
+  InsertIfPosesUnchanged(&feature_cache_,
+                         window,
+                         computed,
+                         scan.poses_version,
+                         FeatureBytes(*computed));
+  return computed;
+}
+
+size_t IcpLoopComputation::FeatureBytes(const ScanFeatures& scan_features) {
+  return sizeof(ScanFeatures) + sizeof(PointCloud) + sizeof(Features) +
+      scan_features.keypoints->size() * sizeof(Point) +
+      scan_features.features->size() * sizeof(pcl::FPFHSignature33);
+}
+
+ScanWindowCacheStats IcpLoopComputation::GetFeatureCacheStats() const {
+  return feature_cache_.GetStats();
+}
+
+ScanWindowCacheStats IcpLoopComputation::GetScanCacheStats() const {
+  return scan_cache_.GetStats();
+}
+
+void IcpLoopComputation::SetKeyedScanStore(
+    const lamp_utils::KeyedScanStore::Ptr& store) {
+  keyed_scans_ = store;
+}
+
 void IcpLoopComputation::GetTeaserInitialAlignment(PointCloudConstPtr source,
                                                    PointCloudConstPtr target,
                                                    Eigen::Matrix4f* tf_out) {
-  // Get Normals
-  Normals::Ptr source_normals(new Normals);
-  Normals::Ptr target_normals(new Normals);
-  lamp_utils::ExtractNormals(source, source_normals);
-  lamp_utils::ExtractNormals(target, target_normals);
-
-  // Get Harris keypoints for source and target
-  PointCloud::Ptr source_keypoints(new PointCloud);
-  PointCloud::Ptr target_keypoints(new PointCloud);
+  GetTeaserInitialAlignment(
+      *ComputeScanFeatures(source), *ComputeScanFeatures(target), tf_out);
+}
 
-  lamp_utils::ComputeKeypoints(
-      source, source_normals, harris_params_, icp_threads_, source_keypoints);
-  lamp_utils::ComputeKeypoints(
-      target, target_normals, harris_params_, icp_threads_, target_keypoints);
-
-  Features::Ptr source_features(new Features);
-  Features::Ptr target_features(new Features);
-  lamp_utils::ComputeFeatures(source_keypoints,
-                         source,
-                         source_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         source_features);
-  lamp_utils::ComputeFeatures(target_keypoints,
-                         target,
-                         target_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         target_features);
-
-  // std::cout << "loop - src cloud size: " << source_keypoints->size() <<
-  // std::endl; std::cout << "loop - target cloud size: " <<
-  // target_keypoints->size() << std::endl; std::cout << "loop - src features
-  // size: " << source_features->size() << std::endl; std::cout << "loop -
-  // target features size: " << target_features->size() << std::endl; std::cout
-  // << "Number of inlier threshold is: " << teaser_inlier_threshold_ <<
-  // std::endl;
+void IcpLoopComputation::GetTeaserInitialAlignment(const ScanFeatures& source,
+                                                   const ScanFeatures& target,
+                                                   Eigen::Matrix4f* tf_out) {
+  const PointCloud::Ptr& source_keypoints = source.keypoints;
+  const PointCloud::Ptr& target_keypoints = target.keypoints;
+  const Features::Ptr& source_features = source.features;
+  const Features::Ptr& target_features = target.features;
 
   if (source_keypoints->size() == 0 || target_keypoints->size() == 0) {
     return;
@@ -5,6 +5,8 @@ Lidar pointcloud based loop closure
 */
 #include "loop_closure/LaserLoopClosure.h"
 
+#include <algorithm>
+
 #include <boost/range/as_array.hpp>
 #include <pcl/io/pcd_io.h>
 #include <pcl/registration/gicp.h>
@@ -26,7 +28,9 @@ Lidar pointcloud based loop closure
 namespace pu = parameter_utils;
 namespace gu = geometry_utils;
 
-LaserLoopClosure::LaserLoopClosure(const ros::NodeHandle& n) : LoopClosure(n) {}
+LaserLoopClosure::LaserLoopClosure(const ros::NodeHandle& n)
+  : LoopClosure(n),
+    keyed_scans_(std::make_shared<lamp_utils::KeyedScanStore>()) {}
 
 LaserLoopClosure::~LaserLoopClosure() {}
 
@@ -79,6 +83,13 @@ bool LaserLoopClosure::Initialize(const ros::NodeHandle& n) {
     return false;
   max_rotation_rad_ = max_rotation_deg_ * M_PI / 180;
 
+  double scan_store_budget_mb;
+  if (!pu::Get(param_ns_ + "/keyed_scan_store/memory_budget_mb",
+               scan_store_budget_mb))
+    return false;
+  keyed_scans_->SetMemoryBudget(
+      static_cast<size_t>(std::max(scan_store_budget_mb, 0.0) * 1024 * 1024));
+
   // Load ICP parameters (from point_cloud localization)
   if (!pu::Get(param_ns_ + "/icp_lc/tf_epsilon", icp_tf_epsilon_))
     return false;
@@ -157,10 +168,10 @@ void LaserLoopClosure::AccumulateScans(gtsam::Key key,
   for (int i = 0; i < sac_num_prev_scans_; i++) {
     gtsam::Key prev_key = key - i - 1;
     // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(prev_key) || !keyed_scans_.count(prev_key)) {
+    if (!keyed_poses_.count(prev_key) || !keyed_scans_->Has(prev_key)) {
       continue;
     }
-    const PointCloud::ConstPtr prev_scan = keyed_scans_[prev_key];
+    const PointCloud::ConstPtr prev_scan = keyed_scans_->Get(prev_key);
 
     // Transform and Accumulate
     const gtsam::Pose3 new_pose = keyed_poses_.at(key);
@@ -175,10 +186,10 @@ void LaserLoopClosure::AccumulateScans(gtsam::Key key,
   for (int i = 0; i < sac_num_next_scans_; i++) {
     gtsam::Key next_key = key + i + 1;
     // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(next_key) || !keyed_scans_.count(next_key)) {
+    if (!keyed_poses_.count(next_key) || !keyed_scans_->Has(next_key)) {
       continue;
     }
-    const PointCloud::ConstPtr next_scan = keyed_scans_[next_key];
+    const PointCloud::ConstPtr next_scan = keyed_scans_->Get(next_key);
 
     // Transform and Accumulate
     const gtsam::Pose3 new_pose = keyed_poses_.at(key);
@@ -261,7 +272,7 @@ bool LaserLoopClosure::FindLoopClosures(
 
   // Look for loop closures for the latest received key
   // Don't check for loop closures against poses that are missing scans.
-  if (!keyed_scans_.count(new_key)) {
+  if (!keyed_scans_->Has(new_key)) {
     ROS_WARN_STREAM("Key " << gtsam::DefaultKeyFormatter(new_key)
                            << " does not have a scan");
     return false;
@@ -269,7 +280,7 @@ bool LaserLoopClosure::FindLoopClosures(
 
   // Get pose and scan for the provided key.
   const gtsam::Pose3 pose1 = keyed_poses_.at(new_key);
-  const PointCloud::ConstPtr scan1 = keyed_scans_.at(new_key);
+  const PointCloud::ConstPtr scan1 = keyed_scans_->Get(new_key);
 
   // Create a temporary copy of last_closure_key_map so that updates in this
   // iteration are not used
@@ -293,7 +304,7 @@ bool LaserLoopClosure::FindLoopClosures(
       continue;
 
     // Skip poses with no keyed scans.
-    if (!keyed_scans_.count(other_key)) {
+    if (!keyed_scans_->Has(other_key)) {
       continue;
     }
 
@@ -413,7 +424,7 @@ bool LaserLoopClosure::PerformAlignment(const gtsam::Symbol key1,
 
   // Check for available information
   if (!keyed_poses_.count(key1) || !keyed_poses_.count(key2) ||
-      !keyed_scans_.count(key1) || !keyed_scans_.count(key2)) {
+      !keyed_scans_->Has(key1) || !keyed_scans_->Has(key2)) {
     ROS_WARN("Incomplete keyed poses/scans");
     return false;
   }
@@ -421,8 +432,8 @@ bool LaserLoopClosure::PerformAlignment(const gtsam::Symbol key1,
   // Get poses and keys
   const gtsam::Pose3 pose1 = keyed_poses_.at(key1);
   const gtsam::Pose3 pose2 = keyed_poses_.at(key2);
-  const PointCloud::ConstPtr scan1 = keyed_scans_.at(key1.key());
-  const PointCloud::ConstPtr scan2 = keyed_scans_.at(key2.key());
+  const PointCloud::ConstPtr scan1 = keyed_scans_->Get(key1.key());
+  const PointCloud::ConstPtr scan2 = keyed_scans_->Get(key2.key());
 
   if (scan1 == NULL || scan2 == NULL) {
     ROS_ERROR("PerformAlignment: Null point clouds.");
@@ -608,7 +619,7 @@ void LaserLoopClosure::SeedCallback(
     gtsam::Symbol key2 = e.key_to;
 
     // Check that scans exist
-    if (!keyed_scans_.count(key1) || !keyed_scans_.count(key2)) {
+    if (!keyed_scans_->Has(key1) || !keyed_scans_->Has(key2)) {
       ROS_WARN_STREAM("Could not seed loop closure - keys do not have scans");
       continue;
     }
@@ -643,18 +654,15 @@ void LaserLoopClosure::SeedCallback(
 void LaserLoopClosure::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_scans_.find(key) != keyed_scans_.end()) {
+  if (keyed_scans_->Has(key)) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                      << gtsam::DefaultKeyFormatter(key)
                      << " already has a scan. Not adding.");
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
-
-  // Add the key and scan.
-  keyed_scans_.insert(std::pair<gtsam::Key, PointCloud::ConstPtr>(key, scan));
+  // Add the key and scan (decoded once by the store).
+  keyed_scans_->Add(scan_msg);
 }
 
 bool LaserLoopClosure::SetupICP() {
@@ -682,139 +690,8 @@ bool LaserLoopClosure::ComputeICPCovariancePointPoint(
     const Eigen::Matrix4f& T,
     const double& icp_fitness,
     Eigen::Matrix<double, 6, 6>& covariance) {
-  geometry_utils::Transform3 ICP_transformation;
-
-  // Extract translation values from T
-  double t_x = T(0, 3);
-  double t_y = T(1, 3);
-  double t_z = T(2, 3);
-
-  // Extract roll, pitch and yaw from T
-  ICP_transformation.rotation = gu::Rot3(T(0, 0),
-                                         T(0, 1),
-                                         T(0, 2),
-                                         T(1, 0),
-                                         T(1, 1),
-                                         T(1, 2),
-                                         T(2, 0),
-                                         T(2, 1),
-                                         T(2, 2));
-  double r = ICP_transformation.rotation.Roll();
-  double p = ICP_transformation.rotation.Pitch();
-  double y = ICP_transformation.rotation.Yaw();
-
-  // Symbolic expression of the Jacobian matrix
-  double J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
-      J33, J34, J35, J36;
-
-  Eigen::Matrix<double, 6, 6> H;
-  H = Eigen::MatrixXd::Zero(6, 6);
-
-  // Compute the entries of Jacobian
-  // Entries of Jacobian matrix are obtained from MATLAB Symbolic Toolbox
-  for (size_t i = 0; i < pointCloud->points.size(); ++i) {
-    double p_x = pointCloud->points[i].x;
-    double p_y = pointCloud->points[i].y;
-    double p_z = pointCloud->points[i].z;
-
-    J11 = 0.0;
-    J12 = -2.0 *
-        (p_z * sin(p) + p_x * cos(p) * cos(y) - p_y * cos(p) * sin(y)) *
-        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
-         p_y * sin(p) * sin(y));
-    J13 = 2.0 * (p_y * cos(y) * sin(p) + p_x * sin(p) * sin(y)) *
-        (t_x - p_x + p_z * cos(p) - p_x * cos(y) * sin(p) +
-         p_y * sin(p) * sin(y));
-    J14 = 2.0 * t_x - 2.0 * p_x + 2.0 * p_z * cos(p) -
-        2.0 * p_x * cos(y) * sin(p) + 2.0 * p_y * sin(p) * sin(y);
-    J15 = 0.0;
-    J16 = 0.0;
-
-    J21 = 2.0 *
-        (p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r)) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J22 = -2.0 *
-        (p_z * cos(p) * cos(r) - p_x * cos(r) * cos(y) * sin(p) +
-         p_y * cos(r) * sin(p) * sin(y)) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J23 = 2.0 *
-        (p_x * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_y * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y))) *
-        (p_y - t_y + p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p));
-    J24 = 0.0;
-    J25 = 2.0 * t_y - 2.0 * p_y -
-        2.0 * p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) -
-        2.0 * p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) +
-        2.0 * p_z * cos(r) * sin(p);
-    J26 = 0.0;
-
-    J31 = -2.0 *
-        (p_x * (sin(r) * sin(y) - cos(p) * cos(r) * cos(y)) +
-         p_y * (cos(y) * sin(r) + cos(p) * cos(r) * sin(y)) -
-         p_z * cos(r) * sin(p)) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J32 = 2.0 *
-        (p_z * cos(p) * sin(r) - p_x * cos(y) * sin(p) * sin(r) +
-         p_y * sin(p) * sin(r) * sin(y)) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J33 = 2.0 *
-        (p_x * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) -
-         p_y * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r))) *
-        (t_z - p_z + p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-         p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-         p_z * sin(p) * sin(r));
-    J34 = 0.0;
-    J35 = 0.0;
-    J36 = 2.0 * t_z - 2.0 * p_z +
-        2.0 * p_x * (cos(r) * sin(y) + cos(p) * cos(y) * sin(r)) +
-        2.0 * p_y * (cos(r) * cos(y) - cos(p) * sin(r) * sin(y)) +
-        2.0 * p_z * sin(p) * sin(r);
-
-    // Form the 3X6 Jacobian matrix
-    Eigen::Matrix<double, 3, 6> J;
-    J << J11, J12, J13, J14, J15, J16, J21, J22, J23, J24, J25, J26, J31, J32,
-        J33, J34, J35, J36;
-    // Compute J'XJ (6X6) matrix and keep adding for all the points in the point
-    // cloud
-    H += J.transpose() * J;
-  }
-  covariance = H.inverse() * icp_fitness;
-
-  // Here bound the covariance using eigen values
-  Eigen::EigenSolver<Eigen::MatrixXd> eigensolver;
-  eigensolver.compute(covariance);
-  Eigen::VectorXd eigen_values = eigensolver.eigenvalues().real();
-  Eigen::MatrixXd eigen_vectors = eigensolver.eigenvectors().real();
-  double lower_bound = 0.001; // Should be positive semidef
-  double upper_bound = 1000;
-  if (eigen_values.size() < 6) {
-    covariance = Eigen::MatrixXd::Identity(6, 6) * upper_bound;
-    ROS_ERROR("Failed to find eigen values when computing icp covariance");
-    return false;
-  }
-  for (size_t i = 0; i < 6; i++) {
-    if (eigen_values[i] < lower_bound)
-      eigen_values[i] = lower_bound;
-    if (eigen_values[i] > upper_bound)
-      eigen_values[i] = upper_bound;
-  }
-  // Update covariance matrix after bound
-  covariance =
-      eigen_vectors * eigen_values.asDiagonal() * eigen_vectors.inverse();
-
-  return true;
+  return lamp_utils::ComputeICPCovariancePointPoint(
+      pointCloud, T, icp_fitness, covariance, icp_threads_);
 }
 
 bool LaserLoopClosure::ComputeICPCovariancePointPlane(
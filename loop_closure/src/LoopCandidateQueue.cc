@@ -6,10 +6,16 @@
  */
 #pragma once
 
+#include <algorithm>
+
 #include <lamp_utils/CommonFunctions.h>
+#include <parameter_utils/ParameterUtils.h>
+#include <std_msgs/Float64.h>
 
 #include "loop_closure/LoopCandidateQueue.h"
 
+namespace pu = parameter_utils;
+
 namespace lamp_loop_closure {
 
 LoopCandidateQueue::LoopCandidateQueue() {}
@@ -42,13 +48,49 @@ bool LoopCandidateQueue::LoadParameters(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   param_ns_ = lamp_utils::GetParamNamespace(n.getNamespace());
 
+  double sent_expiry;
+  if (!pu::Get(param_ns_ + "/queue/sent_expiry", sent_expiry))
+    return false;
+  sent_loop_closures_.SetExpiry(sent_expiry);
+
   return true;
 }
 
+bool LoopCandidateQueue::LoadBatchParameters(int amount_per_round) {
+  AdaptiveBatchParams params;
+  int min_per_round, max_per_round;
+  if (!pu::Get(param_ns_ + "/queue/adaptive/enabled", params.enabled))
+    return false;
+  if (!pu::Get(param_ns_ + "/queue/adaptive/min_per_round", min_per_round))
+    return false;
+  if (!pu::Get(param_ns_ + "/queue/adaptive/max_per_round", max_per_round))
+    return false;
+  if (!pu::Get(param_ns_ + "/queue/adaptive/target_round_time",
+               params.target_round_time))
+    return false;
+  if (!pu::Get(param_ns_ + "/queue/adaptive/max_backlog_wait",
+               params.max_backlog_wait))
+    return false;
+  params.initial_batch = static_cast<size_t>(std::max(amount_per_round, 1));
+  params.min_batch = static_cast<size_t>(std::max(min_per_round, 1));
+  params.max_batch = static_cast<size_t>(std::max(max_per_round, 1));
+  batch_sizer_.SetParams(params);
+  return true;
+}
+
+size_t LoopCandidateQueue::NumQueued() const {
+  size_t n = 0;
+  for (const auto& cur_queue : queues)
+    n += cur_queue.second.size();
+  return n;
+}
+
 bool LoopCandidateQueue::CreatePublishers(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_pub_ = nl.advertise<pose_graph_msgs::LoopCandidateArray>(
       "output_loop_candidates", 10, false);
+  throughput_pub_ =
+      nl.advertise<std_msgs::Float64>("loop_computation_throughput", 10, false);
   return true;
 }
 
@@ -98,6 +140,21 @@ void LoopCandidateQueue::OnLoopComputationCompleted(){
 void LoopCandidateQueue::LoopComputationStatusCallback(const pose_graph_msgs::LoopComputationStatus::ConstPtr& status){
 
   if (status->type == status->COMPLETED_ALL){
+    const double previous_throughput = batch_sizer_.Throughput();
+    batch_sizer_.AddStatus(status->num_computed,
+                           status->mean_computation_time,
+                           status->num_workers,
+                           ros::Time::now().toSec());
+    if (batch_sizer_.Throughput() != previous_throughput) {
+      ROS_DEBUG_STREAM("Loop computation: "
+                       << batch_sizer_.Throughput() << " candidates/s, "
+                       << batch_sizer_.MeanLatency() << " s per candidate on "
+                       << status->num_workers << " workers, "
+                       << batch_sizer_.TotalComputed() << " computed");
+      std_msgs::Float64 throughput;
+      throughput.data = batch_sizer_.Throughput();
+      throughput_pub_.publish(throughput);
+    }
     OnLoopComputationCompleted();
   }
 
@@ -105,35 +162,35 @@ void LoopCandidateQueue::LoopComputationStatusCallback(const pose_graph_msgs::Lo
 
 void LoopCandidateQueue::PublishLoopCandidate(
     const pose_graph_msgs::LoopCandidateArray& candidates, bool check_sent) {
+  // Published by pointer so the loop computation receives it without
+  // serialization when both run in one nodelet manager
+  pose_graph_msgs::LoopCandidateArray::Ptr out_candidate_array(
+      new pose_graph_msgs::LoopCandidateArray);
   if (check_sent) {
-    pose_graph_msgs::LoopCandidateArray out_candidate_array;
     for (auto const &loop_candidate : candidates.candidates) {
       if (!LoopClosureHasBeenSent(loop_candidate)) {
-        out_candidate_array.candidates.push_back(loop_candidate);
+        out_candidate_array->candidates.push_back(loop_candidate);
         AddLoopClosureToSent(loop_candidate);
 
       }
     }
-    loop_candidate_pub_.publish(out_candidate_array);
   } else {
-    loop_candidate_pub_.publish(candidates);
+    *out_candidate_array = candidates;
   }
+  loop_candidate_pub_.publish(out_candidate_array);
 }
-std::string LoopCandidateQueue::make_key(const pose_graph_msgs::LoopCandidate& loop_closure){
-  std::stringstream ss;
-  ss << loop_closure.key_from <<"-" <<loop_closure.key_to <<"-"<<loop_closure.type;
-  return ss.str();
-}
-
-
 bool LoopCandidateQueue::LoopClosureHasBeenSent(const pose_graph_msgs::LoopCandidate& loop_closure){
-  auto got = sent_loop_closures_.find (make_key(loop_closure));
-
-  return (got != sent_loop_closures_.end() );
+  return sent_loop_closures_.Contains(loop_closure.key_from,
+                                      loop_closure.key_to,
+                                      loop_closure.type,
+                                      ros::Time::now().toSec());
 }
 
 void LoopCandidateQueue::AddLoopClosureToSent(const pose_graph_msgs::LoopCandidate& loop_closure){
-  sent_loop_closures_.emplace(make_key(loop_closure));
+  sent_loop_closures_.Insert(loop_closure.key_from,
+                             loop_closure.key_to,
+                             loop_closure.type,
+                             ros::Time::now().toSec());
 }
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -0,0 +1,131 @@
+/**
+ * @file   LoopCandidateScorer.cc
+ * @brief  Scorers for ranking loop candidates and their weighted combination
+ * @author Yun Chang
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <sstream>
+
+#include <gtsam/inference/Symbol.h>
+
+#include "loop_closure/LoopCandidateScorer.h"
+
+namespace lamp_loop_closure {
+
+bool ObservabilityScorer::Score(
+    const pose_graph_msgs::LoopCandidate& candidate, double* score) const {
+  auto from = keyed_observability_->find(candidate.key_from);
+  auto to = keyed_observability_->find(candidate.key_to);
+  if (from == keyed_observability_->end() ||
+      to == keyed_observability_->end())
+    return false;
+  *score = from->second + to->second;
+  return true;
+}
+
+bool DistanceScorer::Score(const pose_graph_msgs::LoopCandidate& candidate,
+                           double* score) const {
+  const auto& p_from = candidate.pose_from.position;
+  const auto& p_to = candidate.pose_to.position;
+  const double dx = p_from.x - p_to.x;
+  const double dy = p_from.y - p_to.y;
+  const double dz = p_from.z - p_to.z;
+  const double distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+  *score = scale_ / (scale_ + distance);
+  return true;
+}
+
+bool TimeSinceClosureScorer::Score(
+    const pose_graph_msgs::LoopCandidate& candidate, double* score) const {
+  const ros::Time& stamp = candidate.header.stamp;
+  std::lock_guard<std::mutex> lock(mutex_);
+  *score = std::max(ScoreRobot(gtsam::Symbol(candidate.key_from).chr(), stamp),
+                    ScoreRobot(gtsam::Symbol(candidate.key_to).chr(), stamp));
+  return true;
+}
+
+void TimeSinceClosureScorer::AddLoopClosure(const gtsam::Key& key_from,
+                                            const gtsam::Key& key_to,
+                                            const ros::Time& stamp) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const gtsam::Key& key : {key_from, key_to}) {
+    ros::Time& last = last_closure_[gtsam::Symbol(key).chr()];
+    if (last < stamp)
+      last = stamp;
+  }
+}
+
+double TimeSinceClosureScorer::ScoreRobot(char prefix,
+                                          const ros::Time& stamp) const {
+  auto it = last_closure_.find(prefix);
+  if (it == last_closure_.end() || saturation_ <= 0)
+    return 1.0;
+  const double elapsed = (stamp - it->second).toSec();
+  return std::min(1.0, std::max(0.0, elapsed / saturation_));
+}
+
+bool UncertaintyScorer::Score(const pose_graph_msgs::LoopCandidate& candidate,
+                              double* score) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto from = position_trace_.find(candidate.key_from);
+  auto to = position_trace_.find(candidate.key_to);
+  if (from == position_trace_.end() || to == position_trace_.end()) {
+    *score = 1.0;
+    return true;
+  }
+  const double trace = from->second + to->second;
+  *score = scale_ > 0 ? trace / (trace + scale_) : 1.0;
+  return true;
+}
+
+void UncertaintyScorer::Update(const pose_graph_msgs::PoseGraph& graph) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& node : graph.nodes) {
+    // Marginals are in the gtsam Pose3 tangent order, rotation then
+    // translation
+    const double trace =
+        node.covariance[21] + node.covariance[28] + node.covariance[35];
+    // All zero when no marginal could be computed for the node
+    if (trace > 0)
+      position_trace_[node.key] = trace;
+    else
+      position_trace_.erase(node.key);
+  }
+}
+
+size_t UncertaintyScorer::NumNodes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return position_trace_.size();
+}
+
+void LoopScoringEngine::AddScorer(const LoopCandidateScorer::Ptr& scorer,
+                                  double weight) {
+  if (weight <= 0)
+    return;
+  scorers_.emplace_back(scorer, weight);
+}
+
+bool LoopScoringEngine::Score(const pose_graph_msgs::LoopCandidate& candidate,
+                              double* score) const {
+  double total = 0;
+  for (const auto& scorer : scorers_) {
+    double value;
+    if (!scorer.first->Score(candidate, &value))
+      return false;
+    total += scorer.second * value;
+  }
+  *score = total;
+  return true;
+}
+
+std::string LoopScoringEngine::Describe() const {
+  std::stringstream ss;
+  for (const auto& scorer : scorers_)
+    ss << "\n  " << scorer.first->Name() << ": " << scorer.second;
+  return ss.str();
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,159 @@
+/**
+ * @file   LoopClosureVerifier.cc
+ * @brief  Pairwise consistency check of a batch of computed loop closures
+ * @author Yun Chang
+ */
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <utility>
+
+#include <gtsam/inference/Symbol.h>
+
+#include <lamp_utils/CommonFunctions.h>
+
+#include "loop_closure/LoopClosureVerifier.h"
+
+namespace lamp_loop_closure {
+
+std::vector<bool> LoopClosureVerifier::Verify(
+    const std::vector<pose_graph_msgs::PoseGraphEdge>& closures,
+    const Poses& poses) {
+  std::vector<bool> keep(closures.size(), true);
+
+  // Closures that can be checked, grouped by the pair of robots they connect
+  // (closures between different robots say nothing about each other)
+  std::map<std::pair<char, char>, std::vector<size_t>> groups;
+  std::vector<pose_graph_msgs::PoseGraphEdge> oriented(closures.size());
+  for (size_t i = 0; i < closures.size(); i++) {
+    if (!poses.count(closures[i].key_from) || !poses.count(closures[i].key_to))
+      continue;
+    stats_.verified++;
+    if (!ConsistentWithOdometry(closures[i], poses)) {
+      keep[i] = false;
+      stats_.rejected_odometry++;
+      continue;
+    }
+    oriented[i] = Oriented(closures[i]);
+    const char robot_from = gtsam::Symbol(oriented[i].key_from).chr();
+    const char robot_to = gtsam::Symbol(oriented[i].key_to).chr();
+    groups[std::make_pair(robot_from, robot_to)].push_back(i);
+  }
+
+  for (const auto& group : groups) {
+    const std::vector<size_t>& voters = group.second;
+    // Nothing to check a lone closure against
+    if (voters.size() < 2)
+      continue;
+
+    std::vector<std::vector<bool>> adjacency(
+        voters.size(), std::vector<bool>(voters.size(), false));
+    for (size_t i = 0; i < voters.size(); i++) {
+      for (size_t j = i + 1; j < voters.size(); j++) {
+        const bool consistent =
+            Consistent(oriented[voters[i]], oriented[voters[j]], poses);
+        adjacency[i][j] = consistent;
+        adjacency[j][i] = consistent;
+      }
+    }
+
+    const std::vector<size_t> clique = LargeClique(adjacency);
+    if (clique.size() < 2)
+      continue;
+    std::vector<bool> in_clique(voters.size(), false);
+    for (size_t v : clique)
+      in_clique[v] = true;
+    for (size_t v = 0; v < voters.size(); v++) {
+      if (!in_clique[v]) {
+        keep[voters[v]] = false;
+        stats_.rejected_inconsistent++;
+      }
+    }
+  }
+  return keep;
+}
+
+pose_graph_msgs::PoseGraphEdge LoopClosureVerifier::Oriented(
+    const pose_graph_msgs::PoseGraphEdge& closure) {
+  if (closure.key_from <= closure.key_to)
+    return closure;
+  pose_graph_msgs::PoseGraphEdge reversed = closure;
+  reversed.key_from = closure.key_to;
+  reversed.key_to = closure.key_from;
+  reversed.pose =
+      lamp_utils::GtsamToRosMsg(lamp_utils::ToGtsam(closure.pose).inverse());
+  return reversed;
+}
+
+bool LoopClosureVerifier::Consistent(
+    const pose_graph_msgs::PoseGraphEdge& closure_i,
+    const pose_graph_msgs::PoseGraphEdge& closure_j,
+    const Poses& poses) const {
+  const gtsam::Pose3 odom_from =
+      poses.at(closure_i.key_from).between(poses.at(closure_j.key_from));
+  const gtsam::Pose3 odom_to =
+      poses.at(closure_i.key_to).between(poses.at(closure_j.key_to));
+  const gtsam::Pose3 cycle = lamp_utils::ToGtsam(closure_i.pose)
+                                 .compose(odom_to)
+                                 .compose(lamp_utils::ToGtsam(closure_j.pose)
+                                              .inverse())
+                                 .compose(odom_from.inverse());
+  const double max_translation = params_.max_translation +
+      params_.drift_rate *
+          (odom_from.translation().norm() + odom_to.translation().norm());
+  return !lamp_utils::PoseChanged(
+      gtsam::Pose3(), cycle, max_translation, params_.max_rotation);
+}
+
+bool LoopClosureVerifier::ConsistentWithOdometry(
+    const pose_graph_msgs::PoseGraphEdge& closure, const Poses& poses) const {
+  if (params_.odom_max_translation <= 0 || params_.odom_max_rotation <= 0)
+    return true;
+  const gtsam::Pose3 odom =
+      poses.at(closure.key_from).between(poses.at(closure.key_to));
+  return !lamp_utils::PoseChanged(odom,
+                                  lamp_utils::ToGtsam(closure.pose),
+                                  params_.odom_max_translation,
+                                  params_.odom_max_rotation);
+}
+
+std::vector<size_t> LoopClosureVerifier::LargeClique(
+    const std::vector<std::vector<bool>>& adjacency) {
+  const size_t n = adjacency.size();
+  std::vector<size_t> degree(n, 0);
+  for (size_t i = 0; i < n; i++)
+    degree[i] = std::count(adjacency[i].begin(), adjacency[i].end(), true);
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return degree[a] > degree[b];
+  });
+
+  // Grow a clique from each vertex, adding its neighbours by degree
+  std::vector<size_t> best;
+  for (size_t seed : order) {
+    if (degree[seed] + 1 <= best.size())
+      break;
+    std::vector<size_t> clique{seed};
+    for (size_t v : order) {
+      if (v == seed || !adjacency[seed][v] ||
+          degree[v] + 1 <= best.size())
+        continue;
+      bool connected = true;
+      for (size_t u : clique) {
+        if (!adjacency[u][v]) {
+          connected = false;
+          break;
+        }
+      }
+      if (connected)
+        clique.push_back(v);
+    }
+    if (clique.size() > best.size())
+      best.swap(clique);
+  }
+  return best;
+}
+
+} // namespace lamp_loop_closure
@@ -28,10 +28,28 @@ bool LoopComputation::CreatePublishers(const ros::NodeHandle& n) {
 
 void LoopComputation::PublishCompletedAllStatus() {
   pose_graph_msgs::LoopComputationStatus status;
+  status.header.stamp = ros::Time::now();
   status.type = status.COMPLETED_ALL;
+  {
+    std::lock_guard<std::mutex> lock(status_mutex_);
+    status.num_computed = status_num_computed_;
+    if (status_num_computed_ > 0) {
+      status.mean_computation_time =
+          status_computation_time_ / status_num_computed_;
+    }
+    status_num_computed_ = 0;
+    status_computation_time_ = 0;
+  }
+  status.num_workers = NumWorkers();
   status_pub_.publish(status);
 }
 
+void LoopComputation::RecordComputation(double seconds) {
+  std::lock_guard<std::mutex> lock(status_mutex_);
+  status_num_computed_++;
+  status_computation_time_ += seconds;
+}
+
 bool LoopComputation::RegisterCallbacks(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_sub_ = nl.subscribe<pose_graph_msgs::LoopCandidateArray>(
@@ -41,18 +59,30 @@ bool LoopComputation::RegisterCallbacks(const ros::NodeHandle& n) {
 }
 
 std::vector<pose_graph_msgs::PoseGraphEdge> LoopComputation::GetCurrentOutputQueue(){
+    std::lock_guard<std::mutex> lock(output_mutex_);
     return output_queue_;
 }
 
-void LoopComputation::PublishLoopClosures() {
-  if (output_queue_.size() == 0) {
-    PublishCompletedAllStatus();
-    return;
+void LoopComputation::AddToOutputQueue(
+    const pose_graph_msgs::PoseGraphEdge& loop_closure) {
+  std::lock_guard<std::mutex> lock(output_mutex_);
+  output_queue_.push_back(loop_closure);
+}
+
+void LoopComputation::PublishOutputQueue() {
+  pose_graph_msgs::PoseGraph::Ptr loop_closures_msg(
+      new pose_graph_msgs::PoseGraph);
+  {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (output_queue_.size() == 0)
+      return;
+    loop_closures_msg->edges.swap(output_queue_);
   }
-  pose_graph_msgs::PoseGraph loop_closures_msg;
-  loop_closures_msg.edges = output_queue_;
   loop_closure_pub_.publish(loop_closures_msg);
-  output_queue_.clear();
+}
+
+void LoopComputation::PublishLoopClosures() {
+  PublishOutputQueue();
   PublishCompletedAllStatus();
 }
 
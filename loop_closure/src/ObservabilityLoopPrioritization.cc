@@ -44,7 +44,8 @@ bool ObservabilityLoopPrioritization::Initialize(const ros::NodeHandle& n) {
 
   ROS_INFO_STREAM("Initialized ObservabilityLoopPrioritization."
                   << "\npublish_n_best: " << publish_n_best_
-                  << "\nmin_observability: " << min_observability_);
+                  << "\nmin_observability: " << min_observability_
+                  << "\nscorer weights:" << scoring_.Describe());
 
   return true;
 }
@@ -67,6 +68,55 @@ bool ObservabilityLoopPrioritization::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/obs_prioritization/horizon", horizon_))
     return false;
 
+  double observability_weight, distance_weight, time_since_closure_weight,
+      uncertainty_weight;
+  double distance_scale, time_since_closure_saturation, uncertainty_scale;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/weights/observability",
+               observability_weight))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/weights/distance",
+               distance_weight))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/weights/time_since_closure",
+               time_since_closure_weight))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/weights/uncertainty",
+               uncertainty_weight))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/distance_scale",
+               distance_scale))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/time_since_closure_saturation",
+               time_since_closure_saturation))
+    return false;
+  if (!pu::Get(param_ns_ + "/obs_prioritization/uncertainty_scale",
+               uncertainty_scale))
+    return false;
+
+  scoring_ = LoopScoringEngine();
+  scoring_.AddScorer(
+      std::make_shared<ObservabilityScorer>(&keyed_observability_),
+      observability_weight);
+  scoring_.AddScorer(std::make_shared<DistanceScorer>(distance_scale),
+                     distance_weight);
+  time_since_closure_scorer_.reset();
+  if (time_since_closure_weight > 0) {
+    time_since_closure_scorer_ = std::make_shared<TimeSinceClosureScorer>(
+        time_since_closure_saturation);
+    scoring_.AddScorer(time_since_closure_scorer_, time_since_closure_weight);
+  }
+  uncertainty_scorer_.reset();
+  if (uncertainty_weight > 0) {
+    uncertainty_scorer_ =
+        std::make_shared<UncertaintyScorer>(uncertainty_scale);
+    scoring_.AddScorer(uncertainty_scorer_, uncertainty_weight);
+  }
+  if (scoring_.NumScorers() == 0) {
+    ROS_ERROR("ObservabilityLoopPrioritization: No scorer has a positive "
+              "weight.");
+    return false;
+  }
+
   return true;
 }
 
@@ -90,6 +140,22 @@ bool ObservabilityLoopPrioritization::RegisterCallbacks(
       &ObservabilityLoopPrioritization::KeyedScanCallback,
       this);
 
+  if (time_since_closure_scorer_) {
+    loop_closure_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+        "loop_closures",
+        100,
+        &ObservabilityLoopPrioritization::LoopClosureCallback,
+        this);
+  }
+
+  if (uncertainty_scorer_) {
+    optimized_values_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+        "optimized_values",
+        10,
+        &ObservabilityLoopPrioritization::OptimizedValuesCallback,
+        this);
+  }
+
   update_timer_ =
       nl.createTimer(ros::Duration(1.0),
                      &ObservabilityLoopPrioritization::ProcessTimerCallback,
@@ -100,12 +166,28 @@ bool ObservabilityLoopPrioritization::RegisterCallbacks(
 
 void ObservabilityLoopPrioritization::ProcessTimerCallback(
     const ros::TimerEvent& ev) {
-  //ROS_INFO_STREAM("Priority Queue Size:" << priority_queue_.size());
-  if (priority_queue_.size() > 0 &&
-      loop_candidate_pub_.getNumSubscribers() > 0) {
+  size_t queue_size;
+  {
+    std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+    queue_size = candidate_heap_.Size();
+  }
+  if (queue_size > 0 && loop_candidate_pub_.getNumSubscribers() > 0) {
     PrunePriorityQueue();
     PublishBestCandidates();
   }
+
+  const LoopCandidateHeapStats stats = GetQueueStats();
+  ROS_DEBUG_STREAM("ObservabilityLoopPrioritization queue depth: "
+                   << stats.depth << " pushed: " << stats.pushed
+                   << " published: " << stats.popped
+                   << " expired: " << stats.expired
+                   << " mean time in queue: " << stats.MeanTimeInQueue()
+                   << "s max: " << stats.max_time_in_queue << "s");
+}
+
+LoopCandidateHeapStats ObservabilityLoopPrioritization::GetQueueStats() {
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  return candidate_heap_.GetStats();
 }
 
 void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
@@ -143,23 +225,13 @@ void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
     if (min_obs_to < min_observability_)
       continue;
 
-    double score = min_obs_from + min_obs_to;
+    double score;
+    if (!scoring_.Score(candidate, &score))
+      continue;
 
     candidate.value = score;
     priority_queue_mutex_.lock();
-    std::deque<double>::iterator score_it = observability_score_.begin();
-    std::deque<pose_graph_msgs::LoopCandidate>::iterator candidate_it =
-        priority_queue_.begin();
-    for (size_t i = 0; i < priority_queue_.size(); i++) {
-      if (score < observability_score_[i]) {
-        ++score_it;
-        ++candidate_it;
-      } else {
-        break;
-      }
-    }
-    observability_score_.insert(score_it, score);
-    priority_queue_.insert(candidate_it, candidate);
+    candidate_heap_.Push(candidate, score, ros::Time::now());
     added++;
     priority_queue_mutex_.unlock();
   }
@@ -172,34 +244,25 @@ void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
 }
 
 void ObservabilityLoopPrioritization::PrunePriorityQueue() {
-  static int old_size = 0;
-  if (priority_queue_.size() != old_size) {
-    ROS_DEBUG_STREAM(
-        "Prune priority queue... size: " << priority_queue_.size());
-    old_size = priority_queue_.size();
-  }
-  priority_queue_mutex_.lock();
-  std::deque<double> temp_observability_score;
-  std::deque<pose_graph_msgs::LoopCandidate> temp_priority_queue;
-  for (size_t i = 0; i < priority_queue_.size(); i++) {
-    auto c = priority_queue_[i];
-    if (c.header.stamp.toSec() + horizon_ > ros::Time::now().toSec()) {
-      temp_observability_score.push_back(observability_score_[i]);
-      temp_priority_queue.push_back(priority_queue_[i]);
-    }
+  // Candidates are indexed by stamp too, so only the expired ones are visited
+  const ros::Time now = ros::Time::now();
+  if (now.toSec() <= horizon_)
+    return;
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  size_t n_expired =
+      candidate_heap_.RemoveStampedBefore(now - ros::Duration(horizon_));
+  if (n_expired > 0) {
+    ROS_DEBUG_STREAM("Discarded " << n_expired << " old measurements. size: "
+                                  << candidate_heap_.Size());
   }
-  observability_score_ = temp_observability_score;
-  priority_queue_ = temp_priority_queue;
-  priority_queue_mutex_.unlock();
-  ROS_DEBUG_STREAM(
-      "Discarded old measurements. size: " << priority_queue_.size());
   return;
 }
 
 void ObservabilityLoopPrioritization::PublishBestCandidates() {
-  pose_graph_msgs::LoopCandidateArray output_msg = GetBestCandidates();
+  pose_graph_msgs::LoopCandidateArray::Ptr output_msg(
+      new pose_graph_msgs::LoopCandidateArray(GetBestCandidates()));
   ROS_DEBUG("Published %d prioritized candidates. ",
-            output_msg.candidates.size());
+            output_msg->candidates.size());
   loop_candidate_pub_.publish(output_msg);
 }
 
@@ -207,18 +270,31 @@ pose_graph_msgs::LoopCandidateArray
 ObservabilityLoopPrioritization::GetBestCandidates() {
   pose_graph_msgs::LoopCandidateArray output_msg;
   output_msg.originator = 2;
+  const ros::Time now = ros::Time::now();
   priority_queue_mutex_.lock();
-  size_t n = priority_queue_.size();
-  for (size_t i = 0; i < n; i++) {
-    if (i == publish_n_best_)
-      break;
-    output_msg.candidates.push_back(priority_queue_.front());
-    priority_queue_.pop_front();
+  while (!candidate_heap_.Empty() &&
+         static_cast<int>(output_msg.candidates.size()) < publish_n_best_) {
+    output_msg.candidates.push_back(candidate_heap_.Pop(now));
   }
   priority_queue_mutex_.unlock();
   return output_msg;
 }
 
+void ObservabilityLoopPrioritization::LoopClosureCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+  for (const auto& edge : msg->edges) {
+    if (edge.type != pose_graph_msgs::PoseGraphEdge::LOOPCLOSE)
+      continue;
+    time_since_closure_scorer_->AddLoopClosure(
+        edge.key_from, edge.key_to, msg->header.stamp);
+  }
+}
+
+void ObservabilityLoopPrioritization::OptimizedValuesCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+  uncertainty_scorer_->Update(*msg);
+}
+
 void ObservabilityLoopPrioritization::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
@@ -229,12 +305,18 @@ void ObservabilityLoopPrioritization::KeyedScanCallback(
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  PointCloudConstPtr scan;
+  if (keyed_scan_store_)
+    scan = keyed_scan_store_->Add(scan_msg);
+  else
+    scan = lamp_utils::KeyedScanStore::Decode(*scan_msg);
 
   char prefix = gtsam::Symbol(key).chr();
   Eigen::Matrix<double, 3, 1> obs_eigenv;
-  lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
+  // Scored once per process when the store is shared
+  if (!keyed_scan_store_ ||
+      !keyed_scan_store_->GetObservability(key, &obs_eigenv))
+    lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
   double obs_normalized =
       obs_eigenv.minCoeff() / static_cast<double>(scan->size());
   if (max_observability_.count(prefix) == 0 ||
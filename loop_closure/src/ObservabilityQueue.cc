@@ -4,12 +4,15 @@
 #include "loop_closure/ObservabilityQueue.h"
 #include <parameter_utils/ParameterUtils.h>
 #include <math.h>
+#include <algorithm>
 #include <limits>
 
 namespace pu = parameter_utils;
 namespace lamp_loop_closure {
 
-ObservabilityQueue::ObservabilityQueue() : LoopCandidateQueue() {}
+ObservabilityQueue::ObservabilityQueue()
+    : LoopCandidateQueue(),
+      keyed_scans_(std::make_shared<lamp_utils::KeyedScanStore>()) {}
 ObservabilityQueue::~ObservabilityQueue() {}
 
 bool ObservabilityQueue::RegisterCallbacks(const ros::NodeHandle& n) {
@@ -38,12 +41,22 @@ bool ObservabilityQueue::LoadParameters(const ros::NodeHandle &n) {
     return false;
   if (!pu::Get(param_ns_ + "/queue/amount_per_round",
                amount_per_round_)) {return false;}
+  if (!LoadBatchParameters(amount_per_round_)) {return false;}
   if (!pu::Get(param_ns_ + "/obs_prioritization/min_observability",
                min_observability_))
     return false;
 
   if (!pu::Get(param_ns_ + "/obs_prioritization/threads", num_threads_))
     return false;
+  if (!pu::Get(param_ns_ + "/keyed_scans_max_delay", keyed_scans_max_delay_))
+    return false;
+
+  double scan_store_budget_mb;
+  if (!pu::Get(param_ns_ + "/keyed_scan_store/memory_budget_mb",
+               scan_store_budget_mb))
+    return false;
+  keyed_scans_->SetMemoryBudget(
+      static_cast<size_t>(std::max(scan_store_budget_mb, 0.0) * 1024 * 1024));
 
     return true;
 }
@@ -51,7 +64,9 @@ bool ObservabilityQueue::LoadParameters(const ros::NodeHandle &n) {
 void ObservabilityQueue::FindNextSet() {
   if (!observability_queue_.empty()) {
     pose_graph_msgs::LoopCandidateArray out_array;
-    for (int i = 0; i < amount_per_round_; ++i) {
+    const size_t batch_size = batch_sizer_.NextBatchSize(
+        observability_queue_.size() + NumQueued());
+    for (size_t i = 0; i < batch_size; ++i) {
       out_array.candidates.push_back(observability_queue_.top().second);
       //ROS_INFO_STREAM("Queue Popped Scan with observability:" << observability_queue_.top().first);
       observability_queue_.pop();
@@ -63,20 +78,14 @@ void ObservabilityQueue::FindNextSet() {
   }
 }
 double ObservabilityQueue::ComputeObservability(const pose_graph_msgs::LoopCandidate& candidate){
-  // Check if keyed scans exist
-  if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-      keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
+  // Scored once per key by the store, not once per candidate
+  Eigen::Matrix<double, 3, 1> obs_eigenv_from;
+  Eigen::Matrix<double, 3, 1> obs_eigenv_to;
+  if (!keyed_scans_->GetObservability(candidate.key_from, &obs_eigenv_from) ||
+      !keyed_scans_->GetObservability(candidate.key_to, &obs_eigenv_to)) {
     return std::numeric_limits<double>::quiet_NaN();
   }
-
-  Eigen::Matrix<double, 3, 1> obs_eigenv_from;
-  lamp_utils::ComputeIcpObservability(keyed_scans_[candidate.key_from],
-                                 &obs_eigenv_from);
   double min_obs_from = obs_eigenv_from.minCoeff();
-
-  Eigen::Matrix<double, 3, 1> obs_eigenv_to;
-  lamp_utils::ComputeIcpObservability(keyed_scans_[candidate.key_to],
-                                 &obs_eigenv_to);
   double min_obs_to = obs_eigenv_to.minCoeff();
 
   double score = min_obs_from + min_obs_to;
@@ -87,11 +96,20 @@ double ObservabilityQueue::ComputeObservability(const pose_graph_msgs::LoopCandi
 
 void ObservabilityQueue::OnNewLoopClosure() {
   for (auto& cur_queue : queues) {
-    while(!cur_queue.second.empty()){
+    // Each candidate once, the ones waiting for their keyed scans go back to
+    // the front and are scored again on the next call
+    const size_t n = cur_queue.second.size();
+    for (size_t i = 0; i < n; i++) {
       auto candidate = cur_queue.second.back();
-      double score = ComputeObservability(candidate);
-      if (isnan(score)) continue; //Retry, this happens when keyed scan isn't found
       cur_queue.second.pop_back();
+      double score = ComputeObservability(candidate);
+      if (isnan(score)) {
+        if ((ros::Time::now() - candidate.header.stamp).toSec() <
+            keyed_scans_max_delay_) {
+          cur_queue.second.push_front(candidate);
+        }
+        continue;
+      }
       if (score >= min_observability_) {
         auto pair = std::make_pair(score, candidate);
         observability_queue_.push(pair);
@@ -109,18 +127,24 @@ void ObservabilityQueue::OnLoopComputationCompleted() {
 void ObservabilityQueue::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_scans_.find(key) != keyed_scans_.end()) {
+  if (keyed_scans_->Has(key)) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                          << gtsam::DefaultKeyFormatter(key)
                          << " already has a scan. Not adding.");
-    return;
+  } else {
+    // Add the key and scan.
+    keyed_scans_->Add(scan_msg);
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  // Candidates may have been waiting for it (also when the shared store got
+  // it first)
+  if (NumQueued() > 0)
+    OnNewLoopClosure();
+}
 
-  // Add the key and scan.
-  keyed_scans_.insert(std::pair<gtsam::Key, PointCloud::ConstPtr>(key, scan));
+void ObservabilityQueue::SetKeyedScanStore(
+    const lamp_utils::KeyedScanStore::Ptr& store) {
+  keyed_scans_ = store;
 }
 
 }
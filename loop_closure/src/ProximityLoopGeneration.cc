@@ -4,6 +4,7 @@
  * @author Yun Chang
  */
 
+#include <algorithm>
 #include <parameter_utils/ParameterUtils.h>
 #include <string>
 #include <lamp_utils/CommonFunctions.h>
@@ -73,6 +74,20 @@ bool ProximityLoopGeneration::LoadParameters(const ros::NodeHandle& n) {
 
   skip_recent_poses_ =
       (int)(distance_to_skip_recent_poses / translation_threshold_nodes);
+
+  if (!pu::Get(param_ns_ + "/pose_update/translation_threshold",
+               pose_update_translation_threshold_))
+    return false;
+  if (!pu::Get(param_ns_ + "/pose_update/rotation_threshold",
+               pose_update_rotation_threshold_))
+    return false;
+  double proposed_expiry;
+  if (!pu::Get(param_ns_ + "/pose_update/proposed_expiry", proposed_expiry))
+    return false;
+  proposed_pairs_.SetExpiry(proposed_expiry);
+
+  // Queries then only visit the cells next to the new node's
+  position_index_.SetCellSize(MaxSearchRadius());
   return true;
 }
 
@@ -102,32 +117,53 @@ ProximityLoopGeneration::DistanceBetweenKeys(const gtsam::Symbol& key1,
   return delta.translation().norm();
 }
 
+double ProximityLoopGeneration::MaxSearchRadius() const {
+  return std::max(proximity_threshold_max_, proximity_threshold_min_);
+}
+
 void ProximityLoopGeneration::GenerateLoops(const gtsam::Key& new_key) {
   // Loop closure off. No candidates generated
   if (!b_check_for_loop_closures_)
     return;
 
   const gtsam::Symbol key = gtsam::Symbol(new_key);
+  const double now = ros::Time::now().toSec();
   std::vector<pose_graph_msgs::LoopCandidate> potential_candidates;
-  for (auto it = keyed_poses_.begin(); it != keyed_poses_.end(); ++it) {
-    const gtsam::Symbol other_key = it->first;
+  // Only poses within the largest possible radius can pass the checks below
+  const std::vector<KeyedPositionIndex::KeyDistance> neighbors =
+      position_index_.RadiusSearch(keyed_poses_.at(new_key).translation(),
+                                   MaxSearchRadius());
+  for (const auto& neighbor : neighbors) {
+    const gtsam::Symbol other_key = neighbor.first;
 
     // Don't self-check.
     if (key == other_key)
       continue;
 
+    // Already proposed before one of the nodes moved
+    const auto pair = std::minmax(new_key, neighbor.first);
+    if (proposed_pairs_.Contains(pair.first,
+                                 pair.second,
+                                 pose_graph_msgs::LoopCandidate::PROXIMITY,
+                                 now))
+      continue;
+
+    // Either key can be the newer one when searching around a moved node
+    const long long index_gap =
+        std::llabs(static_cast<long long>(key.index()) -
+                   static_cast<long long>(other_key.index()));
+
     // Don't compare against poses that were recently collected.
     if (lamp_utils::IsKeyFromSameRobot(key, other_key) &&
-        std::llabs(key.index() - other_key.index()) < skip_recent_poses_)
+        index_gap < skip_recent_poses_)
       continue;
 
-    double distance = DistanceBetweenKeys(key, other_key);
+    double distance = neighbor.second;
     double radius;
     if (lamp_utils::IsKeyFromSameRobot(key, other_key)) {
       radius = std::max(
           0.0,
-          std::min(proximity_threshold_max_,
-                   (key.index() - other_key.index()) * increase_rate_));
+          std::min(proximity_threshold_max_, index_gap * increase_rate_));
     } else {
       radius = std::max(
           proximity_threshold_min_,
@@ -150,27 +186,32 @@ void ProximityLoopGeneration::GenerateLoops(const gtsam::Key& new_key) {
 
     potential_candidates.push_back(candidate);
   }
-  if (potential_candidates.size() < n_closest_) {
-    candidates_.insert(candidates_.end(),
-                       potential_candidates.begin(),
-                       potential_candidates.end());
-  } else {
+  if (potential_candidates.size() >= n_closest_) {
     sort(potential_candidates.begin(),
          potential_candidates.end(),
          [](const pose_graph_msgs::LoopCandidate& lhs,
             const pose_graph_msgs::LoopCandidate& rhs) {
            return lhs.value < rhs.value;
          });
-    candidates_.insert(candidates_.end(),
-                       potential_candidates.begin(),
-                       potential_candidates.begin() + n_closest_);
+    potential_candidates.resize(n_closest_);
+  }
+  for (const auto& candidate : potential_candidates) {
+    const auto pair = std::minmax(candidate.key_from, candidate.key_to);
+    proposed_pairs_.Insert(pair.first,
+                           pair.second,
+                           pose_graph_msgs::LoopCandidate::PROXIMITY,
+                           now);
   }
+  candidates_.insert(candidates_.end(),
+                     potential_candidates.begin(),
+                     potential_candidates.end());
   return;
 }
 
 void ProximityLoopGeneration::KeyedPoseCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
-  pose_graph_msgs::PoseGraphNode node_msg;
+  // Known nodes moved by the optimization
+  std::vector<gtsam::Key> moved_keys;
   for (const auto& node_msg : graph_msg->nodes) {
     gtsam::Symbol new_key = gtsam::Symbol(node_msg.key); // extract new key
     ros::Time timestamp = node_msg.header.stamp; // extract new timestamp
@@ -178,12 +219,7 @@ void ProximityLoopGeneration::KeyedPoseCallback(
     if (!lamp_utils::IsRobotPrefix(new_key.chr()))
       continue;
 
-    // Check if the node is new
-    if (keyed_poses_.count(new_key) > 0) {
-      continue; // Not a new node
-    }
-
-    // also extract poses (NOTE(Yun) this pose will not be updated...)
+    // also extract poses
     gtsam::Pose3 new_pose;
     gtsam::Point3 pose_translation(node_msg.pose.position.x,
                                    node_msg.pose.position.y,
@@ -194,12 +230,32 @@ void ProximityLoopGeneration::KeyedPoseCallback(
                                  node_msg.pose.orientation.z);
     new_pose = gtsam::Pose3(pose_orientation, pose_translation);
 
+    // Known node, follow its optimized pose if it moved
+    auto known = keyed_poses_.find(new_key);
+    if (known != keyed_poses_.end()) {
+      if (lamp_utils::PoseChanged(known->second,
+                                  new_pose,
+                                  pose_update_translation_threshold_,
+                                  pose_update_rotation_threshold_)) {
+        known->second = new_pose;
+        position_index_.Insert(new_key, new_pose.translation());
+        moved_keys.push_back(new_key);
+      }
+      continue;
+    }
+
     // add new key and pose to keyed_poses_
     keyed_poses_[new_key] = new_pose;
+    position_index_.Insert(new_key, new_pose.translation());
 
     GenerateLoops(new_key);
   }
 
+  // Search again around the moved nodes once every pose is updated
+  for (const gtsam::Key& key : moved_keys) {
+    GenerateLoops(key);
+  }
+
   if (loop_candidate_pub_.getNumSubscribers() > 0 && candidates_.size() > 0) {
     PublishLoops();
     ClearLoops();
@@ -20,6 +20,7 @@ bool RoundRobinLoopCandidateQueue::LoadParameters(const ros::NodeHandle &n) {
 
   if (!pu::Get(param_ns_ + "/queue/amount_per_round",
                amount_per_round_)) {return false;}
+  if (!LoadBatchParameters(amount_per_round_)) {return false;}
   return true;
 }
 
@@ -28,7 +29,9 @@ void RoundRobinLoopCandidateQueue::FindNextSet() {
   pose_graph_msgs::LoopCandidateArray out_array;
   int num_found = 0;
   int attempts = 0;
-  while (attempts < amount_per_round_) {
+  const int batch_size =
+      static_cast<int>(batch_sizer_.NextBatchSize(NumQueued()));
+  while (attempts < batch_size) {
     //Loop through queues until we find next one
     pose_graph_msgs::LoopCandidate next_candidate;
     bool found = false;
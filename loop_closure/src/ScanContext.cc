@@ -0,0 +1,272 @@
+/**
+ * @file   ScanContext.cc
+ * @brief  Scan context place descriptor of a keyed scan and its index
+ * @author Yun Chang
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#include "loop_closure/ScanContext.h"
+
+namespace lamp_loop_closure {
+
+// Fraction of the sectors searched on either side of the shift estimated
+// from the sector keys
+static const double kShiftSearchRatio = 0.1;
+
+// Scans inserted since the last build before they are built into a KD-tree,
+// and the largest ranges of a tree that are searched linearly
+static const size_t kTreeRebuildInterval = 50;
+static const size_t kTreeLeafSize = 8;
+
+ScanContext::ScanContext(const ScanContextParams& params,
+                         const PointCloud& cloud) {
+  const size_t num_rings = std::max<size_t>(params.num_rings, 1);
+  const size_t num_sectors = std::max<size_t>(params.num_sectors, 1);
+  descriptor_ = Eigen::MatrixXf::Zero(num_rings, num_sectors);
+  for (const auto& point : cloud.points) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z))
+      continue;
+    const double range = std::hypot(point.x, point.y);
+    if (range <= 0 || range >= params.max_radius)
+      continue;
+    const size_t ring = std::min(
+        static_cast<size_t>(range / params.max_radius * num_rings),
+        num_rings - 1);
+    const double azimuth = std::atan2(point.y, point.x) + M_PI;
+    const size_t sector =
+        std::min(static_cast<size_t>(azimuth / (2 * M_PI) * num_sectors),
+                 num_sectors - 1);
+    const float height = point.z + params.lidar_height;
+    float& bin = descriptor_(ring, sector);
+    bin = std::max(bin, height);
+  }
+  ring_key_ = descriptor_.rowwise().mean();
+  sector_key_ = descriptor_.colwise().mean().transpose();
+}
+
+double ScanContext::Distance(const ScanContext& other, int* shift) const {
+  const int num_sectors = descriptor_.cols();
+  if (other.descriptor_.rows() != descriptor_.rows() ||
+      other.descriptor_.cols() != num_sectors) {
+    *shift = 0;
+    return 1.0;
+  }
+
+  // Coarse shift from the sector keys
+  int coarse_shift = 0;
+  float best_key_distance = std::numeric_limits<float>::max();
+  for (int s = 0; s < num_sectors; s++) {
+    float key_distance = 0;
+    for (int j = 0; j < num_sectors; j++)
+      key_distance +=
+          std::abs(sector_key_(j) - other.sector_key_((j + s) % num_sectors));
+    if (key_distance < best_key_distance) {
+      best_key_distance = key_distance;
+      coarse_shift = s;
+    }
+  }
+
+  const int radius =
+      std::max(1, static_cast<int>(std::ceil(kShiftSearchRatio * num_sectors)));
+  double best = std::numeric_limits<double>::max();
+  for (int offset = -radius; offset <= radius; offset++) {
+    const int s =
+        ((coarse_shift + offset) % num_sectors + num_sectors) % num_sectors;
+    const double distance = ColumnDistance(other, s);
+    if (distance < best) {
+      best = distance;
+      *shift = s;
+    }
+  }
+  return best;
+}
+
+double ScanContext::ShiftToYaw(int shift) const {
+  const int num_sectors = descriptor_.cols();
+  shift %= num_sectors;
+  if (shift > num_sectors / 2)
+    shift -= num_sectors;
+  else if (shift < -num_sectors / 2)
+    shift += num_sectors;
+  return -2 * M_PI * shift / num_sectors;
+}
+
+double ScanContext::ColumnDistance(const ScanContext& other, int shift) const {
+  const int num_sectors = descriptor_.cols();
+  double total = 0;
+  size_t num_columns = 0;
+  for (int j = 0; j < num_sectors; j++) {
+    const auto a = descriptor_.col(j);
+    const auto b = other.descriptor_.col((j + shift) % num_sectors);
+    const float norms = a.norm() * b.norm();
+    // Empty on either side, nothing to compare
+    if (norms <= 0)
+      continue;
+    total += 1.0 - a.dot(b) / norms;
+    num_columns++;
+  }
+  return num_columns > 0 ? total / num_columns : 1.0;
+}
+
+void ScanContextIndex::Insert(const gtsam::Key& key,
+                              const ScanContext::ConstPtr& context) {
+  const Eigen::VectorXf& ring_key = context->RingKey();
+  if (keys_.empty())
+    num_rings_ = ring_key.size();
+  if (static_cast<size_t>(ring_key.size()) != num_rings_)
+    return;
+  keys_.push_back(key);
+  contexts_.push_back(context);
+  ring_keys_.insert(
+      ring_keys_.end(), ring_key.data(), ring_key.data() + num_rings_);
+
+  if (keys_.size() - tree_.size() < kTreeRebuildInterval)
+    return;
+  // Merge the trees that are not larger than the new one into it
+  size_t begin = tree_.size();
+  while (!tree_ends_.empty()) {
+    const size_t last_begin =
+        tree_ends_.size() > 1 ? tree_ends_[tree_ends_.size() - 2] : 0;
+    if (begin - last_begin > keys_.size() - begin)
+      break;
+    begin = last_begin;
+    tree_ends_.pop_back();
+  }
+  tree_.resize(keys_.size());
+  std::iota(tree_.begin() + begin, tree_.end(), begin);
+  split_rings_.resize(keys_.size(), 0);
+  BuildTree(begin, keys_.size());
+  tree_ends_.push_back(keys_.size());
+}
+
+void ScanContextIndex::BuildTree(size_t begin, size_t end) {
+  if (end - begin <= kTreeLeafSize)
+    return;
+
+  // Split along the ring with the largest spread
+  size_t split_ring = 0;
+  float max_spread = -1;
+  for (size_t r = 0; r < num_rings_; r++) {
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    for (size_t t = begin; t < end; t++) {
+      lo = std::min(lo, RingKeyValue(tree_[t], r));
+      hi = std::max(hi, RingKeyValue(tree_[t], r));
+    }
+    if (hi - lo > max_spread) {
+      max_spread = hi - lo;
+      split_ring = r;
+    }
+  }
+
+  const size_t mid = begin + (end - begin) / 2;
+  std::nth_element(tree_.begin() + begin,
+                   tree_.begin() + mid,
+                   tree_.begin() + end,
+                   [&](size_t lhs, size_t rhs) {
+                     return RingKeyValue(lhs, split_ring) <
+                         RingKeyValue(rhs, split_ring);
+                   });
+  split_rings_[mid] = split_ring;
+  BuildTree(begin, mid);
+  BuildTree(mid + 1, end);
+}
+
+void ScanContextIndex::AddCandidate(
+    const Eigen::VectorXf& ring_key,
+    size_t i,
+    size_t num_candidates,
+    const std::function<bool(const gtsam::Key&)>& accept,
+    CandidateHeap* closest) const {
+  float distance = 0;
+  for (size_t r = 0; r < num_rings_; r++) {
+    const float d = ring_key(r) - RingKeyValue(i, r);
+    distance += d * d;
+  }
+  if (closest->size() == num_candidates && distance >= closest->top().first)
+    return;
+  if (!accept(keys_[i]))
+    return;
+  closest->emplace(distance, i);
+  if (closest->size() > num_candidates)
+    closest->pop();
+}
+
+void ScanContextIndex::SearchTree(
+    size_t begin,
+    size_t end,
+    const Eigen::VectorXf& ring_key,
+    size_t num_candidates,
+    const std::function<bool(const gtsam::Key&)>& accept,
+    CandidateHeap* closest) const {
+  if (end - begin <= kTreeLeafSize) {
+    for (size_t t = begin; t < end; t++)
+      AddCandidate(ring_key, tree_[t], num_candidates, accept, closest);
+    return;
+  }
+
+  const size_t mid = begin + (end - begin) / 2;
+  const size_t split_ring = split_rings_[mid];
+  const float diff =
+      ring_key(split_ring) - RingKeyValue(tree_[mid], split_ring);
+  // Nearer half first, the other only if it can still hold a closer key
+  if (diff < 0)
+    SearchTree(begin, mid, ring_key, num_candidates, accept, closest);
+  else
+    SearchTree(mid + 1, end, ring_key, num_candidates, accept, closest);
+  AddCandidate(ring_key, tree_[mid], num_candidates, accept, closest);
+  if (closest->size() == num_candidates &&
+      diff * diff >= closest->top().first)
+    return;
+  if (diff < 0)
+    SearchTree(mid + 1, end, ring_key, num_candidates, accept, closest);
+  else
+    SearchTree(begin, mid, ring_key, num_candidates, accept, closest);
+}
+
+std::vector<ScanContextMatch> ScanContextIndex::Query(
+    const ScanContext& query,
+    size_t num_candidates,
+    size_t num_matches,
+    double max_distance,
+    const std::function<bool(const gtsam::Key&)>& accept) const {
+  std::vector<ScanContextMatch> matches;
+  const Eigen::VectorXf& ring_key = query.RingKey();
+  if (keys_.empty() || num_candidates == 0 ||
+      static_cast<size_t>(ring_key.size()) != num_rings_)
+    return matches;
+
+  // Closest accepted ring keys, from the trees and the scans added since
+  CandidateHeap closest;
+  size_t begin = 0;
+  for (const size_t end : tree_ends_) {
+    SearchTree(begin, end, ring_key, num_candidates, accept, &closest);
+    begin = end;
+  }
+  for (size_t i = tree_.size(); i < keys_.size(); i++)
+    AddCandidate(ring_key, i, num_candidates, accept, &closest);
+
+  for (; !closest.empty(); closest.pop()) {
+    const size_t i = closest.top().second;
+    int shift;
+    const double distance = query.Distance(*contexts_[i], &shift);
+    if (distance > max_distance)
+      continue;
+    matches.push_back({keys_[i], distance, query.ShiftToYaw(shift)});
+  }
+  std::sort(matches.begin(),
+            matches.end(),
+            [](const ScanContextMatch& lhs, const ScanContextMatch& rhs) {
+              return lhs.distance < rhs.distance;
+            });
+  if (matches.size() > num_matches)
+    matches.resize(num_matches);
+  return matches;
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,214 @@
+/**
+ * @file   ScanContextLoopGeneration.cc
+ * @brief  Find potentital loop closures by matching scan context descriptors
+ * @author Yun Chang
+ */
+
+#include <algorithm>
+#include <parameter_utils/ParameterUtils.h>
+#include <lamp_utils/CommonFunctions.h>
+
+#include "loop_closure/ScanContextLoopGeneration.h"
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+ScanContextLoopGeneration::ScanContextLoopGeneration() : LoopGeneration() {}
+ScanContextLoopGeneration::~ScanContextLoopGeneration() {}
+
+bool ScanContextLoopGeneration::Initialize(const ros::NodeHandle& n) {
+  std::string name =
+      ros::names::append(n.getNamespace(), "ScanContextLoopGeneration");
+  // Add load params etc
+  if (!LoadParameters(n)) {
+    ROS_ERROR("%s: Failed to load parameters.", name.c_str());
+    return false;
+  }
+
+  // Register Callbacks
+  if (!RegisterCallbacks(n)) {
+    ROS_ERROR("%s: Failed to register callbacks.", name.c_str());
+    return false;
+  }
+
+  // Publishers
+  if (!CreatePublishers(n)) {
+    ROS_ERROR("%s: Failed to create publishers.", name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool ScanContextLoopGeneration::LoadParameters(const ros::NodeHandle& n) {
+  if (!LoopGeneration::LoadParameters(n))
+    return false;
+
+  int num_rings, num_sectors, num_ring_key_candidates, n_matches;
+  if (!pu::Get(param_ns_ + "/scan_context/num_rings", num_rings))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/num_sectors", num_sectors))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/max_radius",
+               context_params_.max_radius))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/lidar_height",
+               context_params_.lidar_height))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/num_ring_key_candidates",
+               num_ring_key_candidates))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/n_matches", n_matches))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/max_distance",
+               max_descriptor_distance_))
+    return false;
+  context_params_.num_rings = std::max(num_rings, 1);
+  context_params_.num_sectors = std::max(num_sectors, 1);
+  num_ring_key_candidates_ = std::max(num_ring_key_candidates, 1);
+  n_matches_ = std::max(n_matches, 1);
+
+  double distance_to_skip_recent_poses, translation_threshold_nodes;
+  if (!pu::Get(param_ns_ + "/translation_threshold_nodes",
+               translation_threshold_nodes))
+    return false;
+  if (!pu::Get(param_ns_ + "/distance_to_skip_recent_poses",
+               distance_to_skip_recent_poses))
+    return false;
+  skip_recent_poses_ =
+      (int)(distance_to_skip_recent_poses / translation_threshold_nodes);
+  return true;
+}
+
+bool ScanContextLoopGeneration::CreatePublishers(const ros::NodeHandle& n) {
+  if (!LoopGeneration::CreatePublishers(n))
+    return false;
+  return true;
+}
+
+bool ScanContextLoopGeneration::RegisterCallbacks(const ros::NodeHandle& n) {
+  ros::NodeHandle nl(n);
+  keyed_poses_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+      "pose_graph_incremental",
+      100000,
+      &ScanContextLoopGeneration::KeyedPoseCallback,
+      this);
+  keyed_scans_sub_ = nl.subscribe<pose_graph_msgs::KeyedScan>(
+      "keyed_scans",
+      100000,
+      &ScanContextLoopGeneration::KeyedScanCallback,
+      this);
+  return true;
+}
+
+void ScanContextLoopGeneration::SetKeyedScanStore(
+    const lamp_utils::KeyedScanStore::Ptr& store) {
+  keyed_scans_ = store;
+}
+
+void ScanContextLoopGeneration::GenerateLoops(
+    const gtsam::Key& new_key, const ScanContext::ConstPtr& context) {
+  // Loop closure off. Only keep the descriptor in case it is turned on
+  if (!b_check_for_loop_closures_) {
+    index_.Insert(new_key, context);
+    return;
+  }
+
+  const gtsam::Symbol key(new_key);
+  auto accept = [&](const gtsam::Key& other) {
+    const gtsam::Symbol other_key(other);
+    // Don't compare against poses that were recently collected.
+    return !(lamp_utils::IsKeyFromSameRobot(key, other_key) &&
+             std::llabs(key.index() - other_key.index()) < skip_recent_poses_);
+  };
+  const ros::WallTime start = ros::WallTime::now();
+  const std::vector<ScanContextMatch> matches =
+      index_.Query(*context,
+                   num_ring_key_candidates_,
+                   n_matches_,
+                   max_descriptor_distance_,
+                   accept);
+  total_query_time_ += (ros::WallTime::now() - start).toSec();
+  num_queries_++;
+  index_.Insert(new_key, context);
+
+  const gtsam::Pose3& pose_from = keyed_poses_.at(new_key);
+  for (const auto& match : matches) {
+    pose_graph_msgs::LoopCandidate candidate;
+    candidate.header.stamp = ros::Time::now();
+    candidate.key_from = new_key;
+    candidate.key_to = match.key;
+    candidate.pose_from = lamp_utils::GtsamToRosMsg(pose_from);
+    // Same place, rotated by the yaw between the descriptors
+    candidate.pose_to = lamp_utils::GtsamToRosMsg(pose_from.compose(
+        gtsam::Pose3(gtsam::Rot3::Yaw(match.yaw), gtsam::Point3(0, 0, 0))));
+    candidate.type = pose_graph_msgs::LoopCandidate::DESCRIPTOR;
+    candidate.value = match.distance;
+    candidates_.push_back(candidate);
+  }
+
+  ROS_DEBUG_STREAM("Scan context: " << matches.size() << " candidates for "
+                                    << gtsam::DefaultKeyFormatter(new_key)
+                                    << " among " << index_.Size()
+                                    << " scans, mean query time "
+                                    << total_query_time_ / num_queries_
+                                    << " s");
+}
+
+void ScanContextLoopGeneration::KeyedScanCallback(
+    const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
+  const gtsam::Key key = scan_msg->key;
+  if (!lamp_utils::IsRobotPrefix(gtsam::Symbol(key).chr()))
+    return;
+  if (pending_contexts_.count(key) || described_keys_.count(key))
+    return;
+
+  // Without a shared store only the descriptor is kept, not the scan
+  PointCloudConstPtr scan;
+  if (keyed_scans_)
+    scan = keyed_scans_->Add(scan_msg);
+  else
+    scan = lamp_utils::KeyedScanStore::Decode(*scan_msg);
+  if (scan == NULL)
+    return;
+  ScanContext::ConstPtr context(new ScanContext(context_params_, *scan));
+
+  if (!keyed_poses_.count(key)) {
+    pending_contexts_[key] = context;
+    return;
+  }
+  described_keys_.insert(key);
+  GenerateLoops(key, context);
+  PublishAndClearLoops();
+}
+
+void ScanContextLoopGeneration::KeyedPoseCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  for (const auto& node_msg : graph_msg->nodes) {
+    const gtsam::Symbol new_key(node_msg.key);
+    if (!lamp_utils::IsRobotPrefix(new_key.chr()))
+      continue;
+
+    // Latest estimate, the candidates are only placed relative to it
+    keyed_poses_[new_key] = lamp_utils::ToGtsam(node_msg.pose);
+
+    auto pending = pending_contexts_.find(new_key);
+    if (pending == pending_contexts_.end())
+      continue;
+    described_keys_.insert(new_key);
+    GenerateLoops(new_key, pending->second);
+    pending_contexts_.erase(pending);
+  }
+
+  PublishAndClearLoops();
+}
+
+void ScanContextLoopGeneration::PublishAndClearLoops() {
+  if (loop_candidate_pub_.getNumSubscribers() > 0 && candidates_.size() > 0) {
+    PublishLoops();
+    ClearLoops();
+  }
+}
+
+} // namespace lamp_loop_closure
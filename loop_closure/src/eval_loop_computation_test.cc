@@ -68,7 +68,7 @@ public:
       ROS_INFO_STREAM("Thread Pool Initialized with "
                       << icp_lc_.number_of_threads_in_icp_computation_pool_
                       << " threads");
-      icp_lc_.icp_computation_pool_.resize(
+      icp_lc_.icp_computation_pool_.Resize(
           icp_lc_.number_of_threads_in_icp_computation_pool_);
     }
 
@@ -114,6 +114,7 @@ public:
 
   void ComputeLoopClosures() {
     icp_lc_.ComputeTransforms();
+    icp_lc_.WaitForPendingAlignments();
   }
 
   std::vector<pose_graph_msgs::PoseGraphEdge> GetLoopClosures() {
@@ -0,0 +1,151 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang (yunchang@mit.edu)
+ */
+
+#include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/KeyedScanStore.h>
+#include <loop_closure/GenericLoopPrioritization.h>
+#include <loop_closure/IcpLoopComputation.h>
+#include <loop_closure/ObservabilityLoopPrioritization.h>
+#include <loop_closure/ObservabilityQueue.h>
+#include <loop_closure/ProximityLoopGeneration.h>
+#include <loop_closure/RoundRobinLoopCandidateQueue.h>
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <parameter_utils/ParameterUtils.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+
+// Nodelet versions of the loop_generation, loop_prioritization,
+// loop_candidate_queue and loop_computation nodes. Loaded into one manager
+// they pass loop candidates by pointer, receive each keyed scan message once
+// and share the decoded scans through lamp_utils::KeyedScanStore::Shared().
+// Parameters are looked up from the manager, so load them there.
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+class LoopGenerationNodelet : public nodelet::Nodelet {
+public:
+  void onInit() override {
+    if (!loop_gen_.Initialize(getPrivateNodeHandle())) {
+      NODELET_ERROR(
+          "%s: Failed to initialize Loop Candidate Generation module. ",
+          getName().c_str());
+    }
+  }
+
+private:
+  ProximityLoopGeneration loop_gen_;
+};
+
+class LoopPrioritizationNodelet : public nodelet::Nodelet {
+public:
+  void onInit() override {
+    ros::NodeHandle n = getPrivateNodeHandle();
+    int prioritization_method = 0;
+    std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+    if (!pu::Get(param_ns + "/prioritization_method", prioritization_method)) {
+      NODELET_ERROR("%s: Failed to load prioritization method. ",
+                    getName().c_str());
+      return;
+    }
+
+    switch (prioritization_method) {
+    case 0: {
+      loop_prioritize_ = std::unique_ptr<GenericLoopPrioritization>(
+          new GenericLoopPrioritization);
+    } break;
+    case 1: {
+      loop_prioritize_ = std::unique_ptr<ObservabilityLoopPrioritization>(
+          new ObservabilityLoopPrioritization);
+    } break;
+    default: {
+      NODELET_ERROR("%s: Unrecognized prioritization method. ",
+                    getName().c_str());
+      return;
+    }
+    }
+    loop_prioritize_->SetKeyedScanStore(lamp_utils::KeyedScanStore::Shared());
+    if (!loop_prioritize_->Initialize(n)) {
+      NODELET_ERROR(
+          "%s: Failed to initialize Loop Candidate Prioritization module. ",
+          getName().c_str());
+      return;
+    }
+    async_spinners_ = loop_prioritize_->SetAsyncSpinners(n);
+    for (auto& spinner : async_spinners_)
+      spinner.start();
+  }
+
+private:
+  std::unique_ptr<LoopPrioritization> loop_prioritize_;
+  // Stop (on destruction) before the prioritization they call into
+  std::vector<ros::AsyncSpinner> async_spinners_;
+};
+
+class LoopCandidateQueueNodelet : public nodelet::Nodelet {
+public:
+  void onInit() override {
+    ros::NodeHandle n = getPrivateNodeHandle();
+    int queue_method = 0;
+    std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+    if (!pu::Get(param_ns + "/queue/method", queue_method)) {
+      NODELET_ERROR("%s: Failed to load queue method. ", getName().c_str());
+      return;
+    }
+
+    switch (queue_method) {
+    case 1: {
+      queue_ = std::unique_ptr<RoundRobinLoopCandidateQueue>(
+          new RoundRobinLoopCandidateQueue);
+    } break;
+    case 2: {
+      std::unique_ptr<ObservabilityQueue> queue(new ObservabilityQueue);
+      queue->SetKeyedScanStore(lamp_utils::KeyedScanStore::Shared());
+      queue_ = std::move(queue);
+    } break;
+    default: {
+      NODELET_ERROR_STREAM(getName() << ": Unrecognized queue method "
+                                     << queue_method);
+      return;
+    }
+    }
+    if (!queue_->Initialize(n)) {
+      NODELET_ERROR("%s: Failed to initialize Loop Candidate Queue module. ",
+                    getName().c_str());
+    }
+  }
+
+private:
+  std::unique_ptr<LoopCandidateQueue> queue_;
+};
+
+class LoopComputationNodelet : public nodelet::Nodelet {
+public:
+  void onInit() override {
+    loop_computation_.SetKeyedScanStore(lamp_utils::KeyedScanStore::Shared());
+    if (!loop_computation_.Initialize(getPrivateNodeHandle())) {
+      NODELET_ERROR(
+          "%s: Failed to initialize Loop Candidate Computation module.",
+          getName().c_str());
+    }
+  }
+
+private:
+  IcpLoopComputation loop_computation_;
+};
+
+} // namespace lamp_loop_closure
+
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopGenerationNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopPrioritizationNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopCandidateQueueNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopComputationNodelet,
+                       nodelet::Nodelet)
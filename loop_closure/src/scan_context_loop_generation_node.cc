@@ -0,0 +1,25 @@
+/*
+ * Copyright Notes
+ *
+ * Authors: Yun Chang    (yunchang@mit.edu)
+ */
+
+#include <loop_closure/ScanContextLoopGeneration.h>
+#include <ros/ros.h>
+
+namespace lc = lamp_loop_closure;
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "scan_context_loop_generation");
+  ros::NodeHandle n("~");
+
+  lc::ScanContextLoopGeneration loop_gen;
+  if (!loop_gen.Initialize(n)) {
+    ROS_ERROR("%s: Failed to initialize Loop Candidate Generation module. ",
+              ros::this_node::getName().c_str());
+    return EXIT_FAILURE;
+  }
+  ros::spin();
+
+  return EXIT_SUCCESS;
+}
@@ -133,11 +133,13 @@ TEST_F(TestICPComputation, TestThreadedEqualsNonThreaded) {
     for (auto scan : scans){
         icp.KeyedScanCallback(boost::make_shared<pose_graph_msgs::KeyedScan>(scan));
     }
-    icp.InputCallback(boost::make_shared<pose_graph_msgs::LoopCandidateArray>(candidates));
-
+    // With the thread pool the candidates are dispatched on arrival
     auto threaded_start = std::chrono::high_resolution_clock::now();
+    icp.InputCallback(boost::make_shared<pose_graph_msgs::LoopCandidateArray>(candidates));
     icp.ComputeTransforms();
+    icp.WaitForPendingAlignments();
     auto threaded_end = std::chrono::high_resolution_clock::now();
+    EXPECT_FALSE(icp.HasPendingAlignments());
 
     double threadless_time = (threadless_end - threadless_start).count();
     double threadful_time = (threaded_end - threaded_start).count();
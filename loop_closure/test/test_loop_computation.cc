@@ -6,8 +6,11 @@
 #include <geometry_utils/Transform3.h>
 #include <gtest/gtest.h>
 
+#include "loop_closure/AdaptiveBatchSizer.h"
 #include "loop_closure/IcpLoopComputation.h"
+#include "loop_closure/LoopClosureVerifier.h"
 #include "loop_closure/LoopComputation.h"
+#include "loop_closure/SentCandidateSet.h"
 #include "lamp_utils/CommonFunctions.h"
 
 #include "test_artifacts.h"
@@ -27,7 +30,12 @@ class TestLoopComputation : public ::testing::Test {
 
     system("rosparam set b_use_fixed_covariances false");
   }
-  ~TestLoopComputation() {}
+  ~TestLoopComputation() {
+    // Restore the parameters a test changed
+    system(
+        "rosparam load $(rospack find "
+        "loop_closure)/config/laser_parameters.yaml");
+  }
 
   void computeTransforms() { icp_compute_.ComputeTransforms(); }
 
@@ -65,8 +73,126 @@ class TestLoopComputation : public ::testing::Test {
     icp_compute_.GetTeaserInitialAlignment(source, target, tf_out);
   }
 
+  // The motion of the corner between a0 and a100 in the alignment tests
+  static Eigen::Matrix4f CornerMotion() {
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(0, 3) = 1;
+    T(1, 3) = -0.001;
+    return T;
+  }
+
+  // Add keyed scans of a corner at a0 and of the corner moved by T at a100
+  // (not consecutive, the scans around a key are accumulated), with the
+  // given odometry positions
+  void addCornerScans(const Eigen::Matrix4f& T,
+                      const gtsam::Point3& position100,
+                      const gtsam::Point3& position0 = gtsam::Point3(0, 0, 0)) {
+    PointCloud::Ptr corner = GenerateCorner();
+    PointCloud::Ptr corner_moved(new PointCloud);
+    pcl::transformPointCloudWithNormals(*corner, *corner_moved, T, true);
+
+    pose_graph_msgs::KeyedScan::Ptr ks0(new pose_graph_msgs::KeyedScan);
+    *ks0 = PointCloudToKeyedScan(corner, gtsam::Symbol('a', 0));
+    pose_graph_msgs::KeyedScan::Ptr ks100(new pose_graph_msgs::KeyedScan);
+    *ks100 = PointCloudToKeyedScan(corner_moved, gtsam::Symbol('a', 100));
+    keyedScanCallback(ks0);
+    keyedScanCallback(ks100);
+
+    pose0_ = gtsam::Pose3(gtsam::Rot3(), position0);
+    pose100_ = gtsam::Pose3(gtsam::Rot3(), position100);
+    pose_graph_msgs::PoseGraph::Ptr kp(new pose_graph_msgs::PoseGraph);
+    pose_graph_msgs::PoseGraphNode kp0, kp100;
+    kp0.key = gtsam::Symbol('a', 0);
+    kp0.pose = lamp_utils::GtsamToRosMsg(pose0_);
+    kp100.key = gtsam::Symbol('a', 100);
+    kp100.pose = lamp_utils::GtsamToRosMsg(pose100_);
+    kp->nodes.push_back(kp0);
+    kp->nodes.push_back(kp100);
+    keyedPoseCallback(kp);
+  }
+
+  // Align a100 to a0 from the poses given to addCornerScans
+  bool alignCorners() {
+    return performAlignment(gtsam::Symbol('a', 100),
+                            gtsam::Symbol('a', 0),
+                            pose100_,
+                            pose0_,
+                            &tf_,
+                            &covar_);
+  }
+
+  // The internals of icp_compute_ the tests check (the fixture is its friend,
+  // the tests deriving from it are not)
+  ScanWindowCache<IcpLoopComputation::PreparedScan>& scanCache() {
+    return icp_compute_.scan_cache_;
+  }
+  ScanWindowCache<IcpLoopComputation::ScanFeatures>& featureCache() {
+    return icp_compute_.feature_cache_;
+  }
+  ScanWindow windowAround(const gtsam::Key& key) const {
+    return ScanWindow{key,
+                      icp_compute_.sac_num_prev_scans_,
+                      icp_compute_.sac_num_next_scans_};
+  }
+  void useCoarseToFineAlignment() {
+    icp_compute_.icp_alignment_method_ =
+        IcpLoopComputation::IcpAlignmentMethod::COARSE_TO_FINE;
+  }
+  size_t numCoarseToFineLevels() const {
+    return icp_compute_.coarse_to_fine_levels_;
+  }
+  size_t numIcpCreated() const {
+    return icp_compute_.icp_pool_.NumCreated();
+  }
+  size_t numIcpIdle() const {
+    return icp_compute_.icp_pool_.NumIdle();
+  }
+  size_t numAlignments() const {
+    return icp_compute_.num_alignments_;
+  }
+  size_t numCoarseRejections() const {
+    return icp_compute_.num_coarse_rejections_;
+  }
+  size_t numPrecheckRejections() const {
+    return icp_compute_.num_precheck_rejections_;
+  }
+  size_t posesVersion() const {
+    return icp_compute_.poses_version_;
+  }
+  gtsam::Pose3 keyedPose(const gtsam::Key& key) const {
+    return icp_compute_.keyed_poses_.at(key);
+  }
+  void cacheWindow(const ScanWindow& window) {
+    icp_compute_.scan_cache_.Insert(
+        window, boost::make_shared<const IcpLoopComputation::PreparedScan>());
+  }
+
+  // Poses of a0, a1, ... at positions along x
+  void sendPositions(const std::vector<double>& positions) {
+    pose_graph_msgs::PoseGraph::Ptr kp(new pose_graph_msgs::PoseGraph);
+    for (size_t i = 0; i < positions.size(); i++) {
+      pose_graph_msgs::PoseGraphNode node;
+      node.key = gtsam::Symbol('a', i);
+      node.pose = lamp_utils::GtsamToRosMsg(
+          gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(positions[i], 0, 0)));
+      kp->nodes.push_back(node);
+    }
+    keyedPoseCallback(kp);
+  }
+
+  // Positions of n nodes from start, spacing apart
+  static std::vector<double> Spaced(size_t n, double start, double spacing) {
+    std::vector<double> positions;
+    for (size_t i = 0; i < n; i++)
+      positions.push_back(start + i * spacing);
+    return positions;
+  }
+
   IcpLoopComputation icp_compute_;
   double tolerance_ = 1e-5;
+  gtsam::Pose3 pose0_, pose100_;
+  geometry_utils::Transform3 tf_;
+  gtsam::Matrix66 covar_;
 };
 
 TEST_F(TestLoopComputation, TestInitialize) {
@@ -181,6 +307,332 @@ TEST_F(TestLoopComputation, PerformAlignment) {
       gtsam::assert_equal(lamp_utils::ToGtsam(tf_exp), lamp_utils::ToGtsam(tf), 1e-3));
 }
 
+TEST_F(TestLoopComputation, ScanCacheReuse) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  ASSERT_TRUE(scanCache().Enabled());
+
+  addCornerScans(Eigen::Matrix4f::Identity(), gtsam::Point3(0, 0, 0));
+  alignCorners();
+  ScanWindowCacheStats stats = icp_compute_.GetScanCacheStats();
+  EXPECT_EQ(0, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+  EXPECT_EQ(2, stats.size);
+
+  // Second alignment between the same scans reuses both windows
+  alignCorners();
+  stats = icp_compute_.GetScanCacheStats();
+  EXPECT_EQ(2, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+  EXPECT_EQ(2, stats.size);
+
+  // Windows prepared without levels do not fit coarse-to-fine alignment
+  useCoarseToFineAlignment();
+  alignCorners();
+  alignCorners();
+  stats = icp_compute_.GetScanCacheStats();
+  EXPECT_EQ(6, stats.hits);
+  EXPECT_EQ(2, stats.size);
+  const ScanWindow window = windowAround(gtsam::Symbol('a', 0));
+  ASSERT_TRUE(scanCache().Get(window));
+  EXPECT_EQ(numCoarseToFineLevels(), scanCache().Get(window)->levels.size());
+}
+
+TEST_F(TestLoopComputation, FeatureCacheReuse) {
+  system("rosparam set base/icp_initialization_method 3"); // FEATURES
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  ASSERT_TRUE(featureCache().Enabled());
+
+  addCornerScans(Eigen::Matrix4f::Identity(), gtsam::Point3(0, 0, 0));
+  alignCorners();
+  ScanWindowCacheStats stats = icp_compute_.GetFeatureCacheStats();
+  EXPECT_EQ(0, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+  EXPECT_LT(0, stats.bytes);
+
+  // Another candidate between the same windows reuses both
+  alignCorners();
+  stats = icp_compute_.GetFeatureCacheStats();
+  EXPECT_EQ(2, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+}
+
+TEST_F(TestLoopComputation, IcpObjectsArePooled) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+
+  addCornerScans(Eigen::Matrix4f::Identity(), gtsam::Point3(0, 0, 0));
+  for (size_t i = 0; i < 3; i++) {
+    alignCorners();
+  }
+  // Sequential alignments reuse the same ICP object
+  EXPECT_EQ(1, numIcpCreated());
+  EXPECT_EQ(1, numIcpIdle());
+}
+
+TEST_F(TestLoopComputation, CoarseToFineAlignment) {
+  system("rosparam set base/icp_alignment_method 1");
+  system("rosparam set base/icp_lc/coarse_to_fine/leaf_size 0.15");
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+
+  const Eigen::Matrix4f T = CornerMotion();
+  addCornerScans(T, gtsam::Point3(-0.9, 0.1, 0), gtsam::Point3(0, 0, 0.1));
+  EXPECT_TRUE(alignCorners());
+  EXPECT_EQ(1, numAlignments());
+  EXPECT_EQ(0, numCoarseRejections());
+
+  gtsam::Pose3 expected(gtsam::Rot3(), gtsam::Point3(T(0, 3), T(1, 3), T(2, 3)));
+  EXPECT_TRUE(gtsam::assert_equal(expected, lamp_utils::ToGtsam(tf_), 1e-3));
+}
+
+TEST_F(TestLoopComputation, PrecheckRejectsWithoutOverlap) {
+  // Initialize with odometry, which says the scans are 10m apart
+  system("rosparam set base/icp_initialization_method 1");
+  system("rosparam set base/icp_lc/precheck/num_samples 50");
+  system("rosparam set base/icp_lc/precheck/max_distance 1.0");
+  system("rosparam set base/icp_lc/precheck/min_overlap 0.1");
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+
+  addCornerScans(Eigen::Matrix4f::Identity(), gtsam::Point3(10, 0, 0));
+  EXPECT_FALSE(alignCorners());
+  EXPECT_EQ(1, numAlignments());
+  EXPECT_EQ(1, numPrecheckRejections());
+}
+
+TEST_F(TestLoopComputation, DescriptorCandidateGuess) {
+  // Feature initialization, which descriptor candidates skip
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  ASSERT_TRUE(featureCache().Enabled());
+
+  // Odometry is 5 m off, the descriptor match says same place
+  addCornerScans(Eigen::Matrix4f::Identity(), gtsam::Point3(5, 0, 0));
+  pose_graph_msgs::LoopCandidate candidate;
+  candidate.key_from = gtsam::Symbol('a', 100);
+  candidate.key_to = gtsam::Symbol('a', 0);
+  candidate.pose_from = lamp_utils::GtsamToRosMsg(pose100_);
+  candidate.pose_to = lamp_utils::GtsamToRosMsg(pose100_);
+  candidate.type = pose_graph_msgs::LoopCandidate::DESCRIPTOR;
+  pose_graph_msgs::PoseGraphEdge loop_closure;
+  EXPECT_TRUE(icp_compute_.ComputeLoopClosure(candidate, &loop_closure));
+  EXPECT_EQ(0, icp_compute_.GetFeatureCacheStats().misses);
+  EXPECT_TRUE(gtsam::assert_equal(
+      gtsam::Pose3(), lamp_utils::ToGtsam(loop_closure.pose), 1e-3));
+}
+
+TEST_F(TestLoopComputation, MovedPosesInvalidateWindows) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  ASSERT_TRUE(scanCache().Enabled());
+
+  sendPositions(Spaced(7, 0, 1.0));
+  const ScanWindow first{gtsam::Symbol('a', 1), 1, 1};
+  const ScanWindow last{gtsam::Symbol('a', 5), 1, 1};
+  cacheWindow(first);
+  cacheWindow(last);
+
+  // A rigid move leaves the windows as they are
+  sendPositions(Spaced(7, 10, 1.0));
+  EXPECT_EQ(0, posesVersion());
+  EXPECT_TRUE(scanCache().Get(first));
+  EXPECT_TRUE(scanCache().Get(last));
+
+  // A correction spread along the trajectory moves every node, by less than
+  // pose_update/translation_threshold too
+  sendPositions(Spaced(7, 10, 1.02));
+  EXPECT_TRUE(gtsam::assert_equal(
+      gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(13.06, 0, 0)),
+      keyedPose(gtsam::Symbol('a', 3))));
+  EXPECT_EQ(0, posesVersion());
+  sendPositions(Spaced(7, 10, 1.04));
+  EXPECT_EQ(0, posesVersion());
+  EXPECT_TRUE(scanCache().Get(first));
+
+  // The relative poses changed by more than window_translation_tolerance
+  // since the windows were cached, over several updates
+  sendPositions(Spaced(7, 10, 1.06));
+  EXPECT_EQ(1, posesVersion());
+  EXPECT_FALSE(scanCache().Get(first));
+  EXPECT_FALSE(scanCache().Get(last));
+
+  // Only the windows around a node that moved on its own
+  cacheWindow(first);
+  cacheWindow(last);
+  std::vector<double> positions = Spaced(7, 10, 1.06);
+  positions[5] += 0.5;
+  sendPositions(positions);
+  EXPECT_EQ(2, posesVersion());
+  EXPECT_TRUE(scanCache().Get(first));
+  EXPECT_FALSE(scanCache().Get(last));
+}
+
+TEST(TestScanWindowCache, EvictsByMemoryBudget) {
+  ScanWindowCache<int> cache(10, 100);
+  for (gtsam::Key key = 0; key < 3; key++) {
+    cache.Insert(ScanWindow{key, 0, 0}, boost::make_shared<const int>(key), 40);
+  }
+  // The oldest entry is dropped to stay within 100 bytes
+  ScanWindowCacheStats stats = cache.GetStats();
+  EXPECT_EQ(2, stats.size);
+  EXPECT_EQ(80, stats.bytes);
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_FALSE(cache.Get(ScanWindow{0, 0, 0}));
+
+  // Replacing an entry counts its new size
+  cache.Insert(ScanWindow{2, 0, 0}, boost::make_shared<const int>(2), 60);
+  EXPECT_EQ(2, cache.GetStats().size);
+  EXPECT_EQ(100, cache.GetStats().bytes);
+
+  cache.EraseContaining(1);
+  EXPECT_EQ(60, cache.GetStats().bytes);
+  cache.SetMemoryBudget(50);
+  EXPECT_EQ(0, cache.GetStats().size);
+  EXPECT_EQ(0, cache.GetStats().bytes);
+}
+
+TEST(TestAdaptiveBatchSizer, SizesFromThroughput) {
+  AdaptiveBatchParams params;
+  params.enabled = true;
+  params.initial_batch = 50;
+  params.min_batch = 2;
+  params.max_batch = 400;
+  params.target_round_time = 2.0;
+  params.max_backlog_wait = 10.0;
+  params.smoothing = 1.0;
+  AdaptiveBatchSizer sizer;
+  sizer.SetParams(params);
+  EXPECT_EQ(50, sizer.NextBatchSize(1000));
+
+  // 4 workers at 0.1 s per candidate take 40 candidates/s
+  sizer.AddStatus(0, 0, 4, 0.0);
+  sizer.AddStatus(20, 0.1, 4, 1.0);
+  EXPECT_NEAR(20.0, sizer.Throughput(), 1e-9);
+  EXPECT_EQ(80, sizer.NextBatchSize(100));
+  // Draining 1000 at 20/s takes 50 s, five times the allowed wait
+  EXPECT_EQ(400, sizer.NextBatchSize(1000));
+
+  // Slower alignments shrink the batch, down to the minimum
+  sizer.AddStatus(4, 2.0, 4, 2.0);
+  EXPECT_EQ(4, sizer.NextBatchSize(0));
+  sizer.AddStatus(1, 20.0, 1, 3.0);
+  EXPECT_EQ(2, sizer.NextBatchSize(0));
+  EXPECT_EQ(25, sizer.TotalComputed());
+
+  params.enabled = false;
+  sizer.SetParams(params);
+  EXPECT_EQ(50, sizer.NextBatchSize(1000));
+}
+
+TEST(TestSentCandidateSet, InsertAndExpire) {
+  SentCandidateSet sent;
+  EXPECT_FALSE(sent.Contains(1, 2, 0, 0.0));
+  sent.Insert(1, 2, 0, 0.0);
+  EXPECT_TRUE(sent.Contains(1, 2, 0, 0.0));
+  // Direction and type are part of the key
+  EXPECT_FALSE(sent.Contains(2, 1, 0, 0.0));
+  EXPECT_FALSE(sent.Contains(1, 2, 1, 0.0));
+
+  for (uint64_t i = 0; i < 100; i++)
+    sent.Insert(i, i + 1000, 1, 0.0);
+  EXPECT_EQ(101, sent.Size());
+  EXPECT_LE(2 * sent.Size(), sent.Capacity());
+  for (uint64_t i = 0; i < 100; i++)
+    EXPECT_TRUE(sent.Contains(i, i + 1000, 1, 1e6));
+  EXPECT_TRUE(sent.Contains(1, 2, 0, 1e6));
+
+  // With an expiry old entries may be sent again and are dropped on growth
+  sent.SetExpiry(10.0);
+  EXPECT_TRUE(sent.Contains(1, 2, 0, 10.0));
+  EXPECT_FALSE(sent.Contains(1, 2, 0, 11.0));
+  sent.Insert(1, 2, 0, 11.0);
+  EXPECT_TRUE(sent.Contains(1, 2, 0, 20.0));
+  for (uint64_t i = 0; i < 200; i++)
+    sent.Insert(i, i + 5000, 0, 30.0);
+  EXPECT_EQ(200, sent.Size());
+  EXPECT_FALSE(sent.Contains(1, 2, 0, 30.0));
+  EXPECT_TRUE(sent.Contains(199, 5199, 0, 30.0));
+
+  sent.Clear();
+  EXPECT_EQ(0, sent.Size());
+  EXPECT_FALSE(sent.Contains(0, 5000, 0, 30.0));
+}
+
+TEST(TestLoopClosureVerifier, RejectsInconsistentClosures) {
+  // Two robots driving parallel 5 m apart
+  LoopClosureVerifier::Poses poses;
+  for (size_t i = 0; i < 20; i++) {
+    poses[gtsam::Symbol('a', i)] =
+        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, 0, 0));
+    poses[gtsam::Symbol('b', i)] =
+        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, 5, 0));
+  }
+  auto closure = [&](gtsam::Key from, gtsam::Key to, double error) {
+    pose_graph_msgs::PoseGraphEdge edge;
+    edge.key_from = from;
+    edge.key_to = to;
+    edge.pose = lamp_utils::GtsamToRosMsg(
+        poses.at(from).between(poses.at(to)) *
+        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(error, 0, 0)));
+    return edge;
+  };
+
+  std::vector<pose_graph_msgs::PoseGraphEdge> closures;
+  closures.push_back(closure(gtsam::Symbol('a', 2), gtsam::Symbol('b', 2), 0));
+  closures.push_back(
+      closure(gtsam::Symbol('a', 10), gtsam::Symbol('b', 10), 0.2));
+  closures.push_back(closure(gtsam::Symbol('a', 5), gtsam::Symbol('b', 5), 2));
+  closures.push_back(
+      closure(gtsam::Symbol('a', 12), gtsam::Symbol('b', 13), 0));
+  // Not in the estimate yet, cannot be checked
+  closures.push_back(closure(gtsam::Symbol('a', 3), gtsam::Symbol('b', 3), 0));
+  closures.back().key_to = gtsam::Symbol('c', 3);
+
+  LoopClosureVerifierParams params;
+  params.max_translation = 1.0;
+  params.max_rotation = 0.1;
+  params.drift_rate = 0.0;
+  LoopClosureVerifier verifier;
+  verifier.SetParams(params);
+  EXPECT_TRUE(verifier.Consistent(closures[0], closures[1], poses));
+  EXPECT_FALSE(verifier.Consistent(closures[0], closures[2], poses));
+  EXPECT_EQ(std::vector<bool>({true, true, false, true, true}),
+            verifier.Verify(closures, poses));
+
+  // Closures vote only within their robot pair, in either direction. The
+  // reversed b-a closure agrees with the a-b ones and the a-c closure has
+  // nothing to be checked against.
+  for (size_t i = 0; i < 20; i++) {
+    poses[gtsam::Symbol('c', i)] =
+        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, -5, 0));
+  }
+  std::vector<pose_graph_msgs::PoseGraphEdge> pairs(closures.begin(),
+                                                    closures.begin() + 4);
+  pairs.push_back(closure(gtsam::Symbol('b', 7), gtsam::Symbol('a', 7), 0));
+  pairs.push_back(closure(gtsam::Symbol('a', 4), gtsam::Symbol('c', 4), 3));
+  EXPECT_EQ(std::vector<bool>({true, true, false, true, true, true}),
+            verifier.Verify(pairs, poses));
+
+  // Tolerating drift over the 6 m between the closures accepts the offset
+  params.drift_rate = 0.2;
+  verifier.SetParams(params);
+  EXPECT_TRUE(verifier.Consistent(closures[0], closures[2], poses));
+
+  // Against odometry, also rejected without anything to vote with
+  params.drift_rate = 0.0;
+  params.odom_max_translation = 1.0;
+  params.odom_max_rotation = 0.1;
+  verifier.SetParams(params);
+  EXPECT_EQ(std::vector<bool>({true, false}),
+            verifier.Verify({closures[0], closures[2]}, poses));
+  const LoopClosureVerifierStats stats = verifier.GetStats();
+  EXPECT_EQ(12, stats.verified);
+  EXPECT_EQ(1, stats.rejected_odometry);
+  EXPECT_EQ(2, stats.rejected_inconsistent);
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
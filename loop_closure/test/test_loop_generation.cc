@@ -4,9 +4,13 @@
  */
 
 #include <gtest/gtest.h>
+#include <random>
+#include <set>
 
+#include "loop_closure/KeyedPositionIndex.h"
 #include "loop_closure/LoopGeneration.h"
 #include "loop_closure/ProximityLoopGeneration.h"
+#include "loop_closure/ScanContext.h"
 
 namespace lamp_loop_closure {
 class TestLoopGeneration : public ::testing::Test {
@@ -164,6 +168,256 @@ TEST_F(TestLoopGeneration, TestAdaptiveRadius) {
   EXPECT_EQ(1, candidates.size());
 }
 
+TEST_F(TestLoopGeneration, TestPoseUpdateRegeneratesCandidates) {
+  ros::NodeHandle nh;
+  bool init = proximity_lc_.Initialize(nh);
+  pose_graph_msgs::PoseGraph::Ptr graph_msg(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode node1, node2;
+  node1.key = gtsam::Symbol('a', 0);
+  node2.key = gtsam::Symbol('b', 0);
+  node1.pose.orientation.w = 1;
+  node2.pose.orientation.w = 1;
+  node2.pose.position.x = 100;
+  graph_msg->nodes.push_back(node1);
+  graph_msg->nodes.push_back(node2);
+  keyedPoseCallback(graph_msg);
+  EXPECT_EQ(0, getCandidates().size());
+
+  // Optimization brings b0 next to a0
+  graph_msg->nodes[1].pose.position.x = 3;
+  keyedPoseCallback(graph_msg);
+  std::vector<pose_graph_msgs::LoopCandidate> candidates = getCandidates();
+  ASSERT_EQ(1, candidates.size());
+  EXPECT_EQ(gtsam::Symbol('b', 0), candidates[0].key_from);
+  EXPECT_EQ(gtsam::Symbol('a', 0), candidates[0].key_to);
+  EXPECT_NEAR(3, distanceBetweenKeys(node1.key, node2.key), 1e-9);
+
+  // Moving again does not propose the same pair twice
+  graph_msg->nodes[1].pose.position.x = 6;
+  keyedPoseCallback(graph_msg);
+  EXPECT_EQ(1, getCandidates().size());
+}
+
+TEST_F(TestLoopGeneration, TestOlderNodeMoves) {
+  ros::NodeHandle nh;
+  ros::param::set("base/proximity_threshold_min", 5.0);
+  ros::param::set("base/proximity_threshold_max", 80.0);
+  ros::param::set("base/increase_rate", 0.2);
+  ros::param::set("base/b_take_n_closest", false);
+  bool init = proximity_lc_.Initialize(nh);
+  pose_graph_msgs::PoseGraph::Ptr graph_msg(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode node0, node50;
+  node0.key = gtsam::Symbol('a', 0);
+  node50.key = gtsam::Symbol('a', 50);
+  node0.pose.orientation.w = 1;
+  node50.pose.orientation.w = 1;
+  node50.pose.position.x = 30;
+  graph_msg->nodes.push_back(node0);
+  graph_msg->nodes.push_back(node50);
+  keyedPoseCallback(graph_msg);
+  // 50 keys apart gives a radius of 10
+  EXPECT_EQ(0, getCandidates().size());
+
+  // a0 is now searched around, still outside the radius of a50
+  graph_msg->nodes[0].pose.position.x = 15;
+  keyedPoseCallback(graph_msg);
+  EXPECT_EQ(0, getCandidates().size());
+
+  graph_msg->nodes[0].pose.position.x = 25;
+  keyedPoseCallback(graph_msg);
+  std::vector<pose_graph_msgs::LoopCandidate> candidates = getCandidates();
+  ASSERT_EQ(1, candidates.size());
+  EXPECT_EQ(gtsam::Symbol('a', 0), candidates[0].key_from);
+  EXPECT_EQ(gtsam::Symbol('a', 50), candidates[0].key_to);
+}
+
+TEST_F(TestLoopGeneration, TestProposedPairsExpire) {
+  ros::NodeHandle nh;
+  ros::param::set("base/pose_update/proposed_expiry", 0.1);
+  bool init = proximity_lc_.Initialize(nh);
+  pose_graph_msgs::PoseGraph::Ptr graph_msg(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode node1, node2;
+  node1.key = gtsam::Symbol('a', 0);
+  node2.key = gtsam::Symbol('b', 0);
+  node1.pose.orientation.w = 1;
+  node2.pose.orientation.w = 1;
+  node2.pose.position.x = 3;
+  graph_msg->nodes.push_back(node1);
+  graph_msg->nodes.push_back(node2);
+  keyedPoseCallback(graph_msg);
+  EXPECT_EQ(1, getCandidates().size());
+
+  // Proposed again once the pair expired
+  ros::WallDuration(0.2).sleep();
+  graph_msg->nodes[1].pose.position.x = 6;
+  keyedPoseCallback(graph_msg);
+  EXPECT_EQ(2, getCandidates().size());
+}
+
+TEST(TestKeyedPositionIndex, MatchesLinearSearch) {
+  KeyedPositionIndex index(5.0);
+  std::map<gtsam::Key, Eigen::Vector3d> positions;
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> coordinate(-50.0, 50.0);
+  for (size_t i = 0; i < 2000; i++) {
+    const gtsam::Key key = gtsam::Symbol('a' + i % 3, i);
+    positions[key] =
+        Eigen::Vector3d(coordinate(rng), coordinate(rng), coordinate(rng));
+    index.Insert(key, positions[key]);
+  }
+  // Move some nodes around and drop others
+  for (size_t i = 0; i < 2000; i += 7) {
+    const gtsam::Key key = gtsam::Symbol('a' + i % 3, i);
+    positions[key] += Eigen::Vector3d(8.0, -3.0, 1.0);
+    index.Insert(key, positions[key]);
+  }
+  for (size_t i = 3; i < 2000; i += 11) {
+    const gtsam::Key key = gtsam::Symbol('a' + i % 3, i);
+    positions.erase(key);
+    EXPECT_TRUE(index.Erase(key));
+  }
+  ASSERT_EQ(positions.size(), index.Size());
+
+  for (size_t q = 0; q < 50; q++) {
+    const Eigen::Vector3d query(coordinate(rng), coordinate(rng), 0);
+    const double radius = 2.0 + q % 10;
+    std::vector<gtsam::Key> expected;
+    for (const auto& entry : positions) {
+      if ((entry.second - query).norm() <= radius)
+        expected.push_back(entry.first);
+    }
+    const auto result = index.RadiusSearch(query, radius);
+    ASSERT_EQ(expected.size(), result.size());
+    for (size_t i = 0; i < result.size(); i++) {
+      EXPECT_EQ(expected[i], result[i].first);
+      EXPECT_NEAR((positions[expected[i]] - query).norm(),
+                  result[i].second,
+                  1e-9);
+    }
+  }
+}
+
+TEST(TestScanContext, RecognizesRotatedPlace) {
+  // Random boxes around the sensor, seen again after a yaw
+  std::mt19937 generator(7);
+  std::uniform_real_distribution<double> position(-40, 40);
+  std::uniform_real_distribution<double> size(0.5, 8);
+  auto make_place = [&]() {
+    PointCloud cloud;
+    for (size_t b = 0; b < 40; b++) {
+      const double x = position(generator);
+      const double y = position(generator);
+      const double height = size(generator);
+      for (double dz = 0; dz <= height; dz += 0.5) {
+        Point point;
+        point.x = x;
+        point.y = y;
+        point.z = dz - 1.5;
+        cloud.points.push_back(point);
+      }
+    }
+    return cloud;
+  };
+  const double yaw = 0.7;
+  auto rotate = [&](const PointCloud& cloud) {
+    PointCloud rotated;
+    for (Point point : cloud.points) {
+      const double x = point.x, y = point.y;
+      point.x = std::cos(yaw) * x + std::sin(yaw) * y;
+      point.y = -std::sin(yaw) * x + std::cos(yaw) * y;
+      rotated.points.push_back(point);
+    }
+    return rotated;
+  };
+
+  ScanContextParams params;
+  const PointCloud place = make_place();
+  const ScanContext context(params, place);
+  const ScanContext rotated(params, rotate(place));
+  const ScanContext other(params, make_place());
+  EXPECT_EQ(params.num_rings, context.Descriptor().rows());
+  EXPECT_EQ(params.num_sectors, context.Descriptor().cols());
+  EXPECT_TRUE(context.RingKey().isApprox(rotated.RingKey(), 0.1));
+
+  int shift;
+  const double same_distance = context.Distance(rotated, &shift);
+  // Not zero, the yaw is not a whole number of sectors
+  EXPECT_LT(same_distance, 0.2);
+  EXPECT_NEAR(yaw, context.ShiftToYaw(shift), 2 * M_PI / params.num_sectors);
+  EXPECT_GT(context.Distance(other, &shift), 2 * same_distance);
+
+  ScanContextIndex index;
+  index.Insert(gtsam::Symbol('a', 0), std::make_shared<ScanContext>(rotated));
+  for (size_t i = 1; i < 20; i++) {
+    index.Insert(gtsam::Symbol('a', i),
+                 std::make_shared<ScanContext>(params, make_place()));
+  }
+  auto accept_all = [](const gtsam::Key&) { return true; };
+  std::vector<ScanContextMatch> matches =
+      index.Query(context, 5, 2, 1.0, accept_all);
+  ASSERT_EQ(2, matches.size());
+  EXPECT_EQ(gtsam::Symbol('a', 0), matches[0].key);
+  EXPECT_NEAR(same_distance, matches[0].distance, 1e-9);
+  EXPECT_LE(matches[0].distance, matches[1].distance);
+  EXPECT_EQ(1, index.Query(context, 5, 2, 0.3, accept_all).size());
+  EXPECT_TRUE(index
+                  .Query(context,
+                         5,
+                         2,
+                         0.3,
+                         [](const gtsam::Key& key) {
+                           return key != gtsam::Symbol('a', 0);
+                         })
+                  .empty());
+}
+
+TEST(TestScanContext, TreeQueryMatchesLinearSearch) {
+  // Random boxes around the sensor, one place per key
+  std::mt19937 generator(11);
+  std::uniform_real_distribution<double> position(-40, 40);
+  std::uniform_real_distribution<double> size(0.5, 8);
+  ScanContextParams params;
+  std::vector<ScanContext::ConstPtr> contexts;
+  ScanContextIndex index;
+  for (size_t i = 0; i < 380; i++) {
+    PointCloud cloud;
+    for (size_t b = 0; b < 10; b++) {
+      Point point;
+      point.x = position(generator);
+      point.y = position(generator);
+      point.z = size(generator);
+      cloud.points.push_back(point);
+    }
+    contexts.push_back(std::make_shared<ScanContext>(params, cloud));
+    index.Insert(gtsam::Symbol('a', i), contexts.back());
+  }
+  // Trees of 200, 100 and 50 scans, the last ones are not in a tree yet
+  EXPECT_EQ(350, index.NumIndexed());
+
+  auto accept_odd = [](const gtsam::Key& key) {
+    return gtsam::Symbol(key).index() % 2 == 1;
+  };
+  for (size_t q = 0; q < 20; q++) {
+    const ScanContext& query = *contexts[q * 11];
+    // Closest odd ring keys by brute force
+    std::vector<std::pair<float, gtsam::Key>> expected;
+    for (size_t i = 1; i < contexts.size(); i += 2) {
+      expected.emplace_back(
+          (contexts[i]->RingKey() - query.RingKey()).squaredNorm(),
+          gtsam::Symbol('a', i));
+    }
+    std::sort(expected.begin(), expected.end());
+    std::set<gtsam::Key> expected_keys;
+    for (size_t c = 0; c < 10; c++)
+      expected_keys.insert(expected[c].second);
+
+    std::set<gtsam::Key> found_keys;
+    for (const auto& match : index.Query(query, 10, 10, 1.0, accept_odd))
+      found_keys.insert(match.key);
+    EXPECT_EQ(expected_keys, found_keys);
+  }
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
@@ -6,6 +6,8 @@
 #include <gtest/gtest.h>
 
 #include "loop_closure/GenericLoopPrioritization.h"
+#include "loop_closure/LoopCandidateHeap.h"
+#include "loop_closure/LoopCandidateScorer.h"
 #include "loop_closure/LoopPrioritization.h"
 #include "loop_closure/ObservabilityLoopPrioritization.h"
 
@@ -187,6 +189,114 @@ TEST_F(TestLoopPrioritization, TestPrioritization) {
   //   EXPECT_EQ(gtsam::Symbol('a', 1), observ_candidates.candidates[1].key_to);
 }
 
+TEST(TestLoopCandidateHeap, OrderAndExpiry) {
+  LoopCandidateHeap heap;
+  const double scores[] = {0.5, 1.5, 1.0, 1.5, 0.2};
+  for (size_t i = 0; i < 5; i++) {
+    pose_graph_msgs::LoopCandidate candidate;
+    candidate.key_to = gtsam::Symbol('a', i);
+    candidate.header.stamp = ros::Time(10 + i);
+    heap.Push(candidate, scores[i], ros::Time(20));
+  }
+  EXPECT_EQ(5, heap.Size());
+
+  // Drops a0 and a1 regardless of their place in the heap
+  EXPECT_EQ(2, heap.RemoveStampedBefore(ros::Time(11)));
+  EXPECT_EQ(3, heap.Size());
+  EXPECT_EQ(gtsam::Symbol('a', 3), heap.Pop(ros::Time(22)).key_to);
+  EXPECT_EQ(gtsam::Symbol('a', 2), heap.Pop(ros::Time(24)).key_to);
+  EXPECT_EQ(gtsam::Symbol('a', 4), heap.Pop(ros::Time(24)).key_to);
+  EXPECT_TRUE(heap.Empty());
+
+  LoopCandidateHeapStats stats = heap.GetStats();
+  EXPECT_EQ(0, stats.depth);
+  EXPECT_EQ(5, stats.pushed);
+  EXPECT_EQ(3, stats.popped);
+  EXPECT_EQ(2, stats.expired);
+  EXPECT_NEAR(10.0 / 3.0, stats.MeanTimeInQueue(), 1e-9);
+  EXPECT_NEAR(4.0, stats.max_time_in_queue, 1e-9);
+}
+
+TEST(TestLoopScoringEngine, WeightedScorers) {
+  std::unordered_map<gtsam::Key, double> keyed_observability;
+  keyed_observability[gtsam::Symbol('a', 0)] = 0.5;
+  keyed_observability[gtsam::Symbol('b', 0)] = 0.25;
+  auto time_since_closure = std::make_shared<TimeSinceClosureScorer>(10);
+
+  LoopScoringEngine engine;
+  engine.AddScorer(std::make_shared<ObservabilityScorer>(&keyed_observability),
+                   2.0);
+  engine.AddScorer(std::make_shared<DistanceScorer>(5), 1.0);
+  engine.AddScorer(time_since_closure, 1.0);
+  // Left out
+  engine.AddScorer(std::make_shared<DistanceScorer>(1), 0.0);
+  EXPECT_EQ(3, engine.NumScorers());
+
+  pose_graph_msgs::LoopCandidate candidate;
+  candidate.key_from = gtsam::Symbol('a', 0);
+  candidate.key_to = gtsam::Symbol('b', 0);
+  candidate.pose_to.position.x = 5;
+  candidate.header.stamp = ros::Time(100);
+
+  // 2 * 0.75 + 5 / (5 + 5) + 1 (no closures yet)
+  double score;
+  ASSERT_TRUE(engine.Score(candidate, &score));
+  EXPECT_NEAR(3.0, score, 1e-9);
+
+  // Robot a closed 2s ago, robot b never did, which keeps the maximum at 1
+  time_since_closure->AddLoopClosure(
+      gtsam::Symbol('a', 1), gtsam::Symbol('a', 2), ros::Time(98));
+  ASSERT_TRUE(engine.Score(candidate, &score));
+  EXPECT_NEAR(3.0, score, 1e-9);
+  time_since_closure->AddLoopClosure(
+      gtsam::Symbol('b', 1), gtsam::Symbol('a', 3), ros::Time(96));
+  ASSERT_TRUE(engine.Score(candidate, &score));
+  EXPECT_NEAR(2.4, score, 1e-9);
+
+  // No observability for the scan yet
+  candidate.key_to = gtsam::Symbol('b', 1);
+  EXPECT_FALSE(engine.Score(candidate, &score));
+}
+
+TEST(TestLoopScoringEngine, UncertaintyScorer) {
+  UncertaintyScorer scorer(1.0);
+  pose_graph_msgs::PoseGraph graph;
+  pose_graph_msgs::PoseGraphNode node;
+  node.key = gtsam::Symbol('a', 0);
+  node.covariance[21] = node.covariance[28] = node.covariance[35] = 0.1;
+  graph.nodes.push_back(node);
+  node.key = gtsam::Symbol('a', 5);
+  node.covariance[21] = node.covariance[28] = node.covariance[35] = 0.2;
+  graph.nodes.push_back(node);
+  // Marginal not available
+  node.key = gtsam::Symbol('a', 6);
+  node.covariance.assign(0);
+  graph.nodes.push_back(node);
+  scorer.Update(graph);
+  EXPECT_EQ(2, scorer.NumNodes());
+
+  pose_graph_msgs::LoopCandidate candidate;
+  candidate.key_from = gtsam::Symbol('a', 5);
+  candidate.key_to = gtsam::Symbol('a', 0);
+  double score;
+  ASSERT_TRUE(scorer.Score(candidate, &score));
+  EXPECT_NEAR(0.9 / 1.9, score, 1e-9);
+
+  // Tighter nodes after optimization score lower
+  graph.nodes.resize(1);
+  graph.nodes[0].covariance.assign(0);
+  graph.nodes[0].covariance[35] = 0.01;
+  scorer.Update(graph);
+  double tighter_score;
+  ASSERT_TRUE(scorer.Score(candidate, &tighter_score));
+  EXPECT_LT(tighter_score, score);
+
+  // Not optimized yet
+  candidate.key_to = gtsam::Symbol('a', 6);
+  ASSERT_TRUE(scorer.Score(candidate, &score));
+  EXPECT_EQ(1.0, score);
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
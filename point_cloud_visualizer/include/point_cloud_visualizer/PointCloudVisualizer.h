@@ -54,6 +54,7 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <lamp_utils/ColorHandling.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/KeyedScanStore.h>
 #include <lamp_utils/PrefixHandling.h>
 
 #include <tf_conversions/tf_eigen.h>
@@ -120,6 +121,12 @@ public:
   // Calls LoadParameters and RegisterCallbacks. Fails on failure of either.
   bool Initialize(const ros::NodeHandle& n);
 
+  // Take decoded keyed scans from a store shared with the other consumers in
+  // this process instead of decoding them here
+  void SetKeyedScanStore(const lamp_utils::KeyedScanStore::Ptr& store) {
+    keyed_scan_store_ = store;
+  }
+
   // Update the point cloud by appending an incremental point cloud.
   bool InsertPointCloud(const PointCloud& points);
 
@@ -128,6 +135,7 @@ public:
 
 private:
   PoseGraph pose_graph_;
+  lamp_utils::KeyedScanStore::Ptr keyed_scan_store_;
   // Node initialization.
   bool LoadParameters(const ros::NodeHandle& n);
 
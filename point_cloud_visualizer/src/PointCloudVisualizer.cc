@@ -180,8 +180,11 @@ void PointCloudVisualizer::KeyedScanCallback(
     return;
   }
 
-  PointCloud::Ptr scan(new PointCloud);
-  pcl::fromROSMsg(msg->scan, *scan);
+  PointCloudConstPtr scan;
+  if (keyed_scan_store_)
+    scan = keyed_scan_store_->Add(msg);
+  else
+    scan = lamp_utils::KeyedScanStore::Decode(*msg);
 
   // The first key should be treated differently; we need to use the laser
   // scan's timestamp for pose zero.